@@ -21,7 +21,9 @@ sys.setrecursionlimit(10000)
 class LogParser:
 
     def __init__(self, in_dir='./', out_dir='./result/', log_format=None, tau=0.5, keep_para=True, text_max_length=4096,
-                 log_main=None, *, updated_templates=False):
+                 log_main=None, *, updated_templates=False, keep_ids=0, id_window=0,
+                 mask_rules=None, max_clusters=0, hot_clusters=0, columnar=False, time_buckets=0,
+                 time_fields=('Date', 'Time')):
         """
         Class for parsing log files.
         :param in_dir: directory containing the log files to be processed.
@@ -38,6 +40,23 @@ class LogParser:
         :param log_main: name of the main log to output to.
         :param updated_templates: whether to update the templates in *_main_structured.csv every time (True)
             or simply append the new parsed result without updating the old templates (default=False).
+        :param keep_ids: max number of line ids kept in memory for each template (0 means unbounded).
+            Older ids are spilled to logIds.seg inside out_dir.
+        :param id_window: only keep in memory the ids of the last id_window lines (0 means unbounded).
+        :param mask_rules: list of masking rules applied to the content before parsing.
+            Builtins: 'ip', 'hex', 'blk', 'num'; any other entry is a glob ('*', '?', '#' for digits).
+            Ex: ['ip', 'blk', 'num', 'job_#_#']
+        :param max_clusters: once there are more templates than this, near-duplicate templates are
+            merged in small steps while parsing (0 disables).
+        :param hot_clusters: max number of templates kept in memory (0 means unbounded). The least
+            recently seen ones are evicted to coldTemplates.store inside out_dir and promoted back on a match.
+        :param columnar: write *_structured.cols (line id, cluster id and parameter columns, see
+            CPlusSpell.ColumnarReader) instead of *_structured.csv. Parameters are then extracted natively
+            and the returned dataframe has no ParameterList.
+        :param time_buckets: count the lines of every template by buckets of this many seconds while parsing
+            (0 disables). Closed buckets are appended to eventCounts.csv inside out_dir as
+            Time (bucket start, epoch seconds), EventId, Cluster, Count; see flush_counts().
+        :param time_fields: header fields holding the time of a line, read as yyMMdd or yyyyMMdd then HHmmss.
 
         """
         # Attributes in priority order (from most necessary to optional)
@@ -55,6 +74,14 @@ class LogParser:
         self.main_log_name = log_main
         self.df_event = None
         self.updated_templates = updated_templates
+        self.keep_ids = keep_ids
+        self.id_window = id_window
+        self.mask_rules = mask_rules or []
+        self.max_clusters = max_clusters
+        self.hot_clusters = hot_clusters
+        self.columnar = columnar
+        self.time_buckets = time_buckets
+        self.time_fields = list(time_fields)
 
         self.parser = None
 
@@ -75,6 +102,28 @@ class LogParser:
         else:
             self.parser = cp.Parser(self.tau)
 
+        if self.keep_ids or self.id_window:
+            if not os.path.exists(self.save_path):
+                os.makedirs(self.save_path)
+            # The segment only belongs to the clusters it was written with: start over unless they were loaded.
+            self.parser.setRetention(self.keep_ids, self.id_window, os.path.join(self.save_path, 'logIds.seg'),
+                                     fresh=self.log_cluster_lines is None)
+        if self.mask_rules:
+            self.parser.setMasking(self.mask_rules)
+        if self.max_clusters:
+            self.parser.setConsolidation(self.max_clusters)
+        if self.hot_clusters:
+            if not os.path.exists(self.save_path):
+                os.makedirs(self.save_path)
+            # Like the segment, the store only belongs to the clusters it was evicted from.
+            self.parser.setEviction(self.hot_clusters, os.path.join(self.save_path, 'coldTemplates.store'),
+                                    fresh=self.log_cluster_lines is None)
+        if self.time_buckets:
+            if not os.path.exists(self.save_path):
+                os.makedirs(self.save_path)
+            self.parser.setTimeBuckets(self.time_buckets, 60, os.path.join(self.save_path, 'eventCounts.csv'),
+                                       self.time_fields)
+
     def set_last_line_id(self):
         for logClust in self.log_cluster_lines:
             max_line = max(logClust.logIDL, default=0)
@@ -142,7 +191,10 @@ class LogParser:
         """
         t0 = datetime.now()
         self.df_log['LineId'] = self.df_log['LineId'].apply(lambda x: x + self.last_line_id)
-        self.log_cluster_lines = self.parser.parse(self.df_log["Content"], self.last_line_id)
+        times = []
+        if self.time_buckets:
+            times = self.df_log[self.time_fields].astype(str).agg(' '.join, axis=1).tolist()
+        self.log_cluster_lines = self.parser.parse(self.df_log["Content"], self.last_line_id, times)
         t1 = datetime.now()
 
         logging.info('Parsing done. [Time taken: {!s}]'.format(t1 - t0))
@@ -152,7 +204,10 @@ class LogParser:
         if not os.path.exists(self.save_path):
             os.makedirs(self.save_path)
         if persistence:
-            self.output_result()
+            if self.columnar:
+                self.output_columnar()
+            else:
+                self.output_result()
 
         # Update last_line for next execution if called in batch
         self.set_last_line_id()
@@ -180,21 +235,23 @@ class LogParser:
         ids = [0] * self.df_log.shape[0]
         self.df_event = []
 
-        for logClust in self.log_cluster_lines:
+        retention = self.keep_ids or self.id_window
+        for idx, logClust in enumerate(self.log_cluster_lines):
             template_str = ' '.join(logClust.logTemplate)
             eid = hashlib.md5(template_str.encode('utf-8')).hexdigest()[0:8]
-            for logId in logClust.logIDL:
+            log_ids = self.parser.lineIds(idx) if retention else logClust.logIDL
+            for logId in log_ids:
                 if logId <= self.last_line_id:
                     continue
                 templates[logId - self.last_line_id - 1] = template_str
                 ids[logId - self.last_line_id - 1] = eid
-            self.df_event.append([eid, template_str, len(logClust.logIDL)])
+            self.df_event.append([eid, template_str, len(log_ids)])
 
         self.df_event = pd.DataFrame(self.df_event, columns=['EventId', 'EventTemplate', 'Occurrences'])
 
         self.df_log['EventId'] = ids
         self.df_log['EventTemplate'] = templates
-        if self.keep_para:
+        if self.keep_para and not self.columnar:
             self.df_log["ParameterList"] = self.df_log.apply(self.get_parameter_list, axis=1)
         logging.info('Output parse file')
 
@@ -252,10 +309,35 @@ class LogParser:
         self.df_log.to_csv(os.path.join(self.save_path, self.log_name + '_structured.csv'), index=False)
         self.df_event.to_csv(os.path.join(self.save_path, self.log_name + '_templates.csv'), index=False)
 
+    def output_columnar(self):
+        content = list(self.df_log['Content'])
+        if self.main_log_name:
+            main_structured_path = os.path.join(self.save_path, self.main_log_name + '_main_structured.cols')
+            # Only the footer is read to find where the main output stops.
+            skip = max(0, cp.lastLineId(main_structured_path) - self.last_line_id) \
+                if os.path.isfile(main_structured_path) else 0
+            if skip < len(content):
+                self.parser.writeColumns(main_structured_path, content[skip:], self.last_line_id + skip,
+                                         self.keep_para)
+            self.df_event.to_csv(os.path.join(self.save_path, self.main_log_name + '_main_templates.csv'),
+                                 index=False)
+
+        structured_path = os.path.join(self.save_path, self.log_name + '_structured.cols')
+        if os.path.isfile(structured_path):
+            os.remove(structured_path)
+        self.parser.writeColumns(structured_path, content, self.last_line_id, self.keep_para)
+        self.df_event.to_csv(os.path.join(self.save_path, self.log_name + '_templates.csv'), index=False)
+
     def purgeIDs(self):
         self.parser.purgeIDs()
         self.log_cluster_lines = self.parser.logClust
 
+    def flush_counts(self):
+        """ Writes the time buckets still open to eventCounts.csv, at the end of the input
+        """
+        if self.time_buckets:
+            self.parser.flushCounts()
+
     @staticmethod
     def start_timer(handler):
         if os.name != 'nt':
@@ -0,0 +1,110 @@
+import socket
+import struct
+from collections import namedtuple
+
+# One answered line: line_id is 0 and cluster -1 for lines that do not fit the log format.
+LineResult = namedtuple('LineResult', ['line_id', 'cluster', 'version', 'template', 'parameters'])
+
+
+class DaemonClient:
+
+    def __init__(self, socket_path):
+        """
+        Client of a parse daemon started with `cspell --format FORMAT --serve SOCKET`.
+        Frames are answered in order, so several send() calls may precede the matching receive() calls.
+        :param socket_path: path of the UNIX socket the daemon listens on.
+        """
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.sock.connect(socket_path)
+        self.pending = []
+
+    def close(self):
+        self.sock.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    def send(self, lines, parameters=False, templates=False):
+        flags = (1 if parameters else 0) | (2 if templates else 0)
+        body = [b'L', struct.pack('<BI', flags, len(lines))]
+        for line in lines:
+            data = line.encode('utf-8')
+            body.append(struct.pack('<I', len(data)))
+            body.append(data)
+        self._send_frame(b''.join(body))
+        self.pending.append(flags)
+
+    def receive(self):
+        flags = self.pending.pop(0)
+        kind, data = self._receive_frame()
+        if kind != b'R':
+            raise RuntimeError('Unexpected reply ' + repr(kind))
+        (count,) = struct.unpack_from('<I', data)
+        pos = 4
+        res = []
+        for _ in range(count):
+            line_id, cluster, version = struct.unpack_from('<iiI', data, pos)
+            pos += 12
+            template = None
+            if flags & 2:
+                template, pos = self._string(data, pos)
+            params = None
+            if flags & 1:
+                (n,) = struct.unpack_from('<I', data, pos)
+                pos += 4
+                params = []
+                for _ in range(n):
+                    value, pos = self._string(data, pos)
+                    params.append(value)
+            res.append(LineResult(line_id, cluster, version, template, params))
+        return res
+
+    def parse(self, lines, parameters=False, templates=False):
+        """
+        Classifies raw log lines and returns a LineResult per line.
+        """
+        self.send(lines, parameters, templates)
+        return self.receive()
+
+    def checkpoint(self):
+        """
+        Saves the daemon state now; False if it was started without --state.
+        """
+        if self.pending:
+            raise RuntimeError('Receive the pending replies first')
+        self._send_frame(b'C')
+        kind, data = self._receive_frame()
+        if kind != b'C':
+            raise RuntimeError('Unexpected reply ' + repr(kind))
+        return data[0] == 1
+
+    def _send_frame(self, body):
+        self.sock.sendall(struct.pack('<I', len(body)) + body)
+
+    def _receive_frame(self):
+        (size,) = struct.unpack('<I', self._read(4))
+        frame = self._read(size)
+        kind, data = frame[:1], frame[1:]
+        if kind == b'E':
+            message, _ = self._string(data, 0)
+            raise RuntimeError('Daemon error: ' + message)
+        return kind, data
+
+    def _read(self, n):
+        chunks = []
+        while n > 0:
+            chunk = self.sock.recv(n)
+            if not chunk:
+                raise ConnectionError('Daemon closed the connection')
+            chunks.append(chunk)
+            n -= len(chunk)
+        return b''.join(chunks)
+
+    @staticmethod
+    def _string(data, pos):
+        (n,) = struct.unpack_from('<I', data, pos)
+        pos += 4
+        return data[pos:pos + n].decode('utf-8', errors='replace'), pos + n
@@ -1,7 +1,10 @@
 import unittest
+import hashlib
 import os
+import tempfile
 import pandas as pd
 import CPlusSpell as cp
+from cspell import LogParser
 
 THIS_DIR = os.path.dirname(os.path.abspath(__file__))
 LOG_FORMAT = '<Date> <Time> <Pid> <Level> <Component>: <Content>'
@@ -66,6 +69,267 @@ class TestLogParser(unittest.TestCase):
         new_template = self.cpParser.getTemplate(lcs, seq)
         self.assertListEqual(new_template, expected_template)
 
+    def test_retention(self):
+        lines = ['PacketResponder 1 for block blk_38865049064139660 terminating'] * 10
+
+        with tempfile.TemporaryDirectory() as tmp_dir:
+            parser = cp.Parser(.7)
+            parser.setRetention(2, 0, os.path.join(tmp_dir, 'logIds.seg'))
+            clusters = parser.parse(lines, 0)
+            self.assertListEqual(clusters[0].logIDL, [9, 10])
+            self.assertListEqual(parser.lineIds(0), list(range(1, 11)))
+
+            reloaded = cp.Parser(clusters, parser.trieRoot, .7)
+            reloaded.setRetention(2, 0, os.path.join(tmp_dir, 'logIds.seg'))
+            self.assertListEqual(reloaded.lineIds(0), list(range(1, 11)))
+
+            # A new parser does not inherit the line IDs of the previous run.
+            rerun = cp.Parser(.7)
+            rerun.setRetention(2, 0, os.path.join(tmp_dir, 'logIds.seg'), fresh=True)
+            rerun.parse(lines, 0)
+            self.assertListEqual(rerun.lineIds(0), list(range(1, 11)))
+
+    def test_retention_rerun(self):
+        lines = ['081109 203615 148 INFO dfs.DataNode$PacketResponder: '
+                 'PacketResponder 1 for block blk_38865049064139660 terminating\n'] * 40
+        log_format = '<Date> <Time> <Pid> <Level> <Component>: <Content>'
+        with tempfile.TemporaryDirectory() as tmp_dir:
+            for _ in range(2):
+                # Without the pickled state of the previous run, as on a first run into out_dir.
+                for state in ('rootNode.pkl', 'logCluL.pkl'):
+                    if os.path.exists(os.path.join(tmp_dir, state)):
+                        os.remove(os.path.join(tmp_dir, state))
+                log_parser = LogParser(out_dir=tmp_dir, log_format=log_format, keep_ids=2, log_main='main')
+                log_parser.parse_lines(lines)
+                self.assertEqual(len(log_parser.parser.lineIds(0)), 40)
+
+    def test_masking(self):
+        self.cpParser.setMasking(['ip', 'blk', 'num'])
+        clusters = self.cpParser.parse(list(DF_MOCK['Content']), 0)
+        expected_template = ['Receiving', 'block', '<*>', 'src', '<*>', '<*>', 'dest', '<*>', '<*>']
+
+        self.assertEqual(len(clusters), 2)
+        self.assertListEqual(clusters[0].logTemplate, expected_template)
+        self.assertListEqual(clusters[0].logIDL, [1, 3])
+
+    def test_consolidate(self):
+        parser = cp.Parser(.7)
+        parser.addTemplate('PacketResponder 1 for block <*> terminating')
+        parser.addTemplate('PacketResponder 2 for block <*> terminating')
+
+        self.assertListEqual(parser.consolidate(), [0, 0])
+        self.assertEqual(len(parser.logClust), 1)
+        self.assertListEqual(parser.logClust[0].logTemplate,
+                             ['PacketResponder', '<*>', 'for', 'block', '<*>', 'terminating'])
+        self.assertListEqual(helper(parser.trieRoot), ['PacketResponder', 'for', 'block', 'terminating'])
+
+    def test_addTemplates(self):
+        templates = ['PacketResponder <*> for block <*> terminating',
+                     'Receiving block <*> src <*> dest <*>',
+                     'PacketResponder <*> for block <*> terminating',
+                     'Received block <*> of size <*> from <*>']
+        parser = cp.Parser(.7)
+        parser.addTemplate(templates[1])
+        self.assertEqual(parser.addTemplates(templates), 2)
+
+        expected = cp.Parser(.7)
+        for template in (templates[1], templates[0], templates[3]):
+            expected.addTemplate(template)
+        self.assertListEqual([c.logTemplate for c in parser.logClust], [c.logTemplate for c in expected.logClust])
+        self.assertListEqual(helper(parser.trieRoot), helper(expected.trieRoot))
+
+    def test_frozen_parser(self):
+        parser = cp.Parser(.5)
+        parser.parse(['PacketResponder 1 for block blk_1 terminating',
+                      'PacketResponder 2 for block blk_2 terminating',
+                      'Receiving block blk_3 src /10.0.0.1 dest /10.0.0.2',
+                      'Receiving block blk_7 src /10.0.0.5 dest /10.0.0.6'], 0)
+        frozen = cp.FrozenParser(parser)
+        self.assertEqual(len(frozen), len(parser.logClust))
+        lines = ['PacketResponder 3 for block blk_4 terminating',
+                 'Deleting block blk_5 file /data/blk_5',
+                 'Receiving block blk_6 src /10.0.0.3 dest /10.0.0.4']
+        res = frozen.classify(lines, 2)
+        self.assertListEqual(res.clusters, [0, -1, 1])
+        self.assertListEqual(res.unmatched, [1])
+        self.assertEqual(frozen.classify(lines[0]), 0)
+        # Classifying learns nothing.
+        self.assertEqual(len(parser.logClust), 2)
+        self.assertEqual(frozen.classify(lines[1]), -1)
+
+    def test_time_buckets(self):
+        parser = cp.Parser(.5)
+        parser.setTimeBuckets(60, 2)
+        content = ['PacketResponder 1 for block blk_1 terminating',
+                   'PacketResponder 2 for block blk_2 terminating',
+                   'Receiving block blk_3 src /10.0.0.1 dest /10.0.0.2',
+                   'PacketResponder 3 for block blk_4 terminating',
+                   'PacketResponder 4 for block blk_5 terminating']
+        times = ['081109 203615', '081109 203659', '081109 203701', '081109 203702', '081109 203901']
+        parser.parse(content, 0, times)
+        # 20:36 and 20:37 left the window when 20:39 arrived, 20:38 and 20:39 are open.
+        closed = parser.drainCounts()
+        self.assertListEqual([(r.start, r.cluster, r.count) for r in closed],
+                             [(1226262960, 0, 2), (1226263020, 0, 1), (1226263020, 1, 1)])
+        self.assertEqual(closed[0].eventId, hashlib.md5('PacketResponder <*> for block <*> terminating'
+                                                        .encode('utf-8')).hexdigest()[0:8])
+        self.assertListEqual([(r.start, r.cluster, r.count) for r in parser.openCounts()], [(1226263140, 0, 1)])
+        parser.flushCounts()
+        self.assertListEqual([(r.start, r.cluster, r.count) for r in parser.drainCounts()], [(1226263140, 0, 1)])
+        self.assertListEqual(parser.drainCounts(), [])
+
+    def test_time_buckets_eviction(self):
+        responder = 'PacketResponder 1 for block blk_38865049064139660 terminating'
+        receiving = 'Receiving block blk_-1608999687919862906 src: /10.250.19.102:54106'
+
+        with tempfile.TemporaryDirectory() as tmp_dir:
+            parser = cp.Parser(.7)
+            parser.setEviction(1, os.path.join(tmp_dir, 'coldTemplates.store'))
+            parser.setTimeBuckets(60, 1)
+            parser.parse([responder, receiving, responder], 0, ['081109 203615', '081109 203715', '081109 203815'])
+            self.assertListEqual(parser.evict(3), [0, -1])
+            # Rows waiting to be drained are renumbered with their templates, -1 for the evicted one.
+            self.assertListEqual([(r.start, r.cluster, r.count) for r in parser.drainCounts()],
+                                 [(1226262960, 0, 1), (1226263020, -1, 1)])
+
+    def test_eviction(self):
+        cold = 'PacketResponder 1 for block blk_38865049064139660 terminating'
+        hot = 'Receiving block blk_-1608999687919862906 src: /10.250.19.102:54106'
+
+        with tempfile.TemporaryDirectory() as tmp_dir:
+            parser = cp.Parser(.7)
+            parser.setEviction(1, os.path.join(tmp_dir, 'coldTemplates.store'))
+            parser.parse([cold], 0)
+            parser.parse([hot], 1)
+            self.assertListEqual(parser.evict(2), [-1, 0])
+            self.assertEqual(len(parser.logClust), 1)
+
+            clusters = parser.parse([cold], 2)
+            self.assertEqual(len(clusters), 2)
+            self.assertListEqual(clusters[1].logIDL, [1, 3])
+
+    def test_eviction_rerun(self):
+        cold = ('081109 203615 148 INFO dfs.DataNode$PacketResponder: '
+                'PacketResponder 1 for block blk_38865049064139660 terminating\n')
+        hot = ('081109 203615 148 INFO dfs.DataNode$DataXceiver: '
+               'Receiving block blk_-1608999687919862906 src: /10.250.19.102:54106\n')
+        log_format = '<Date> <Time> <Pid> <Level> <Component>: <Content>'
+        with tempfile.TemporaryDirectory() as tmp_dir:
+            for _ in range(2):
+                # Without the pickled state of the previous run, as on a first run into out_dir.
+                for state in ('rootNode.pkl', 'logCluL.pkl'):
+                    if os.path.exists(os.path.join(tmp_dir, state)):
+                        os.remove(os.path.join(tmp_dir, state))
+                log_parser = LogParser(out_dir=tmp_dir, log_format=log_format, hot_clusters=1, log_main='main')
+                log_parser.parse_lines([cold, hot])
+                # The cold template holds the lines of this run only, not a stale one from the store.
+                self.assertListEqual([c.logIDL for c in log_parser.log_cluster_lines], [[1], [2]])
+                self.assertListEqual(log_parser.parser.evict(2), [-1, 0])
+
+    def test_deferred_matching(self):
+        parser = cp.Parser(.7)
+        parser.setDeferredMatching(True)
+        clusters = parser.parse(['PacketResponder 1 for block blk_38865049064139660 terminating',
+                                 'PacketResponder 1 for block blk_-6952295868487656571 terminating'], 0)
+
+        self.assertEqual(len(clusters), 1)
+        self.assertListEqual(clusters[0].logTemplate, ['PacketResponder', '1', 'for', 'block', '<*>', 'terminating'])
+        self.assertListEqual(clusters[0].logIDL, [1, 2])
+        self.assertListEqual(parser.applyDeferred(True), [0])
+        with self.assertRaises(Exception):
+            parser.setConsolidation(10)
+
+    def test_memory_budget(self):
+        parser = cp.Parser(.7)
+        parser.parse(list(DF_MOCK['Content']), 0)
+        usage = parser.memoryUsage()
+        self.assertGreater(usage.trie, 0)
+        self.assertEqual(usage.total, usage.trie + usage.trieClusters + usage.templates + usage.lineIds +
+                         usage.postings + usage.tokens + usage.caches)
+
+        calls = []
+        parser.setMemoryBudget(1, 0, lambda usage, hard: calls.append(hard))
+        parser.enforceMemoryBudget()
+        self.assertListEqual(calls, [False])
+
+        parser.setMemoryBudget(0, 1)
+        parser.parse(list(DF_MOCK['Content']), 3)
+        parser.enforceMemoryBudget()
+        self.assertListEqual([c.logIDL for c in parser.logClust], [[], [], [6]])
+
+    def test_ingest(self):
+        lines = ['081109 203615 148 INFO dfs.DataNode$PacketResponder: PacketResponder 1 for block blk_38865049064139660 terminating',
+                 '081109 203807 222 INFO dfs.DataNode$PacketResponder: PacketResponder 0 for block blk_-6952295868487656571 terminating',
+                 'not a log line',
+                 '081109 204005 35 INFO dfs.FSNamesystem: BLOCK* NameSystem.addStoredBlock: blockMap updated: 10.251.73.220:50010 is added to blk_7128370237687728475 size 67108864']
+        log_format = '<Date> <Time> <Pid> <Level> <Component>: <Content>'
+
+        with tempfile.TemporaryDirectory() as tmp_dir:
+            for name, part in (('HDFSpartaa', lines[:2]), ('HDFSpartab', lines[2:])):
+                with open(os.path.join(tmp_dir, name), 'w') as f:
+                    f.write('\n'.join(part) + '\n')
+            checkpoint = os.path.join(tmp_dir, 'ingest.ckpt')
+
+            parser = cp.Parser(.7)
+            ingestor = cp.Ingestor(parser, log_format)
+            ingestor.setCheckpoint(checkpoint)
+            self.assertEqual(ingestor.ingest([os.path.join(tmp_dir, 'HDFSpart*')]), 3)
+            self.assertEqual(ingestor.lastLineId, 3)
+            self.assertListEqual([c.logIDL for c in parser.logClust], [[1], [2], [3]])
+
+            resumed = cp.Parser(.7)
+            ingestor = cp.Ingestor(resumed, log_format)
+            ingestor.setCheckpoint(checkpoint)
+            self.assertTrue(ingestor.restore())
+            self.assertEqual(ingestor.lastLineId, 3)
+            self.assertEqual(ingestor.ingest([os.path.join(tmp_dir, 'HDFSpart*')]), 0)
+            self.assertListEqual([c.logTemplate for c in resumed.logClust],
+                                 [c.logTemplate for c in parser.logClust])
+
+    def test_columnar(self):
+        content = ['PacketResponder 1 for block blk_38865049064139660 terminating',
+                   'PacketResponder 1 for block blk_-6952295868487656571 terminating']
+
+        with tempfile.TemporaryDirectory() as tmp_dir:
+            path = os.path.join(tmp_dir, 'HDFS_main_structured.cols')
+            parser = cp.Parser(.7)
+            parser.parse(content[:1], 0)
+            parser.writeColumns(path, content[:1], 0)
+            parser.parse(content[1:], 1)
+            parser.writeColumns(path, content[1:], 1)
+
+            self.assertEqual(cp.lastLineId(path), 2)
+            reader = cp.ColumnarReader(path)
+            self.assertEqual(len(reader), 2)
+            self.assertListEqual(reader.lineIds(), [1, 2])
+            self.assertListEqual(reader.clusterIds(), [0, 0])
+            self.assertListEqual(reader.parameters(), [[], ['blk_-6952295868487656571']])
+            self.assertDictEqual(reader.templates(), {0: 'PacketResponder 1 for block <*> terminating'})
+
+            # An all-punctuation value is an empty parameter, kept even in last position.
+            path = os.path.join(tmp_dir, 'status_structured.cols')
+            status = ['Task 7 finished with status 5', 'Task 8 finished with status --']
+            parser = cp.Parser(.5)
+            parser.parse(status, 0)
+            parser.writeColumns(path, status, 0)
+            self.assertListEqual(cp.ColumnarReader(path).parameters(), [['7', '5'], ['8', '']])
+
+    def test_postings(self):
+        content = ['PacketResponder 1 for block blk_38865049064139660 terminating',
+                   'Receiving block blk_-1608999687919862906 src: /10.250.19.102:54106',
+                   'PacketResponder 1 for block blk_-6952295868487656571 terminating']
+
+        parser = cp.Parser(.7)
+        parser.setPostings(True)
+        parser.parse(content, 0)
+        parser.purgeIDs()
+        postings = parser.postings
+        self.assertListEqual(postings.lines(0), [1, 3])
+        self.assertListEqual(postings.lines(0, 2, 3), [3])
+        self.assertEqual(postings.count(1), 1)
+        self.assertListEqual(postings.countsSince(1), [1, 1])
+        self.assertListEqual(postings.intersect([0, 1]), [])
+
 
 def helper(rootNode):
     if rootNode.child == dict():
@@ -4,47 +4,99 @@
 #include <vector>
 #include <regex>
 #include <map>
+#include <memory_resource>
+#include <numeric>
 #include <optional>
 #include <set>
 #include <cassert>
 #include <chrono>
 #include <ctime>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <filesystem>
 #include <fstream>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#if __has_include(<glob.h>)
+#include <glob.h>
+#endif
+#if __has_include(<sys/resource.h>)
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+#include "IdSegment.h"
+#include "Masker.h"
+#include "LogFormat.h"
+#include "ScratchArena.h"
+#include "LcsKernel.h"
+#include "ColdStore.h"
+#include "LineReader.h"
+#include "MemoryUsage.h"
+#include "ColumnarLog.h"
+#include "PostingIndex.h"
+#include "TimeBuckets.h"
+#include "Md5.h"
 
 using namespace std;
 
-vector<string> split(string s, const string& delimiter = "[\\s=:,]"){
+vector<string> split(string_view s, const string& delimiter = "[\\s=:,]"){
     vector<string> res;
 
-    regex rgx(delimiter);
-    sregex_token_iterator iter(s.begin(),s.end(),
-                               rgx,-1);
-    sregex_token_iterator end;
+    // Compiling the regex costs more than splitting a line, keep the last one per thread.
+    static thread_local pair<string, regex> cached;
+    if (cached.first != delimiter || delimiter.empty())
+        cached = {delimiter, regex(delimiter)};
+    cregex_token_iterator iter(s.data(), s.data() + s.size(),
+                               cached.second, -1);
+    cregex_token_iterator end;
     for ( ; iter != end; ++iter){
-        if (*iter != "")
-            res.push_back(*iter);
+        if (iter->length() != 0)
+            res.emplace_back(iter->first, iter->second);
     }
 
     return res;
 }
 
+// Tokens of the line being parsed: views into the line, allocated from the parser's scratch arena.
+using Tokens = pmr::vector<string_view>;
+
 class TemplateCluster {
 public:
     vector<string> logTemplate;
     vector<int> logIds;
+    // ID of the last line assigned and number of lines assigned, for cold-template eviction.
+    int lastSeen = 0;
+    unsigned hits = 0;
+    // Bumped each time the template is generalized, so clients can tell a cached template is stale.
+    unsigned version = 0;
+    // Token IDs of logTemplate in the dictionary of generation idsGeneration, taken at template version idsVersion.
+    vector<int> tokenIds;
+    uint64_t idsGeneration = 0;
+    unsigned idsVersion = 0;
     TemplateCluster(){}
     TemplateCluster(vector<string> tmp)
             : logTemplate(std::move(tmp)){}
     TemplateCluster(vector<string> tmp, vector<int> ids)
-            : logTemplate(tmp), logIds(ids){}
+            : logTemplate(std::move(tmp)), logIds(std::move(ids)),
+              lastSeen(logIds.empty() ? 0 : logIds.back()), hits((unsigned) logIds.size()){}
 };
 
+class TrieNode;
+// Transparent comparator, so token views look up children without building a string.
+using TrieChildren = map<string, TrieNode, less<>>;
+
 class TrieNode {
 public:
     optional<TemplateCluster> cluster;
     string token;
     int templateNo;
-    map<string , TrieNode> child;
+    TrieChildren child;
 
     TrieNode(){}
     TrieNode(string token, int templateNo)
@@ -53,51 +105,552 @@ public:
     TrieNode(const optional<TemplateCluster> &cluster,
              string token,
              int templateNo,
-             const map<string, TrieNode> &child) :
+             const TrieChildren &child) :
              cluster(cluster), token(std::move(token)), templateNo(templateNo), child(child) {}
 };
 
+/*
+ * Queues between a parser in deferred matching mode and its matching worker.
+ * The worker keeps a mirror of the settled templates, in logClust order, and
+ * matches each provisional cluster against it as assign() would have; clusters
+ * it joins to an earlier template come back as merges. Clusters are named by a
+ * stable ID rather than their index, which moves as merges are applied.
+ */
+struct DeferredWork {
+    enum Kind { Seed, Match, Reset };
+    struct Job {
+        Kind kind;
+        uint64_t cluster;
+        vector<string> logTemplate;
+    };
+    struct Merge {
+        uint64_t cluster;
+        uint64_t target;
+        vector<string> logTemplate;
+    };
+    mutex lock;
+    condition_variable wake;
+    condition_variable idle;
+    deque<Job> jobs;
+    vector<Merge> merges;
+    // Jobs queued or being matched.
+    size_t pending = 0;
+    bool stop = false;
+    thread worker;
+
+    void post(Job job){
+        {
+            lock_guard<mutex> guard(lock);
+            jobs.push_back(std::move(job));
+            pending++;
+        }
+        wake.notify_one();
+    }
+
+    ~DeferredWork(){
+        {
+            lock_guard<mutex> guard(lock);
+            stop = true;
+        }
+        wake.notify_one();
+        if (worker.joinable())
+            worker.join();
+    }
+};
+
 class Parser {
 public:
     vector<TemplateCluster> logClust;
     TrieNode trieRoot;
     const float tau;
+    size_t keepIds = 0;
+    int idWindow = 0;
+    int retentionInterval = 10000;
+    unique_ptr<IdSegment> spill;
+    size_t maxClusters = 0;
+    size_t consolidateBudget = 16;
+    size_t consolidateCursor = 1;
+    size_t settledClusters = 0;
+    bool sweepMerged = false;
+    size_t hotClusters = 0;
+    unique_ptr<ColdStore> cold;
+    shared_ptr<const Masker> masker;
+    // Unmasked tokenizer on the delimiters of masker, for parameter extraction; null for the default ones.
+    shared_ptr<const Masker> splitter;
+    // Progress lines of parseEach on stdout; drivers answering on stdout turn them off.
+    bool progress = true;
+    ScratchArena scratch;
+    TokenIds tokenIds;
+    unique_ptr<PostingIndex> postings;
+    // Deferred matching: worker queues, and a stable ID per cluster of logClust (ascending).
+    unique_ptr<DeferredWork> deferred;
+    vector<uint64_t> stableIds;
+    uint64_t nextStableId = 0;
+    // Memory budgets in bytes (0 disables), checked every retentionInterval lines.
+    size_t softBudget = 0;
+    size_t hardBudget = 0;
+    int budgetLines = 0;
+    function<void(const MemoryUsage&, bool)> onBudget;
+    // Line counts by time bucket, and the CSV file their closed buckets go to (if open).
+    unique_ptr<TimeBuckets> counters;
+    ofstream countsOut;
 
     Parser() : tau(.5) {}
     Parser(float tau)
             : tau(tau){}
     Parser(vector<TemplateCluster> logClust, TrieNode trieRoot, float tau)
-            : logClust(logClust), trieRoot(trieRoot), tau(tau){}
+            : logClust(std::move(logClust)), trieRoot(std::move(trieRoot)), tau(tau){}
 
-    void addTemplate(string newTemplate){
-        auto logTemplate = split(std::move(newTemplate));
-        addTemplate(logTemplate);
+    void addTemplate(const string& newTemplate){
+        addTemplate(split(newTemplate));
     }
     void addTemplate(vector<string> newTemplate){
-        auto newCluster = TemplateCluster(std::move(newTemplate));
-        logClust.push_back(newCluster);
-        addSeqToPrefixTree(trieRoot, newCluster);
+        logClust.emplace_back(std::move(newTemplate));
+        addSeqToPrefixTree(trieRoot, logClust.back());
+        if (deferred) {
+            stableIds.push_back(++nextStableId);
+            deferred->post({DeferredWork::Seed, stableIds.back(), logClust.back().logTemplate});
+        }
+    }
+
+    size_t addTemplates(const vector<string>& templates, int threads = 1){
+        /*
+         * addTemplate() for a template library, skipping duplicates of an earlier
+         * template or of one already in logClust. Templates are split on up to
+         * threads threads, then ordered by their constant tokens, so the trie is
+         * built in one pass that never walks a shared prefix twice and appends
+         * children at the end of their map. logClust and the trie come out as
+         * addTemplate() of the kept templates in input order would leave them.
+         * Returns the number of templates added.
+         */
+        static const Masker plain({});
+        size_t n = templates.size();
+        vector<vector<string>> toks(n);
+        auto run = [&](int t, int tMax){
+            vector<string_view> views;
+            for (size_t i = n * t / tMax; i < n * (t + 1) / tMax; i++) {
+                views.clear();
+                plain.tokenize(templates[i], views);
+                toks[i].assign(views.begin(), views.end());
+            }
+        };
+        // Splitting a template takes about a microsecond, smaller libraries stay on this thread.
+        int tMax = max(1, min(threads, (int) (n / 4096)));
+        vector<thread> pool;
+        for (int t = 1; t < tMax; t++)
+            pool.emplace_back(run, t, tMax);
+        run(0, tMax);
+        for (auto &th : pool)
+            th.join();
+
+        // Constant tokens as ranks in string order, so templates sort on ints.
+        unordered_map<string_view, int> rankOf;
+        vector<vector<int>> consts(n);
+        for (size_t i = 0; i < n; i++)
+            for (const string& tok : toks[i])
+                if (tok != "<*>")
+                    consts[i].push_back(rankOf.try_emplace(tok, (int) rankOf.size()).first->second);
+        vector<string_view> tokenOf(rankOf.size());
+        for (const auto &entry : rankOf)
+            tokenOf[entry.second] = entry.first;
+        vector<int> rank(tokenOf.size());
+        iota(rank.begin(), rank.end(), 0);
+        sort(rank.begin(), rank.end(), [&](int a, int b){ return tokenOf[a] < tokenOf[b]; });
+        vector<int> rerank(rank.size());
+        for (int r = 0; r < rank.size(); r++)
+            rerank[rank[r]] = r;
+        for (auto &c : consts)
+            for (int &tok : c)
+                tok = rerank[tok];
+        sort(tokenOf.begin(), tokenOf.end());
+
+        // Equal constant tokens form a run, within it equal templates are adjacent and the first one is kept.
+        vector<size_t> order(n);
+        iota(order.begin(), order.end(), 0);
+        sort(order.begin(), order.end(), [&](size_t a, size_t b){
+            if (consts[a] != consts[b])
+                return consts[a] < consts[b];
+            return toks[a] != toks[b] ? toks[a] < toks[b] : a < b;
+        });
+        vector<const vector<string>*> known;
+        for (const TemplateCluster& c : logClust)
+            known.push_back(&c.logTemplate);
+        auto byTemplate = [](const vector<string>* a, const vector<string>* b){ return *a < *b; };
+        sort(known.begin(), known.end(), byTemplate);
+
+        vector<bool> keep(n);
+        // Trie nodes of the constant tokens of the last run.
+        vector<TrieNode*> path{&trieRoot};
+        const vector<int>* last = nullptr;
+        for (size_t runStart = 0, runEnd; runStart < n; runStart = runEnd) {
+            const vector<int> &run = consts[order[runStart]];
+            int kept = 0;
+            // The leaf keeps the first template of the run in input order.
+            size_t first = n;
+            for (runEnd = runStart; runEnd < n && consts[order[runEnd]] == run; runEnd++) {
+                size_t i = order[runEnd];
+                if (runEnd > runStart && toks[order[runEnd - 1]] == toks[i])
+                    continue;
+                if (binary_search(known.begin(), known.end(), &toks[i], byTemplate))
+                    continue;
+                keep[i] = true;
+                kept++;
+                first = min(first, i);
+            }
+            if (kept == 0)
+                continue;
+
+            size_t shared = 0;
+            if (last)
+                while (shared < last->size() && shared < run.size() && (*last)[shared] == run[shared])
+                    shared++;
+            last = &run;
+            path.resize(shared + 1);
+            for (size_t d = 1; d < path.size(); d++)
+                path[d]->templateNo += kept;
+            for (size_t d = shared; d < run.size(); d++) {
+                auto &children = path.back()->child;
+                string_view tok = tokenOf[run[d]];
+                auto it = children.end();
+                // In an empty trie every child comes after its siblings.
+                if (!children.empty() && children.rbegin()->first >= tok)
+                    it = children.lower_bound(tok);
+                if (it == children.end() || it->first != tok)
+                    it = children.emplace_hint(it, piecewise_construct, forward_as_tuple(tok),
+                                               forward_as_tuple(string(tok), 0));
+                it->second.templateNo += kept;
+                path.push_back(&it->second);
+            }
+            if (!path.back()->cluster.has_value())
+                path.back()->cluster.emplace(toks[first]);
+        }
+
+        size_t added = 0;
+        for (size_t i = 0; i < n; i++) {
+            if (!keep[i])
+                continue;
+            logClust.emplace_back(std::move(toks[i]));
+            added++;
+            if (deferred) {
+                stableIds.push_back(++nextStableId);
+                deferred->post({DeferredWork::Seed, stableIds.back(), logClust.back().logTemplate});
+            }
+        }
+        return added;
+    }
+
+    size_t loadTemplates(const string& path, int threads = 1){
+        // addTemplates() of the non-empty lines of the file at path, one template per line.
+        ifstream in(path);
+        if (!in)
+            throw runtime_error("Cannot open template library: " + path);
+        vector<string> templates;
+        string line;
+        while (getline(in, line))
+            if (line.find_first_not_of(" \t\r") != string::npos)
+                templates.push_back(line);
+        return addTemplates(templates, threads);
     }
 
     void purgeIDs(){
         int max = 0;
         for (auto &clust: logClust) {
+            if (clust.logIds.empty())
+                continue;
             int tmp = *std::max_element(clust.logIds.begin(), clust.logIds.end());
             max = tmp > max ? tmp : max;
         }
         for (auto &clust: logClust) {
-            int tmp = *std::max_element(clust.logIds.begin(), clust.logIds.end());
-            if (tmp < max)
-                clust.logIds.clear();
-            else{
-                clust.logIds.clear();
+            bool hasMax = std::find(clust.logIds.begin(), clust.logIds.end(), max) != clust.logIds.end();
+            clust.logIds.clear();
+            if (hasMax)
                 clust.logIds.push_back(max);
-            }
         }
 
         purgeTreeIDs(trieRoot);
     }
 
+    void setRetention(size_t keepIds, int idWindow, const string& spillPath, bool fresh = false){
+        /*
+         * Bounds the line IDs kept in memory per cluster to the most recent keepIds
+         * and/or to the last idWindow lines (0 disables either rule). Older IDs are
+         * appended to the segment file at spillPath, where lineIds() still finds them.
+         * An existing segment is resumed, its cluster numbers taken to be those of
+         * logClust, unless fresh, which truncates it.
+         */
+        this->keepIds = keepIds;
+        this->idWindow = idWindow;
+        spill = spillPath.empty() ? nullptr : make_unique<IdSegment>(spillPath, fresh);
+    }
+
+    void enforceRetention(int lastID){
+        // Renumbering since the last step goes to the segment as one remap block.
+        if (spill)
+            spill->flush();
+        for (int c = 0; c < logClust.size(); c++) {
+            auto &ids = logClust[c].logIds;
+            size_t cut = 0;
+            // Allow twice the budget before spilling, so each spill moves a whole block.
+            if (keepIds > 0 && ids.size() >= 2 * keepIds)
+                cut = ids.size() - keepIds;
+            if (idWindow > 0)
+                cut = max(cut, (size_t) (lower_bound(ids.begin(), ids.end(), lastID - idWindow + 1) - ids.begin()));
+            if (cut == 0)
+                continue;
+            if (spill)
+                spill->append(c, ids.data(), cut);
+            ids.erase(ids.begin(), ids.begin() + cut);
+        }
+    }
+
+    vector<int> lineIds(int clusterNo){
+        /*
+         * All line IDs assigned to logClust[clusterNo], spilled ones included.
+         */
+        vector<int> res;
+        if (spill)
+            res = spill->read(clusterNo);
+        const auto &ids = logClust.at(clusterNo).logIds;
+        res.insert(res.end(), ids.begin(), ids.end());
+        // Consolidated clusters interleave spilled and in-memory IDs.
+        if (!is_sorted(res.begin(), res.end()))
+            sort(res.begin(), res.end());
+        return res;
+    }
+
+    MemoryUsage memoryUsage() const {
+        /*
+         * Heap bytes of the parser state by component, from a walk over the
+         * clusters and the trie (tens of nanoseconds per node). The mirror kept
+         * by the deferred matching worker is not included.
+         */
+        MemoryUsage usage;
+        usage.templates = MemoryUsage::of(logClust);
+        for (const TemplateCluster& c : logClust) {
+            usage.templates += MemoryUsage::of(c.logTemplate) + MemoryUsage::of(c.tokenIds);
+            usage.lineIds += MemoryUsage::of(c.logIds);
+        }
+        trieUsage(trieRoot, usage);
+        if (postings)
+            usage.postings = postings->bytes();
+        usage.tokens = tokenIds.bytes();
+        usage.caches = scratch.getCapacity();
+        if (spill)
+            usage.caches += spill->bytes();
+        if (cold)
+            usage.caches += cold->bytes();
+        if (counters)
+            usage.caches += counters->bytes();
+        if (deferred) {
+            lock_guard<mutex> guard(deferred->lock);
+            usage.caches += deferred->jobs.size() * sizeof(DeferredWork::Job) + MemoryUsage::of(deferred->merges);
+            for (const auto &job : deferred->jobs)
+                usage.caches += MemoryUsage::of(job.logTemplate);
+            for (const auto &merge : deferred->merges)
+                usage.caches += MemoryUsage::of(merge.logTemplate);
+        }
+        return usage;
+    }
+
+    static void trieUsage(const TrieNode& node, MemoryUsage& usage){
+        usage.trie += MemoryUsage::of(node.token);
+        if (node.cluster.has_value())
+            usage.trieClusters += MemoryUsage::of(node.cluster->logTemplate) + MemoryUsage::of(node.cluster->logIds);
+        for (const auto &child : node.child) {
+            usage.trie += sizeof(child) + MemoryUsage::treeNode + MemoryUsage::of(child.first);
+            trieUsage(child.second, usage);
+        }
+    }
+
+    void setMemoryBudget(size_t soft, size_t hard, function<void(const MemoryUsage&, bool)> onBudget = nullptr){
+        /*
+         * Checks memoryUsage() against the soft and hard budgets in bytes (0
+         * disables either) every retentionInterval lines parsed, and calls
+         * onBudget(usage, hard) once one is exceeded, or relieveMemory() without
+         * a callback.
+         */
+        softBudget = soft;
+        hardBudget = hard;
+        this->onBudget = std::move(onBudget);
+    }
+
+    MemoryUsage enforceMemoryBudget(){
+        // The check parseEach() runs; returns the usage after relieveMemory() if it ran.
+        MemoryUsage usage = memoryUsage();
+        bool hard = hardBudget > 0 && usage.total() > hardBudget;
+        if (!hard && (softBudget == 0 || usage.total() <= softBudget))
+            return usage;
+        if (onBudget) {
+            onBudget(usage, hard);
+            return usage;
+        }
+        relieveMemory(hard);
+        return memoryUsage();
+    }
+
+    void relieveMemory(bool hard){
+        /*
+         * compact(), and if hard also drops the line IDs in memory: to the spill
+         * segment if retention has one, otherwise purgeIDs() keeps only the last.
+         */
+        if (hard) {
+            if (spill)
+                spillIds();
+            else
+                purgeIDs();
+        }
+        compact();
+    }
+
+    void compact(){
+        /*
+         * Gives back spare capacity without losing anything: logClust and the
+         * line ID lists are trimmed and the token dictionary, which keeps the
+         * tokens of templates generalized since, is started over. The token IDs
+         * cached on the clusters are interned again when next matched.
+         */
+        logClust.shrink_to_fit();
+        for (TemplateCluster& c : logClust)
+            c.logIds.shrink_to_fit();
+        tokenIds = TokenIds();
+    }
+
+    void spillIds(){
+        // Moves every line ID in memory to the spill segment, where lineIds() still finds them.
+        if (!spill)
+            throw logic_error("No spill segment, call setRetention with a spill path");
+        for (int c = 0; c < logClust.size(); c++) {
+            auto &ids = logClust[c].logIds;
+            spill->append(c, ids.data(), ids.size());
+            ids.clear();
+        }
+    }
+
+    void setPostings(bool enable){
+        /*
+         * Keeps a compressed posting list of line IDs per cluster for range, count
+         * and intersection queries (see PostingIndex), built from the current line
+         * IDs and then updated by every line, merge and eviction. Unlike logIds it
+         * is not bounded by retention or purgeIDs.
+         */
+        if (!enable) {
+            postings.reset();
+            return;
+        }
+        postings = make_unique<PostingIndex>();
+        for (int c = 0; c < logClust.size(); c++)
+            for (int id : lineIds(c))
+                postings->add(c, id);
+    }
+
+    const PostingIndex& postingIndex() const {
+        if (!postings)
+            throw logic_error("Posting index disabled, call setPostings(true)");
+        return *postings;
+    }
+
+    void setTimeBuckets(int64_t seconds, size_t ring = 60, const string& path = "",
+                        const vector<string>& fields = {"Date", "Time"}){
+        /*
+         * Counts the lines of every cluster by buckets of seconds (0 disables) over a
+         * window of the last ring buckets, see TimeBuckets. The time of a line is read
+         * from the digits of the header fields by the callers that have them: parse()
+         * given times, Ingestor and cspell. Closed buckets are appended to the CSV
+         * file path as Time,EventId,Cluster,Count rows, or kept for drainCounts()
+         * without one. Counts, and the cluster of rows kept for drainCounts(), move
+         * along with merged clusters; evicted clusters have their buckets closed.
+         */
+        if (counters)
+            flushCounts();
+        countsOut = ofstream();
+        counters.reset();
+        if (seconds <= 0)
+            return;
+        counters = make_unique<TimeBuckets>(seconds, ring, fields);
+        if (!path.empty()) {
+            bool fresh = !filesystem::exists(path) || filesystem::file_size(path) == 0;
+            countsOut.open(path, ios::app);
+            if (!countsOut)
+                throw runtime_error("Cannot open " + path);
+            if (fresh)
+                countsOut << "Time,EventId,Cluster,Count\n";
+        }
+    }
+
+    void countLine(int cluster, int64_t time){
+        // time is TimeBuckets::none for lines whose header had no readable time.
+        if (!counters || cluster < 0)
+            return;
+        if (time == TimeBuckets::none) {
+            counters->unparsed++;
+            return;
+        }
+        counters->add(cluster, time);
+        if (!counters->closed.empty())
+            writeCounts();
+    }
+
+    static int64_t lineTime(const vector<string_view>& fields){
+        int64_t res;
+        return TimeBuckets::parseTime(fields, res) ? res : TimeBuckets::none;
+    }
+
+    void flushCounts(){
+        // Closes every bucket, at the end of the input or before the clusters are replaced.
+        if (!counters)
+            return;
+        counters->flush();
+        writeCounts();
+    }
+
+    vector<TimeBuckets::Row> drainCounts(){
+        // Rows of the buckets closed since the last call, when they do not go to a file.
+        if (!counters)
+            throw logic_error("Time buckets disabled, call setTimeBuckets");
+        return std::move(counters->closed);
+    }
+
+    vector<TimeBuckets::Row> openCounts() const {
+        // Rows of the buckets still open, with the current EventIds.
+        if (!counters)
+            throw logic_error("Time buckets disabled, call setTimeBuckets");
+        auto res = counters->open();
+        for (auto &row : res)
+            row.eventId = eventId(row.cluster);
+        return res;
+    }
+
+    string eventId(int cluster) const {
+        // As LogParser.cluster_to_df computes it: md5 of the template joined by spaces, 8 hex digits.
+        if (cluster < 0 || cluster >= (int) logClust.size())
+            return string();
+        string joined;
+        for (const string& tok : logClust[cluster].logTemplate) {
+            if (!joined.empty())
+                joined += ' ';
+            joined += tok;
+        }
+        return Md5::hex(joined, 8);
+    }
+
+    void writeCounts(){
+        /*
+         * Labels the rows closed since the last call with the EventId of their
+         * cluster's template now, and appends them to the counts file if any.
+         */
+        auto &closed = counters->closed;
+        for (auto it = closed.rbegin(); it != closed.rend() && it->eventId.empty(); ++it)
+            it->eventId = eventId(it->cluster);
+        if (!countsOut.is_open())
+            return;
+        for (const auto &row : closed)
+            countsOut << row.start << ',' << row.eventId << ',' << row.cluster << ',' << row.count << '\n';
+        countsOut.flush();
+        if (!countsOut)
+            throw runtime_error("Cannot write time bucket counts");
+        closed.clear();
+    }
+
     void purgeTreeIDs(TrieNode& tree){
         if (tree.cluster.has_value()){
             tree.cluster.value().logIds.clear();
@@ -107,128 +660,308 @@ public:
         }
     }
 
-    vector<string> getTemplate(vector<string> lcs, vector<string> seq) {
+    void setMasking(const vector<string>& rules, const string& delimiters = Masker::defaultDelimiters){
+        /*
+         * Masks variable tokens before matching. Rules are "ip", "hex", "blk", "num"
+         * or glob patterns ('*', '?', '#' for a digit run); no rules disables masking.
+         * Lines are split on the characters of delimiters.
+         */
+        bool plainDelimiters = delimiters == Masker::defaultDelimiters;
+        if (rules.empty() && plainDelimiters)
+            masker.reset();
+        else
+            masker = make_shared<const Masker>(rules, delimiters);
+        splitter = plainDelimiters ? nullptr : make_shared<const Masker>(vector<string>(), delimiters);
+    }
+
+    const Masker& tokenizer() const {
+        // Without rules a Masker splits on the same set as split(logMsg, "[\\s=:,]").
+        static const Masker plain({});
+        return masker ? *masker : plain;
+    }
+
+    vector<string> tokenize(string_view logMsg){
+        return tokenizer().tokenize(logMsg);
+    }
+
+    void getTemplate(const Tokens& lcs, const vector<string>& seq, Tokens& res) {
 //        cout << "getTemplate START" << endl;
 
-        vector<string> res;
+        res.clear();
         if (lcs.empty())
-            return res;
+            return;
 
-        reverse(lcs.begin(), lcs.end());
+        size_t next = 0;
         int i = 0;
         for (const string& tok : seq) {
             i++;
-            if (tok == lcs[lcs.size() - 1]){
-                res.push_back(tok);
-                lcs.erase(lcs.begin() + lcs.size() - 1);
+            if (tok == lcs[next]){
+                res.emplace_back(tok);
+                next++;
             }else
                 res.emplace_back("<*>");
-            if (lcs.empty())
+            if (next == lcs.size())
                 break;
         }
         if (i < seq.size())
             res.emplace_back("<*>");
-        return res;
     }
 
-    void removeSeqFromPrefixTree(TrieNode& prefixTreeRoot, TemplateCluster cluster) {
+    vector<string> getTemplate(const vector<string>& lcs, const vector<string>& seq) {
+        Tokens lcsViews(lcs.begin(), lcs.end()), res;
+        getTemplate(lcsViews, seq, res);
+        return vector<string>(res.begin(), res.end());
+    }
+
+    void removeSeqFromPrefixTree(TrieNode& prefixTreeRoot, const TemplateCluster& cluster) {
         auto parentn = &prefixTreeRoot;
-        vector<string> seq;
-        copy_if (cluster.logTemplate.begin(), cluster.logTemplate.end(),
-                 back_inserter(seq),
-                 [](const string& s){return s != "<*>";});
-        for (const string& tok : seq) {
-            if ((*parentn).child.count(tok)){
-                auto matched = &(*parentn).child[tok];
-                if ((*matched).templateNo == 1){
-                    (*parentn).child.erase(tok);
+        for (const string& tok : cluster.logTemplate) {
+            if (tok == "<*>")
+                continue;
+            auto matched = parentn->child.find(tok);
+            if (matched != parentn->child.end()){
+                if (matched->second.templateNo == 1){
+                    parentn->child.erase(matched);
                     break;
                 }else {
-                    (*matched).templateNo--;
-                    parentn = matched;
+                    matched->second.templateNo--;
+                    parentn = &matched->second;
                 }
             }
         }
     }
 
-    void addSeqToPrefixTree(TrieNode& prefixTreeRoot, TemplateCluster newCluster) {
+    void addSeqToPrefixTree(TrieNode& prefixTreeRoot, const TemplateCluster& newCluster) {
 //        cout << "addSeqToPrefixTree START" << endl;
 
         auto parentn = &prefixTreeRoot;
-        vector<string> seq;
-        copy_if (newCluster.logTemplate.begin(), newCluster.logTemplate.end(),
-                 back_inserter(seq),
-                 [](const string& s){return s != "<*>";});
-        for (const string& tok : seq) {
-            if (parentn->child.count(tok))
-                parentn->child[tok].templateNo++;
-            else
-                parentn->child.insert({tok,TrieNode(tok, 1)});
-//                parentn->child[tok] = TrieNode(tok, 1);
-            parentn = &parentn->child[tok];
+        for (const string& tok : newCluster.logTemplate) {
+            if (tok == "<*>")
+                continue;
+            auto res = parentn->child.try_emplace(tok, tok, 0);
+            res.first->second.templateNo++;
+            parentn = &res.first->second;
         }
+        // The leaf only needs the template, line IDs stay in logClust.
         if (!parentn->cluster.has_value())
-            parentn->cluster = newCluster;
+            parentn->cluster.emplace(newCluster.logTemplate);
     }
 
-    vector<string> LCS(vector<string> seq1, vector<string> seq2) {
+    void rewriteSeqInPrefixTree(TrieNode& prefixTreeRoot, const vector<string>& oldTemplate,
+                                const TemplateCluster& cluster) {
+        /*
+         * Moves the path of oldTemplate to the current template of cluster in one
+         * walk, leaving the trie exactly as removeSeqFromPrefixTree(old) followed by
+         * addSeqToPrefixTree(cluster) would. The constant tokens both templates
+         * start with keep their nodes and counts, only the divergent suffix is
+         * decremented and inserted. A node counting a single template is erased
+         * and rebuilt by that pair, so from the first such node on the shared
+         * nodes are reset (no leaf, no other children) instead.
+         */
+        auto mem = scratch.resource();
+        pmr::vector<const string*> oldConst(mem), newConst(mem);
+        for (const string& tok : oldTemplate)
+            if (tok != "<*>")
+                oldConst.push_back(&tok);
+        for (const string& tok : cluster.logTemplate)
+            if (tok != "<*>")
+                newConst.push_back(&tok);
+
+        pmr::vector<TrieNode*> path(mem);
+        path.reserve(oldConst.size());
+        size_t single = oldConst.size();
+        auto parentn = &prefixTreeRoot;
+        for (const string* tok : oldConst) {
+            auto matched = parentn->child.find(*tok);
+            if (matched == parentn->child.end()) {
+                // Not a path of the trie, keep the exact semantics of the pair.
+                TemplateCluster old(oldTemplate);
+                removeSeqFromPrefixTree(prefixTreeRoot, old);
+                addSeqToPrefixTree(prefixTreeRoot, cluster);
+                return;
+            }
+            parentn = &matched->second;
+            if (single == oldConst.size() && parentn->templateNo == 1)
+                single = path.size();
+            path.push_back(parentn);
+        }
+
+        size_t shared = 0;
+        while (shared < oldConst.size() && shared < newConst.size() && *oldConst[shared] == *newConst[shared])
+            shared++;
+        auto nodeAt = [&](size_t depth) { return depth == 0 ? &prefixTreeRoot : path[depth - 1]; };
+
+        if (single < shared) {
+            for (size_t d = single; d < shared; d++) {
+                TrieNode* node = path[d];
+                node->cluster.reset();
+                node->templateNo = 1;
+                for (auto it = node->child.begin(); it != node->child.end();)
+                    it = d + 1 < shared && &it->second == path[d + 1] ? next(it) : node->child.erase(it);
+            }
+        } else {
+            if (shared == oldConst.size() && shared == newConst.size())
+                return;
+            for (size_t d = shared; d < oldConst.size(); d++) {
+                if (path[d]->templateNo == 1) {
+                    nodeAt(d)->child.erase(*oldConst[d]);
+                    break;
+                }
+                path[d]->templateNo--;
+            }
+        }
+
+        parentn = nodeAt(shared);
+        for (size_t d = shared; d < newConst.size(); d++) {
+            auto res = parentn->child.try_emplace(*newConst[d], *newConst[d], 0);
+            res.first->second.templateNo++;
+            parentn = &res.first->second;
+        }
+        if (!parentn->cluster.has_value())
+            parentn->cluster.emplace(cluster.logTemplate);
+    }
 
-        vector<vector<int>> lengths(seq1.size()+1,vector<int>(seq2.size()+1));
+    template <class Seq1, class Seq2>
+    static void lcsTable(const Seq1& seq1, const Seq2& seq2, pmr::vector<int>& lengths) {
+        // Row-major (seq1.size()+1) x (seq2.size()+1) table, reusing the capacity of lengths.
+        const size_t cols = seq2.size()+1;
+        lengths.assign((seq1.size()+1) * cols, 0);
+        auto at = [&lengths, cols](size_t i, size_t j) -> int& { return lengths[i*cols + j]; };
         for (int i = 0; i < seq1.size() ; i++){
             for (int j = 0; j < seq2.size(); j++) {
 //                printf("i: %d j:%d\n", i, j);
                 if (seq1[i] == seq2[j])
-                    lengths[i+1][j+1] = lengths[i][j]+1;
+                    at(i+1, j+1) = at(i, j)+1;
                 else
-                    lengths[i+1][j+1] = max(lengths[i+1][j], lengths[i][j+1]);
+                    at(i+1, j+1) = max(at(i+1, j), at(i, j+1));
             }
         }
-        vector<string> result;
+    }
+
+    template <class Seq1, class Seq2>
+    void LCS(const Seq1& seq1, const Seq2& seq2, pmr::vector<int>& lengths, Tokens& result) {
+        /*
+         * Longest common subsequence as views into seq1's tokens. lengths is the DP
+         * workspace, kept by the caller so repeated calls do not reallocate it.
+         */
+        lcsTable(seq1, seq2, lengths);
+        const size_t cols = seq2.size()+1;
+        auto at = [&lengths, cols](size_t i, size_t j) -> int& { return lengths[i*cols + j]; };
+        result.clear();
         auto lenOfSeq1= seq1.size();
         auto lenOfSeq2 = seq2.size();
         while (lenOfSeq1 != 0 && lenOfSeq2 != 0){
-            if (lengths[lenOfSeq1][lenOfSeq2] == lengths[lenOfSeq1-1][lenOfSeq2])
+            if (at(lenOfSeq1, lenOfSeq2) == at(lenOfSeq1-1, lenOfSeq2))
                 lenOfSeq1--;
-            else if (lengths[lenOfSeq1][lenOfSeq2] == lengths[lenOfSeq1][lenOfSeq2-1])
+            else if (at(lenOfSeq1, lenOfSeq2) == at(lenOfSeq1, lenOfSeq2-1))
                 lenOfSeq2--;
             else{
                 assert(seq1[lenOfSeq1-1] == seq2[lenOfSeq2-1] && "Error in LCS");
-                result.insert(result.begin(), seq1[lenOfSeq1-1]);
+                result.emplace_back(seq1[lenOfSeq1-1]);
                 lenOfSeq1--;
                 lenOfSeq2--;
             }
         }
-        return result;
+        reverse(result.begin(), result.end());
+    }
+
+    vector<string> LCS(const vector<string>& seq1, const vector<string>& seq2) {
+        pmr::vector<int> lengths;
+        Tokens result;
+        LCS(seq1, seq2, lengths, result);
+        return vector<string>(result.begin(), result.end());
+    }
+
+    const vector<int>& templateIds(TemplateCluster& cluster){
+        // Token IDs of the template, interned again only after it changed or the dictionary was started over.
+        if (cluster.idsGeneration != tokenIds.getGeneration() || cluster.idsVersion != cluster.version) {
+            cluster.tokenIds.clear();
+            for (const string& tok : cluster.logTemplate)
+                cluster.tokenIds.push_back(tokenIds.intern(tok));
+            cluster.idsGeneration = tokenIds.getGeneration();
+            cluster.idsVersion = cluster.version;
+        }
+        return cluster.tokenIds;
+    }
+
+    static void uniqueTokens(Tokens& tokens) {
+        // Sorted, duplicate-free tokens: a flat replacement for set<string>.
+        sort(tokens.begin(), tokens.end());
+        tokens.erase(unique(tokens.begin(), tokens.end()), tokens.end());
     }
 
-    optional<TemplateCluster*> LCSMatch(vector<TemplateCluster> &cluster, vector<string> logMsg) {
+    optional<TemplateCluster*> LCSMatch(TemplateCluster* first, TemplateCluster* last, const Tokens& logMsg) {
 //        cout << "LCSMatch START" << endl;
+        /*
+         * Temporaries come from the allocator of logMsg. Clusters passing the token
+         * overlap filter are scored LcsBatch::lanes at a time on token IDs; the
+         * lengths are those of LCS() and are compared in cluster order, so the
+         * choice and its tie-breaking are the same as scoring them one by one.
+         */
+        auto mem = logMsg.get_allocator().resource();
         optional<TemplateCluster *> res;
-        set<string> msgSet;
-        for (const string& w : logMsg) {
-            msgSet.insert(w);
-        }
+        Tokens msgSet(logMsg, mem);
+        uniqueTokens(msgSet);
+        Tokens tempSet(mem);
         double msgLen = logMsg.size();
         int maxLen = -1;
         optional<TemplateCluster *> maxLCS;
 
-        for (TemplateCluster& templateCluster : cluster) {
-            set<string> tempSet;
-            for (auto w : templateCluster.logTemplate) {
-                tempSet.insert(w);
-            }
-            set<string> intersect;
-            set_intersection(msgSet.begin(), msgSet.end(), tempSet.begin(), tempSet.end(),
-                             inserter(intersect, intersect.begin()));
-            if (intersect.size() < .5 * msgLen)
+        pmr::vector<TemplateCluster*> candidates(mem);
+        for (TemplateCluster* it = first; it != last; it++) {
+            TemplateCluster &templateCluster = *it;
+            tempSet.assign(templateCluster.logTemplate.begin(), templateCluster.logTemplate.end());
+            uniqueTokens(tempSet);
+            size_t intersect = count_if(tempSet.begin(), tempSet.end(),
+                                        [&msgSet](string_view w) { return binary_search(msgSet.begin(), msgSet.end(), w); });
+            if (intersect < .5 * msgLen)
                 continue;
-            auto lcs = LCS(logMsg, templateCluster.logTemplate);
-            int lenLcs = lcs.size();
-            if (lenLcs > maxLen ||
-                (lenLcs == maxLen &&
-                 templateCluster.logTemplate.size() < (*maxLCS.value()).logTemplate.size())){
-                maxLen = lenLcs;
-                maxLCS = optional(&templateCluster);
+            candidates.push_back(&templateCluster);
+        }
+        if (candidates.empty())
+            return res;
+
+        // Template IDs are cached per cluster and interned before the message is
+        // looked up, so every message token shared with a candidate has its ID.
+        const size_t lanes = LcsBatch::lanes;
+        pmr::vector<int> blocks(mem);
+        pmr::vector<size_t> blockStart(mem);
+        for (size_t b = 0; b < candidates.size(); b += lanes) {
+            size_t count = min(lanes, candidates.size() - b);
+            size_t columns = 0;
+            for (size_t l = 0; l < count; l++)
+                columns = max(columns, candidates[b + l]->logTemplate.size());
+            size_t start = blocks.size();
+            blockStart.push_back(start);
+            blocks.resize(start + columns * lanes, LcsBatch::padding);
+            for (size_t l = 0; l < count; l++) {
+                const auto &ids = templateIds(*candidates[b + l]);
+                for (size_t j = 0; j < ids.size(); j++)
+                    blocks[start + j * lanes + l] = ids[j];
+            }
+        }
+        blockStart.push_back(blocks.size());
+        pmr::vector<int> msgIds(mem);
+        msgIds.reserve(logMsg.size());
+        for (string_view tok : logMsg)
+            msgIds.push_back(tokenIds.find(tok));
+
+        pmr::vector<int> rows(mem);
+        int scores[LcsBatch::lanes];
+        for (size_t b = 0, block = 0; b < candidates.size(); b += lanes, block++) {
+            size_t columns = (blockStart[block + 1] - blockStart[block]) / lanes;
+            rows.resize(LcsBatch::workspaceSize(columns));
+            LcsBatch::score(msgIds.data(), msgIds.size(), blocks.data() + blockStart[block], columns,
+                            rows.data(), scores);
+            for (size_t l = 0; l < lanes && b + l < candidates.size(); l++) {
+                TemplateCluster &templateCluster = *candidates[b + l];
+                int lenLcs = scores[l];
+                if (lenLcs > maxLen ||
+                    (lenLcs == maxLen &&
+                     templateCluster.logTemplate.size() < (*maxLCS.value()).logTemplate.size())){
+                    maxLen = lenLcs;
+                    maxLCS = optional(&templateCluster);
+                }
             }
         }
 
@@ -240,125 +973,1369 @@ public:
         return res;
     }
 
-    optional<TemplateCluster*> simpleLoopMatch(vector<TemplateCluster> &cluster, vector<string> constLogMsg) {
+    optional<TemplateCluster*> LCSMatch(vector<TemplateCluster> &cluster, const Tokens& logMsg) {
+        return LCSMatch(cluster.data(), cluster.data() + cluster.size(), logMsg);
+    }
+
+    optional<TemplateCluster*> LCSMatch(vector<TemplateCluster> &cluster, const vector<string>& logMsg) {
+        return LCSMatch(cluster, Tokens(logMsg.begin(), logMsg.end()));
+    }
+
+    optional<TemplateCluster*> simpleLoopMatch(vector<TemplateCluster> &cluster, const Tokens& constLogMsg) {
 //        cout << "simpleLoopMatch START" << endl;
 
+        Tokens tokenSet(constLogMsg, constLogMsg.get_allocator());
+        uniqueTokens(tokenSet);
         for (TemplateCluster& templateCluster : cluster) {
             if (templateCluster.logTemplate.size() < .5 * constLogMsg.size())
                 continue;
-            set<string> tokenSet;
-            for (string w : constLogMsg) {
-                tokenSet.insert(w);
-            }
             if (all_of(templateCluster.logTemplate.cbegin(), templateCluster.logTemplate.cend(),
-                       [&tokenSet](const string& tok) { return tok == "<*>" || tokenSet.count(tok); }))
+                       [&tokenSet](const string& tok) {
+                           return tok == "<*>" || binary_search(tokenSet.begin(), tokenSet.end(), string_view(tok));
+                       }))
                 return &templateCluster;
         }
         return nullopt;
     }
 
-    optional<TemplateCluster*> prefixTreeMatch(TrieNode &prefixTree, vector<string> constLogMsg, int start) {
+    optional<TemplateCluster*> prefixTreeMatch(TrieNode &prefixTree, const Tokens& constLogMsg, int start) {
 //        cout << "prefixTreeMatch START" << endl;
+        TrieNode *node = &prefixTree;
         for (int i = start; i < constLogMsg.size(); i++) {
-            if (prefixTree.child.count(constLogMsg[i])){
-                TrieNode *child = &(prefixTree.child.at(constLogMsg[i]));
-                if ((*child).cluster.has_value()){
-                    vector<string> tmp =  (*child).cluster.value().logTemplate;
-                    vector<string> constLM;
-                    copy_if (tmp.begin(), tmp.end(),
-                             back_inserter(constLM),
-                             [](string s){return s != "<*>";});
-                    if (constLM.size() >= tau * constLogMsg.size())
-//                        return child.cluster.has_value() ? child.cluster : nullopt;
-                        return &((*child).cluster.value());
-                }else
-                    return prefixTreeMatch((*child), constLogMsg, i+1);
-            }
+            auto child = node->child.find(constLogMsg[i]);
+            if (child == node->child.end())
+                continue;
+            if (child->second.cluster.has_value()){
+                const vector<string> &tmp = child->second.cluster.value().logTemplate;
+                auto constLen = count_if(tmp.begin(), tmp.end(),
+                                         [](const string& s){return s != "<*>";});
+                if (constLen >= tau * constLogMsg.size())
+                    return &(child->second.cluster.value());
+            }else
+                // Continue the match from the next token inside the child.
+                node = &child->second;
         }
         return nullopt;
     }
 
-    vector<TemplateCluster> parse(const vector<string> content, const int lastLine=0){
-//        cout << "parse START" << endl;
-        int i = 1;
-        for (const string& logMsg : content){
-//            cout << "Loop: " << i << " Msg: "<< logMsg << endl;
-            int logID = i + lastLine;
-            vector<string> tokMsg = split(logMsg, "[\\s=:,]");
-            vector<string> constLogMsg;
-            copy_if (tokMsg.begin(), tokMsg.end(),
-                     back_inserter(constLogMsg),
-                     [](string s){return s != "<*>";});
-
-            optional<TemplateCluster *>  matchCluster = prefixTreeMatch(trieRoot, constLogMsg, 0);
+    void generalize(TemplateCluster& cluster, const Tokens& tokMsg){
+        /*
+         * Replaces the template of cluster with getTemplate(LCS(tokMsg, template)),
+         * moving it in the trie if it changed.
+         */
+        auto &matchClustTemp = cluster.logTemplate;
+        auto mem = tokMsg.get_allocator().resource();
+        pmr::vector<int> lengths(mem);
+        Tokens lcs(mem), newTemplate(mem);
+        LCS(tokMsg, matchClustTemp, lengths, lcs);
+        getTemplate(lcs, matchClustTemp, newTemplate);
+        if (!equal(newTemplate.begin(), newTemplate.end(), matchClustTemp.begin(), matchClustTemp.end())){
+            // newTemplate views the old template, copy it out before replacing.
+            vector<string> generalized(newTemplate.begin(), newTemplate.end());
+            vector<string> old = std::move(cluster.logTemplate);
+            cluster.logTemplate = std::move(generalized);
+            cluster.version++;
+            rewriteSeqInPrefixTree(trieRoot, old, cluster);
+        }
+    }
+
+    void setConsolidation(size_t maxClusters, size_t budget = 16){
+        /*
+         * Once logClust holds more than maxClusters templates (0 disables), parse()
+         * runs a consolidate(budget) step after each line until a full sweep over
+         * the clusters finds nothing left to merge.
+         */
+        if (maxClusters > 0 && deferred)
+            throw logic_error("Consolidation and deferred matching are exclusive");
+        this->maxClusters = maxClusters;
+        consolidateBudget = max<size_t>(budget, 1);
+        settledClusters = 0;
+    }
+
+    vector<int> consolidate(size_t budget = 0){
+        /*
+         * Merges clusters that the LCSMatch/getTemplate rule would have joined had
+         * their template arrived as a line: cluster c is matched against the clusters
+         * before it, and on a match it is generalized into them, its line IDs moved
+         * over and its trie path removed. Examines at most budget clusters (0 means
+         * all) starting where the previous call stopped, so ingestion only pauses
+         * for a bounded step. Returns the new index of every old cluster index.
+         */
+        vector<int> origin(logClust.size());
+        iota(origin.begin(), origin.end(), 0);
+        vector<int> mergedInto(logClust.size(), -1);
+        if (consolidateCursor == 0 || consolidateCursor >= logClust.size())
+            consolidateCursor = 1;
+        size_t examined = 0;
+        while (consolidateCursor < logClust.size() && (budget == 0 || examined < budget)) {
+            size_t c = consolidateCursor;
+            examined++;
+            scratch.reset();
+            const auto &logTemplate = logClust[c].logTemplate;
+            Tokens tokMsg(logTemplate.begin(), logTemplate.end(), scratch.resource());
+            auto match = LCSMatch(logClust.data(), logClust.data() + c, tokMsg);
+            if (!match.has_value()) {
+                consolidateCursor++;
+                continue;
+            }
+            TemplateCluster &target = *match.value();
+            generalize(target, tokMsg);
+            mergedInto[origin[c]] = origin[&target - logClust.data()];
+            mergeCluster(c, target);
+            origin.erase(origin.begin() + c);
+            sweepMerged = true;
+        }
+        if (consolidateCursor >= logClust.size()) {
+            // A sweep without merges means the table is settled at this size.
+            if (!sweepMerged)
+                settledClusters = logClust.size();
+            sweepMerged = false;
+            consolidateCursor = 1;
+        }
+        return mergeRemap(origin, mergedInto);
+    }
+
+    void mergeCluster(size_t c, TemplateCluster& target){
+        /*
+         * Moves the line IDs, last line and hits of cluster c to target, an earlier
+         * cluster, and drops c with its trie path.
+         */
+        auto &ids = target.logIds;
+        size_t mid = ids.size();
+        ids.insert(ids.end(), logClust[c].logIds.begin(), logClust[c].logIds.end());
+        inplace_merge(ids.begin(), ids.begin() + mid, ids.end());
+        target.lastSeen = max(target.lastSeen, logClust[c].lastSeen);
+        target.hits += logClust[c].hits;
+        removeSeqFromPrefixTree(trieRoot, logClust[c]);
+        logClust.erase(logClust.begin() + c);
+    }
+
+    vector<int> mergeRemap(const vector<int>& origin, const vector<int>& mergedInto){
+        /*
+         * New index of every old cluster index after mergeCluster() steps, given the
+         * old index of every remaining cluster and the old target of every merged one,
+         * applied to the spilled and posted line IDs.
+         */
+        vector<int> remap(mergedInto.size());
+        for (int c = 0; c < origin.size(); c++)
+            remap[origin[c]] = c;
+        // Targets always precede the merged cluster and are never merged in the same call.
+        for (int c = 0; c < mergedInto.size(); c++)
+            if (mergedInto[c] >= 0)
+                remap[c] = remap[mergedInto[c]];
+        if (spill && origin.size() < mergedInto.size())
+            spill->remap(remap);
+        if (postings && origin.size() < mergedInto.size())
+            postings->remap(remap);
+        if (counters && origin.size() < mergedInto.size())
+            counters->remap(remap);
+        return remap;
+    }
+
+    void setEviction(size_t hotClusters, const string& storePath, bool fresh = false){
+        /*
+         * Keeps at most hotClusters templates (0 disables) in logClust and the trie,
+         * evicting the coldest ones with their line IDs to the store at storePath.
+         * Evicted templates are matched again only when the hot set has no match.
+         * An existing store is resumed unless fresh, which truncates it.
+         */
+        if (hotClusters > 0 && deferred)
+            throw logic_error("Eviction and deferred matching are exclusive");
+        this->hotClusters = hotClusters;
+        cold = storePath.empty() ? nullptr : make_unique<ColdStore>(storePath, fresh);
+    }
+
+    vector<int> evict(int lastLine){
+        /*
+         * Moves the coldest clusters (oldest last line, then fewest hits) to the cold
+         * store until at most hotClusters remain. Only clusters not seen after lastLine
+         * are eligible, so the lines of the batch being parsed keep their cluster.
+         * Returns the new index of every old cluster index, -1 for evicted ones.
+         */
+        vector<int> remap(logClust.size());
+        iota(remap.begin(), remap.end(), 0);
+        if (!cold || hotClusters == 0 || logClust.size() <= hotClusters)
+            return remap;
+        vector<int> eligible;
+        for (int c = 0; c < logClust.size(); c++)
+            if (logClust[c].lastSeen <= lastLine)
+                eligible.push_back(c);
+        size_t excess = min(logClust.size() - hotClusters, eligible.size());
+        if (excess == 0)
+            return remap;
+        auto colder = [this](int a, int b){
+            const auto &x = logClust[a], &y = logClust[b];
+            return x.lastSeen != y.lastSeen ? x.lastSeen < y.lastSeen : x.hits < y.hits;
+        };
+        nth_element(eligible.begin(), eligible.begin() + excess - 1, eligible.end(), colder);
+        eligible.resize(excess);
+
+        for (int c : eligible) {
+            TemplateCluster &cluster = logClust[c];
+            cold->put({cluster.logTemplate, lineIds(c), cluster.lastSeen, cluster.hits});
+            removeSeqFromPrefixTree(trieRoot, cluster);
+            remap[c] = -1;
+            if (counters)
+                counters->closeCluster(c);
+        }
+        if (counters)
+            writeCounts();
+        int next = 0;
+        for (int c = 0; c < logClust.size(); c++) {
+            if (remap[c] < 0)
+                continue;
+            if (next != c)
+                logClust[next] = std::move(logClust[c]);
+            remap[c] = next++;
+        }
+        logClust.erase(logClust.begin() + next, logClust.end());
+        if (spill)
+            spill->remap(remap);
+        // Evicted lists come back from the store's line IDs on promotion.
+        if (postings)
+            postings->remap(remap);
+        if (counters)
+            counters->remap(remap);
+        consolidateCursor = 1;
+        return remap;
+    }
+
+    optional<TemplateCluster*> promote(const Tokens& tokMsg, const Tokens& constLogMsg){
+        /*
+         * Matches the line against the cold store with the in-memory rules, on the
+         * entries sharing enough tokens with it, and moves the matching template back
+         * into logClust and the trie, generalized as LCSMatch would.
+         */
+        if (!cold || cold->size() == 0)
+            return nullopt;
+        Tokens msgSet(tokMsg, tokMsg.get_allocator());
+        uniqueTokens(msgSet);
+        vector<int> entries;
+        cold->candidates(msgSet, .5 * tokMsg.size(), entries);
+        if (entries.empty())
+            return nullopt;
+        vector<TemplateCluster> loaded;
+        for (int entry : entries)
+            loaded.emplace_back(cold->read(entry).logTemplate);
+        bool lcsMatched = false;
+        auto match = simpleLoopMatch(loaded, constLogMsg);
+        if (!match.has_value()) {
+            match = LCSMatch(loaded, tokMsg);
+            lcsMatched = true;
+        }
+        if (!match.has_value())
+            return nullopt;
+
+        auto taken = cold->take(entries[match.value() - loaded.data()]);
+        TemplateCluster &promoted = logClust.emplace_back(std::move(taken.logTemplate), std::move(taken.logIds));
+        if (postings)
+            for (int id : promoted.logIds)
+                postings->add((int) logClust.size() - 1, id);
+        promoted.lastSeen = taken.lastSeen;
+        promoted.hits = taken.hits;
+        addSeqToPrefixTree(trieRoot, promoted);
+        if (lcsMatched)
+            generalize(promoted, tokMsg);
+        return &promoted;
+    }
+
+    void setDeferredMatching(bool enable){
+        /*
+         * In deferred mode a line missed by the trie and simpleLoopMatch gets a new,
+         * provisional cluster at once, and LCSMatch with its generalization runs on a
+         * worker thread, so a line never waits for a scan of every template. Merges
+         * found by the worker are applied by applyDeferred(), which parseEach() calls
+         * after each line. Exclusive with consolidation and eviction.
+         */
+        if (enable == (deferred != nullptr))
+            return;
+        if (!enable) {
+            applyDeferred(true);
+            deferred.reset();
+            stableIds.clear();
+            return;
+        }
+        if (maxClusters > 0 || hotClusters > 0)
+            throw logic_error("Consolidation, eviction and deferred matching are exclusive");
+        deferred = make_unique<DeferredWork>();
+        deferred->worker = thread(deferredWorker, deferred.get(), tau);
+        resetDeferred();
+    }
+
+    void resetDeferred(){
+        // Renames the clusters and replaces the mirror of the worker with them.
+        stableIds.clear();
+        deferred->post({DeferredWork::Reset, 0, {}});
+        for (const TemplateCluster& cluster : logClust) {
+            stableIds.push_back(++nextStableId);
+            deferred->post({DeferredWork::Seed, stableIds.back(), cluster.logTemplate});
+        }
+    }
+
+    vector<int> applyDeferred(bool wait = false){
+        /*
+         * Applies the merges the worker has found so far (after it has matched every
+         * provisional cluster if wait): the template of the target is replaced by the
+         * generalized one, and the provisional cluster is merged into it. Returns the
+         * new index of every old cluster index, as consolidate() does.
+         */
+        vector<int> origin(logClust.size());
+        iota(origin.begin(), origin.end(), 0);
+        vector<int> mergedInto(logClust.size(), -1);
+        if (!deferred)
+            return origin;
+        vector<DeferredWork::Merge> merges;
+        {
+            unique_lock<mutex> guard(deferred->lock);
+            if (wait)
+                deferred->idle.wait(guard, [this]{ return deferred->pending == 0; });
+            merges.swap(deferred->merges);
+        }
+        auto indexOf = [this](uint64_t id){
+            return (size_t) (lower_bound(stableIds.begin(), stableIds.end(), id) - stableIds.begin());
+        };
+        for (auto &merge : merges) {
+            size_t c = indexOf(merge.cluster), t = indexOf(merge.target);
+            TemplateCluster &target = logClust[t];
+            if (target.logTemplate != merge.logTemplate) {
+                vector<string> old = std::move(target.logTemplate);
+                target.logTemplate = std::move(merge.logTemplate);
+                target.version++;
+                rewriteSeqInPrefixTree(trieRoot, old, target);
+            }
+            mergedInto[origin[c]] = origin[t];
+            mergeCluster(c, target);
+            origin.erase(origin.begin() + c);
+            stableIds.erase(stableIds.begin() + c);
+        }
+        return mergeRemap(origin, mergedInto);
+    }
+
+    static void deferredWorker(DeferredWork* work, float tau){
+        /*
+         * Matches provisional clusters in the order they were made, with the rules
+         * of assign() but against the settled templates only: a match generalizes
+         * the mirrored template and is posted as a merge, otherwise the cluster
+         * settles as a template of its own.
+         */
+#if __has_include(<sys/resource.h>) && defined(__linux__)
+        // Lowest priority, so on a busy machine the worker yields to the threads feeding lines.
+        setpriority(PRIO_PROCESS, (id_t) gettid(), 19);
+#endif
+        Parser mirror(tau);
+        vector<uint64_t> ids;
+        unique_lock<mutex> guard(work->lock);
+        while (true) {
+            work->wake.wait(guard, [work]{ return work->stop || !work->jobs.empty(); });
+            if (work->stop)
+                return;
+            DeferredWork::Job job = std::move(work->jobs.front());
+            work->jobs.pop_front();
+            guard.unlock();
+
+            optional<DeferredWork::Merge> merge;
+            if (job.kind == DeferredWork::Reset) {
+                mirror.logClust.clear();
+                mirror.trieRoot = TrieNode();
+                ids.clear();
+            } else {
+                optional<TemplateCluster*> match;
+                if (job.kind == DeferredWork::Match) {
+                    mirror.scratch.reset();
+                    Tokens tokMsg(job.logTemplate.begin(), job.logTemplate.end(), mirror.scratch.resource());
+                    Tokens constLogMsg(mirror.scratch.resource());
+                    copy_if(tokMsg.begin(), tokMsg.end(), back_inserter(constLogMsg),
+                            [](string_view s){return s != "<*>";});
+                    match = mirror.prefixTreeMatch(mirror.trieRoot, constLogMsg, 0);
+                    if (!match.has_value())
+                        match = mirror.simpleLoopMatch(mirror.logClust, constLogMsg);
+                    if (!match.has_value()) {
+                        match = mirror.LCSMatch(mirror.logClust, tokMsg);
+                        if (match.has_value())
+                            mirror.generalize(*match.value(), tokMsg);
+                    }
+                }
+                if (match.has_value()) {
+                    // Trie matches point at the copy in the leaf, the target is the first equal template.
+                    const auto &logTemplate = match.value()->logTemplate;
+                    size_t t = find_if(mirror.logClust.begin(), mirror.logClust.end(), [&](const TemplateCluster& c){
+                        return c.logTemplate == logTemplate;
+                    }) - mirror.logClust.begin();
+                    merge = DeferredWork::Merge{job.cluster, ids[t], logTemplate};
+                } else {
+                    mirror.addTemplate(std::move(job.logTemplate));
+                    ids.push_back(job.cluster);
+                }
+            }
+
+            guard.lock();
+            if (merge.has_value())
+                work->merges.push_back(std::move(merge.value()));
+            if (--work->pending == 0)
+                work->idle.notify_all();
+        }
+    }
+
+    int feed(string_view logMsg, int logID){
+        /*
+         * Parses a single line with the given ID and returns the index in logClust
+         * of the cluster it was assigned to.
+         */
+        // Temporaries of the previous line are gone, start over at the head of the arena.
+        scratch.reset();
+        Tokens tokMsg(scratch.resource());
+        tokenizer().tokenize(logMsg, tokMsg);
+        return assign(tokMsg, logID);
+    }
+
+    int feedTokens(const string_view* tokens, size_t n, int logID){
+        /*
+         * feed() for a line already split by tokenizer(), e.g. on a read-ahead
+         * thread. The views must stay valid for the duration of the call.
+         */
+        scratch.reset();
+        Tokens tokMsg(tokens, tokens + n, scratch.resource());
+        return assign(tokMsg, logID);
+    }
+
+    int assign(const Tokens& tokMsg, int logID){
+        Tokens constLogMsg(scratch.resource());
+        constLogMsg.reserve(tokMsg.size());
+        copy_if (tokMsg.begin(), tokMsg.end(),
+                 back_inserter(constLogMsg),
+                 [](string_view s){return s != "<*>";});
+
+        optional<TemplateCluster *>  matchCluster = prefixTreeMatch(trieRoot, constLogMsg, 0);
+        if (!matchCluster.has_value()){
+            matchCluster = simpleLoopMatch(logClust, constLogMsg);
+            if (!matchCluster.has_value() && deferred){
+                // Provisional until the worker has matched it against the settled templates.
+                logClust.emplace_back(vector<string>(tokMsg.begin(), tokMsg.end()), vector<int>{logID});
+                addSeqToPrefixTree(trieRoot, logClust.back());
+                if (postings)
+                    postings->add((int) logClust.size() - 1, logID);
+                stableIds.push_back(++nextStableId);
+                deferred->post({DeferredWork::Match, stableIds.back(), logClust.back().logTemplate});
+                return (int) logClust.size() - 1;
+            }
             if (!matchCluster.has_value()){
-                matchCluster = simpleLoopMatch(logClust, constLogMsg);
-                if (!matchCluster.has_value()){
-                    matchCluster = LCSMatch(logClust, tokMsg);
+                matchCluster = LCSMatch(logClust, tokMsg);
+                if (matchCluster.has_value()){
+//                    cout << "Inner TRUE" << endl;
+                    generalize(*matchCluster.value(), tokMsg);
+                }else{
+                    // Evicted templates are only looked up once the hot set has no match.
+                    matchCluster = promote(tokMsg, constLogMsg);
                     if (!matchCluster.has_value()){
 //                        cout << "Inner FALSE" << endl;
 
-                        vector<int> ids = {logID};
-                        auto newCluster = TemplateCluster(tokMsg, ids);
-                        logClust.push_back(newCluster);
-                        addSeqToPrefixTree(trieRoot, newCluster);
-                    }else{
-//                        cout << "Inner TRUE" << endl;
-                        auto matchClustTemp = (*matchCluster.value()).logTemplate;
-                        auto newTemplate = getTemplate(LCS(tokMsg, matchClustTemp), matchClustTemp);
-                        if (newTemplate != matchClustTemp){
-                            removeSeqFromPrefixTree(trieRoot, *matchCluster.value());
-                            (*matchCluster.value()).logTemplate = newTemplate;
-                            addSeqToPrefixTree(trieRoot, *matchCluster.value());
-                        }
+                        logClust.emplace_back(vector<string>(tokMsg.begin(), tokMsg.end()), vector<int>{logID});
+                        addSeqToPrefixTree(trieRoot, logClust.back());
+                        if (postings)
+                            postings->add((int) logClust.size() - 1, logID);
+                        return (int) logClust.size() - 1;
                     }
                 }
             }
-            if (matchCluster.has_value()){
-//                cout << "Outer TRUE" << endl;
+        }
+//        cout << "Outer TRUE" << endl;
+        for (int c = 0; c < logClust.size(); c++) {
+            if ((*matchCluster.value()).logTemplate == logClust[c].logTemplate) {
+                logClust[c].logIds.push_back(logID);
+                if (postings)
+                    postings->add(c, logID);
+                logClust[c].lastSeen = logID;
+                logClust[c].hits++;
+                return c;
+            }
+        }
+        return -1;
+    }
 
-                for (TemplateCluster& logCluster : logClust) {
-                    if ((*matchCluster.value()).logTemplate == logCluster.logTemplate) {
-                        logCluster.logIds.push_back(logID);
-                        break;
-                    }
-                }
+    const vector<TemplateCluster>& parse(const vector<string>& content, const int lastLine=0,
+                                         const vector<string>& times = {}){
+        /*
+         * times, if given, holds the time fields of every line (e.g. "081109 203615"),
+         * counted into the time buckets set by setTimeBuckets().
+         */
+//        cout << "parse START" << endl;
+        if (!times.empty() && times.size() != content.size())
+            throw invalid_argument("One time per line expected");
+        bool timed = counters && !times.empty();
+        parseEach(content.size(), lastLine, [&](size_t k, int logID){
+//            cout << "Loop: " << k + 1 << " Msg: "<< content[k] << endl;
+            int c = feed(content[k], logID);
+            if (timed)
+                countLine(c, lineTime({times[k]}));
+        });
+        applyDeferred(true);
+        return logClust;
+    }
+
+    template <class FeedLine>
+    void parseEach(size_t lines, const int lastLine, FeedLine&& feedLine){
+        /*
+         * Runs feedLine(k, lastLine + k + 1) for the k-th of lines, with the
+         * consolidation, retention and eviction steps parse() takes between lines.
+         */
+        if (hotClusters > 0)
+            evict(lastLine);
+        size_t i = 1;
+        for (size_t k = 0; k < lines; k++){
+            int logID = (int) i + lastLine;
+            feedLine(k, logID);
+            if (deferred)
+                applyDeferred();
+            if (maxClusters > 0 && logClust.size() > maxClusters && logClust.size() > settledClusters)
+                consolidate(consolidateBudget);
+            if (keepIds > 0 || idWindow > 0) {
+                if (i % retentionInterval == 0 || i == lines)
+                    enforceRetention(logID);
+            }
+            if (hotClusters > 0 && i % retentionInterval == 0)
+                evict(lastLine);
+            // Counted across calls, so small batches (a daemon's frames) do not walk the state each time.
+            if ((softBudget > 0 || hardBudget > 0) && ++budgetLines >= retentionInterval) {
+                budgetLines = 0;
+                enforceMemoryBudget();
             }
             i++;
-            if (i % 10000 == 0 || i == content.size() ){
+            if (progress && (i % 10000 == 0 || i == lines)){
                 auto now = chrono::system_clock::now();
                 auto time = chrono::system_clock::to_time_t(now);
                 auto timestamp = strtok(ctime(&time), "\n");
 //                chrono::duration<double> elapsed_seconds = end-start;
 //                elapsed_seconds.count()
-                printf("[%s] Processed %2.2lu%% of log lines.\n",timestamp, 100*i/content.size());
-//                printf("%s Processed %2.2lu%% of log lines.\n",ctime(&time), 100*i/content.size());
+                printf("[%s] Processed %2.2lu%% of log lines.\n",timestamp, 100*i/lines);
+//                printf("%s Processed %2.2lu%% of log lines.\n",ctime(&time), 100*i/lines);
             }
         }
-        return logClust;
+    }
+
+    static void parameters(const vector<string>& logTemplate, string_view content, vector<string_view>& out,
+                           const Masker* splitter = nullptr){
+        /*
+         * Values of the "<*>" of logTemplate in content, as LogParser.get_parameter_list
+         * finds them but without regexes: content is split without masking (on the
+         * delimiters of splitter if given), each constant token is looked up in order
+         * and the tokens in between go to the wildcards, the last wildcard of a run
+         * taking all of them. Values are views into content, stripped of surrounding
+         * punctuation.
+         */
+        static const Masker plain({});
+        static thread_local vector<string_view> toks;
+        out.clear();
+        toks.clear();
+        (splitter ? *splitter : plain).tokenize(content, toks);
+        size_t t = 0;
+        for (size_t k = 0; k < logTemplate.size(); k++) {
+            if (logTemplate[k] != "<*>") {
+                size_t found = t;
+                while (found < toks.size() && toks[found] != logTemplate[k])
+                    found++;
+                if (found < toks.size())
+                    t = found + 1;
+                continue;
+            }
+            if (t >= toks.size())
+                continue;
+            size_t end = t + 1;
+            if (k + 1 == logTemplate.size())
+                end = toks.size();
+            else if (logTemplate[k + 1] != "<*>")
+                while (end < toks.size() && toks[end] != logTemplate[k + 1])
+                    end++;
+            string_view value(toks[t].data(), toks[end - 1].data() + toks[end - 1].size() - toks[t].data());
+            size_t b = 0, e = value.size();
+            while (b < e && ispunct((unsigned char) value[b]))
+                b++;
+            while (e > b && ispunct((unsigned char) value[e - 1]))
+                e--;
+            out.push_back(value.substr(b, e - b));
+            t = end;
+        }
+    }
+
+    vector<int> clustersOf(int lastLine, size_t lines){
+        /*
+         * Cluster index of lines lastLine + 1 ... lastLine + lines, -1 for the ones
+         * no cluster in memory holds (evicted, purged).
+         */
+        vector<int> clusterOf(lines, -1);
+        int last = lastLine + (int) lines;
+        for (int c = 0; c < logClust.size(); c++) {
+            for (int id : spill ? lineIds(c) : logClust[c].logIds)
+                if (id > lastLine && id <= last)
+                    clusterOf[id - lastLine - 1] = c;
+        }
+        return clusterOf;
+    }
+
+    // Content is any sequence of strings or string_views.
+    template <class Content>
+    void writeColumns(ColumnarWriter& out, const Content& content, int lastLine, bool withParameters = true){
+        /*
+         * Appends the lines of content, parsed as lines lastLine + 1 ... by parse(),
+         * as one segment: line ID, cluster index (-1 if not found in memory), the
+         * parameters if asked, and the current template of every cluster.
+         */
+        vector<int> clusterOf = clustersOf(lastLine, content.size());
+        vector<string_view> params;
+        for (size_t i = 0; i < content.size(); i++) {
+            params.clear();
+            if (withParameters && clusterOf[i] >= 0)
+                parameters(logClust[clusterOf[i]].logTemplate, content[i], params, splitter.get());
+            out.addRow(lastLine + (int) i + 1, clusterOf[i], params);
+        }
+        for (int c = 0; c < logClust.size(); c++)
+            out.addTemplate(c, logClust[c].logTemplate);
+        out.flush();
+    }
+
+    void writeColumns(const string& path, const vector<string>& content, int lastLine, bool withParameters = true){
+        ColumnarWriter out(path);
+        writeColumns(out, content, lastLine, withParameters);
+    }
+
+    /*
+     * Binary snapshot of the clusters and the prefix tree, replacing the pickled
+     * rootNode/logCluL pair for native drivers:
+     *     [uint32 magic][uint32 version][uint32 clusters] cluster * clusters  node
+     *     cluster: [int32 lastSeen][uint32 hits][uint32 version] strings [uint32 ids][int32 id] * ids
+     *     node:    [int32 templateNo][uint8 leaf] (strings if leaf)
+     *              [uint32 children] ([string key] node) * children
+     * The tree is stored as is rather than rebuilt from logClust, since leaves may
+     * keep the first of several templates sharing their constant tokens.
+     * Version 1 snapshots, without template versions, are still read.
+     */
+    static constexpr uint32_t stateMagic = 0x53505343; // "CSPS"
+    static constexpr uint32_t stateVersion = 2;
+
+    void saveState(ostream& out) const {
+        writeState<uint32_t>(out, stateMagic);
+        writeState<uint32_t>(out, stateVersion);
+        writeState<uint32_t>(out, (uint32_t) logClust.size());
+        for (const TemplateCluster& c : logClust) {
+            writeState<int32_t>(out, c.lastSeen);
+            writeState<uint32_t>(out, c.hits);
+            writeState<uint32_t>(out, c.version);
+            writeStrings(out, c.logTemplate);
+            writeState<uint32_t>(out, (uint32_t) c.logIds.size());
+            out.write(reinterpret_cast<const char*>(c.logIds.data()), (streamsize) (c.logIds.size() * sizeof(int32_t)));
+        }
+        writeNode(out, trieRoot);
+        if (!out)
+            throw runtime_error("Cannot write parser state");
+    }
+
+    void loadState(istream& in){
+        /*
+         * Replaces clusters and prefix tree with a snapshot written by saveState().
+         * Retention, masking, consolidation and eviction settings are kept.
+         */
+        uint32_t magic = 0, version = 0, clusters = 0;
+        readState(in, magic);
+        readState(in, version);
+        if (magic != stateMagic || version < 1 || version > stateVersion)
+            throw runtime_error("Not a parser state snapshot");
+        readState(in, clusters);
+        vector<TemplateCluster> loaded(clusters);
+        for (TemplateCluster& c : loaded) {
+            uint32_t ids = 0;
+            readState(in, c.lastSeen);
+            readState(in, c.hits);
+            if (version >= 2)
+                readState(in, c.version);
+            readStrings(in, c.logTemplate);
+            readState(in, ids);
+            c.logIds.resize(ids);
+            if (!in.read(reinterpret_cast<char*>(c.logIds.data()), (streamsize) (ids * sizeof(int32_t))))
+                throw runtime_error("Truncated parser state");
+        }
+        TrieNode root;
+        readNode(in, root);
+        // Merges of the clusters being replaced are settled first, the results are dropped.
+        applyDeferred(true);
+        flushCounts();
+        logClust = std::move(loaded);
+        trieRoot = std::move(root);
+        if (postings)
+            setPostings(true);
+        if (deferred)
+            resetDeferred();
+        consolidateCursor = 1;
+        settledClusters = 0;
+        sweepMerged = false;
+    }
+
+    template <class T>
+    static void writeState(ostream& out, T value) {
+        out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    template <class T>
+    static void readState(istream& in, T& value) {
+        if (!in.read(reinterpret_cast<char*>(&value), sizeof(value)))
+            throw runtime_error("Truncated parser state");
+    }
+
+    static void writeString(ostream& out, const string& s) {
+        writeState<uint32_t>(out, (uint32_t) s.size());
+        out.write(s.data(), (streamsize) s.size());
+    }
+
+    static void readString(istream& in, string& s) {
+        uint32_t len = 0;
+        readState(in, len);
+        s.resize(len);
+        if (!in.read(s.data(), len))
+            throw runtime_error("Truncated parser state");
+    }
+
+    static void writeStrings(ostream& out, const vector<string>& v) {
+        writeState<uint32_t>(out, (uint32_t) v.size());
+        for (const string& s : v)
+            writeString(out, s);
+    }
+
+    static void readStrings(istream& in, vector<string>& v) {
+        uint32_t n = 0;
+        readState(in, n);
+        v.resize(n);
+        for (string& s : v)
+            readString(in, s);
+    }
+
+    static void writeNode(ostream& out, const TrieNode& node) {
+        writeState<int32_t>(out, node.templateNo);
+        writeState<uint8_t>(out, node.cluster.has_value());
+        if (node.cluster.has_value())
+            writeStrings(out, node.cluster->logTemplate);
+        writeState<uint32_t>(out, (uint32_t) node.child.size());
+        for (const auto &child : node.child) {
+            writeString(out, child.first);
+            writeNode(out, child.second);
+        }
+    }
+
+    static void readNode(istream& in, TrieNode& node) {
+        uint8_t leaf = 0;
+        uint32_t children = 0;
+        readState(in, node.templateNo);
+        readState(in, leaf);
+        if (leaf) {
+            node.cluster.emplace();
+            readStrings(in, node.cluster->logTemplate);
+        }
+        readState(in, children);
+        for (uint32_t c = 0; c < children; c++) {
+            string key;
+            readString(in, key);
+            auto &child = node.child.try_emplace(key).first->second;
+            child.token = key;
+            readNode(in, child);
+        }
+    }
+};
+
+class FrozenParser {
+    /*
+     * Read-only classifier over the templates of a Parser at the time it was
+     * frozen: the trie, loop and LCS matches of Parser::assign() without any
+     * learning, so any number of threads can share one without locks. Lines no
+     * template matches get -1, to be fed to a learning Parser. The loop and LCS
+     * matches look clusters up through an inverted index of template tokens
+     * instead of scanning every template; LCS scoring runs on token IDs fixed
+     * at freeze time.
+     */
+public:
+    struct Node {
+        // Index of the first cluster with the leaf template, -1 if none has it any more.
+        int cluster = -1;
+        bool leaf = false;
+        size_t constLen = 0;
+        map<string, Node, less<>> child;
+    };
+
+    // Cluster index of every line, and the positions of the lines with -1.
+    struct Classification {
+        vector<int> clusters;
+        vector<size_t> unmatched;
+    };
+
+    const vector<vector<string>> templates;
+
+    explicit FrozenParser(const Parser& parser)
+            : templates(copyTemplates(parser)), tau(parser.tau), masker(parser.masker) {
+        map<vector<string>, int> firstOf;
+        for (int c = 0; c < (int) templates.size(); c++)
+            firstOf.try_emplace(templates[c], c);
+        for (const auto &tmpl : templates)
+            canonical.push_back(firstOf.at(tmpl));
+        freezeNode(parser.trieRoot, root, firstOf);
+
+        clusters.resize(templates.size());
+        for (int c = 0; c < (int) templates.size(); c++) {
+            Cluster &cluster = clusters[c];
+            vector<int> distinct;
+            for (const string& tok : templates[c]) {
+                int id = tokenIds.try_emplace(tok, (int) tokenIds.size()).first->second;
+                cluster.ids.push_back(id);
+                distinct.push_back(id);
+            }
+            sort(distinct.begin(), distinct.end());
+            distinct.erase(unique(distinct.begin(), distinct.end()), distinct.end());
+            cluster.hasWildcard = find(templates[c].begin(), templates[c].end(), "<*>") != templates[c].end();
+            cluster.constTokens = (int) distinct.size() - cluster.hasWildcard;
+            if (cluster.constTokens == 0)
+                wildcardOnly.push_back(c);
+            postings.resize(tokenIds.size());
+            for (int id : distinct)
+                postings[id].push_back(c);
+        }
+        auto wildcard = tokenIds.find("<*>");
+        wildcardId = wildcard == tokenIds.end() ? TokenIds::unknown : wildcard->second;
+    }
+
+    FrozenParser(const FrozenParser&) = delete;
+    FrozenParser& operator=(const FrozenParser&) = delete;
+
+    size_t size() const { return templates.size(); }
+
+    int classify(string_view logMsg) const {
+        /*
+         * Index of the cluster the learning parser would have put the line in
+         * without creating or generalizing a template, -1 if none matches.
+         */
+        static thread_local ScratchArena scratch;
+        scratch.reset();
+        Tokens tokMsg(scratch.resource());
+        (masker ? *masker : plainTokenizer()).tokenize(logMsg, tokMsg);
+        return classifyTokens(tokMsg);
+    }
+
+    Classification classify(const vector<string>& lines, int threads = 1) const {
+        Classification res;
+        res.clusters.assign(lines.size(), -1);
+        int tMax = max(1, min(threads, (int) lines.size()));
+        auto run = [&](int t){
+            for (size_t i = lines.size() * t / tMax; i < lines.size() * (t + 1) / tMax; i++)
+                res.clusters[i] = classify(lines[i]);
+        };
+        vector<thread> pool;
+        for (int t = 1; t < tMax; t++)
+            pool.emplace_back(run, t);
+        run(0);
+        for (auto &th : pool)
+            th.join();
+        for (size_t i = 0; i < lines.size(); i++)
+            if (res.clusters[i] < 0)
+                res.unmatched.push_back(i);
+        return res;
+    }
+
+private:
+    struct Cluster {
+        // Token IDs of the template.
+        vector<int> ids;
+        // Distinct tokens other than "<*>".
+        int constTokens = 0;
+        bool hasWildcard = false;
+    };
+
+    const float tau;
+    shared_ptr<const Masker> masker;
+    Node root;
+    vector<int> canonical;
+    vector<Cluster> clusters;
+    // Views into templates, which never change.
+    unordered_map<string_view, int> tokenIds;
+    // Clusters holding each token ID, in index order.
+    vector<vector<int>> postings;
+    vector<int> wildcardOnly;
+    int wildcardId = TokenIds::unknown;
+
+    static vector<vector<string>> copyTemplates(const Parser& parser) {
+        vector<vector<string>> res;
+        for (const TemplateCluster& c : parser.logClust)
+            res.push_back(c.logTemplate);
+        return res;
+    }
+
+    static const Masker& plainTokenizer() {
+        static const Masker plain({});
+        return plain;
+    }
+
+    static void freezeNode(const TrieNode& node, Node& frozen, const map<vector<string>, int>& firstOf) {
+        if (node.cluster.has_value()) {
+            // Leaves of templates generalized away since keep the old one, which matches no cluster.
+            auto it = firstOf.find(node.cluster->logTemplate);
+            frozen.leaf = true;
+            frozen.cluster = it == firstOf.end() ? -1 : it->second;
+            frozen.constLen = count_if(node.cluster->logTemplate.begin(), node.cluster->logTemplate.end(),
+                                       [](const string& s){ return s != "<*>"; });
+        }
+        for (const auto &child : node.child)
+            freezeNode(child.second, frozen.child[child.first], firstOf);
+    }
+
+    int classifyTokens(const Tokens& tokMsg) const {
+        auto mem = tokMsg.get_allocator().resource();
+        Tokens constLogMsg(mem);
+        copy_if(tokMsg.begin(), tokMsg.end(), back_inserter(constLogMsg), [](string_view s){ return s != "<*>"; });
+
+        // Parser::prefixTreeMatch
+        const Node *node = &root;
+        for (string_view tok : constLogMsg) {
+            auto child = node->child.find(tok);
+            if (child == node->child.end())
+                continue;
+            if (child->second.leaf) {
+                if (child->second.constLen >= tau * constLogMsg.size())
+                    return child->second.cluster;
+            } else
+                node = &child->second;
+        }
+
+        // Distinct message tokens shared with each template.
+        static thread_local vector<int> shared;
+        static thread_local vector<int> touched;
+        if (shared.size() < clusters.size())
+            shared.resize(clusters.size());
+        touched.clear();
+        pmr::vector<int> msgIds(mem);
+        bool msgWildcard = false;
+        for (string_view tok : tokMsg) {
+            auto it = tokenIds.find(tok);
+            msgIds.push_back(it == tokenIds.end() ? TokenIds::unknown : it->second);
+        }
+        pmr::vector<int> distinct(msgIds, mem);
+        sort(distinct.begin(), distinct.end());
+        distinct.erase(unique(distinct.begin(), distinct.end()), distinct.end());
+        for (int id : distinct) {
+            if (id == TokenIds::unknown)
+                continue;
+            msgWildcard |= id == wildcardId;
+            for (int c : postings[id])
+                if (shared[c]++ == 0)
+                    touched.push_back(c);
+        }
+        sort(touched.begin(), touched.end());
+        int res = match(tokMsg, constLogMsg, msgIds, msgWildcard, shared, touched);
+        for (int c : touched)
+            shared[c] = 0;
+        return res;
+    }
+
+    int match(const Tokens& tokMsg, const Tokens& constLogMsg, const pmr::vector<int>& msgIds, bool msgWildcard,
+              const vector<int>& shared, const vector<int>& touched) const {
+        // Parser::simpleLoopMatch: the first template of at least half the constant tokens whose constants all occur.
+        auto loopFits = [&](int c){ return templates[c].size() >= .5 * constLogMsg.size(); };
+        int loop = -1;
+        for (int c : touched)
+            if (shared[c] - (msgWildcard && clusters[c].hasWildcard) == clusters[c].constTokens && loopFits(c)) {
+                loop = c;
+                break;
+            }
+        for (int c : wildcardOnly) {
+            if (loop >= 0 && c > loop)
+                break;
+            if (loopFits(c)) {
+                loop = c;
+                break;
+            }
+        }
+        if (loop >= 0)
+            return canonical[loop];
+
+        // Parser::LCSMatch over the templates sharing half the message's tokens.
+        double msgLen = tokMsg.size();
+        auto mem = tokMsg.get_allocator().resource();
+        pmr::vector<int> candidates(mem);
+        if (msgLen == 0) {
+            candidates.resize(clusters.size());
+            iota(candidates.begin(), candidates.end(), 0);
+        } else {
+            for (int c : touched)
+                if (shared[c] >= .5 * msgLen)
+                    candidates.push_back(c);
+        }
+        const size_t lanes = LcsBatch::lanes;
+        pmr::vector<int> block(mem), rows(mem);
+        int scores[LcsBatch::lanes];
+        int maxLen = -1, best = -1;
+        for (size_t b = 0; b < candidates.size(); b += lanes) {
+            size_t count = min(lanes, candidates.size() - b);
+            size_t columns = 0;
+            for (size_t l = 0; l < count; l++)
+                columns = max(columns, clusters[candidates[b + l]].ids.size());
+            block.assign(columns * lanes, LcsBatch::padding);
+            for (size_t l = 0; l < count; l++) {
+                const auto &ids = clusters[candidates[b + l]].ids;
+                for (size_t j = 0; j < ids.size(); j++)
+                    block[j * lanes + l] = ids[j];
+            }
+            rows.resize(LcsBatch::workspaceSize(columns));
+            LcsBatch::score(msgIds.data(), msgIds.size(), block.data(), columns, rows.data(), scores);
+            for (size_t l = 0; l < count; l++) {
+                int c = candidates[b + l];
+                if (scores[l] > maxLen || (scores[l] == maxLen && templates[c].size() < templates[best].size())) {
+                    maxLen = scores[l];
+                    best = c;
+                }
+            }
+        }
+        if (best >= 0 && maxLen >= tau * msgLen)
+            return canonical[best];
+        return -1;
     }
 };
 
+class ParserRouter {
+    /*
+     * Routes every line to a Parser keyed by one header field of the log format
+     * (e.g. Component or Level), so matching only scans the templates of the
+     * line's own partition. Partitions share the masking rules, are parsed on
+     * separate threads without locks and are remapped after each batch into one
+     * global cluster ID space, assigned in partition key order.
+     */
+public:
+    LogFormat format;
+    int keyField;
+    int contentField;
+    const float tau;
+    shared_ptr<const Masker> masker;
+    map<string, Parser> parsers;
+    vector<pair<string, int>> clusterIds;
+    map<string, vector<int>> globalIds;
+
+    ParserRouter(const string& logFormat, const string& key, float tau, const string& content = "Content")
+            : format(logFormat), tau(tau){
+        keyField = format.indexOf(key);
+        contentField = format.indexOf(content);
+        if (keyField < 0 || contentField < 0)
+            throw invalid_argument("Log format " + logFormat + " lacks <" + key + "> or <" + content + ">");
+    }
+
+    void setMasking(const vector<string>& rules){
+        masker = rules.empty() ? nullptr : make_shared<const Masker>(rules);
+        for (auto &p : parsers)
+            p.second.masker = masker;
+    }
+
+    Parser& partition(const string& key){
+        auto it = parsers.find(key);
+        if (it == parsers.end()) {
+            it = parsers.emplace(piecewise_construct, forward_as_tuple(key), forward_as_tuple(tau)).first;
+            it->second.masker = masker;
+        }
+        return it->second;
+    }
+
+    const TemplateCluster& cluster(int globalId) const {
+        const auto &owner = clusterIds.at(globalId);
+        return parsers.at(owner.first).logClust.at(owner.second);
+    }
+
+    vector<int> parse(const vector<string>& lines, int lastLine=0, int threads=1){
+        /*
+         * Returns the global cluster ID of every line, -1 for lines that do not fit
+         * the log format. Line IDs follow the position in lines.
+         */
+        vector<int> res(lines.size(), -1);
+        vector<string_view> contents(lines.size());
+        map<string, vector<int>> partitions;
+        vector<string_view> fields;
+        for (int i = 0; i < lines.size(); i++) {
+            if (!format.extract(lines[i], fields))
+                continue;
+            contents[i] = fields[contentField];
+            partitions[string(fields[keyField])].push_back(i);
+        }
+
+        // Largest partitions first, each to the least loaded thread.
+        vector<pair<Parser*, const vector<int>*>> work;
+        for (auto &part : partitions)
+            work.emplace_back(&partition(part.first), &part.second);
+        sort(work.begin(), work.end(), [](const auto& a, const auto& b){
+            return a.second->size() > b.second->size();
+        });
+        int tMax = max(1, min(threads, (int) work.size()));
+        vector<vector<int>> assigned(tMax);
+        vector<size_t> load(tMax);
+        for (int w = 0; w < work.size(); w++) {
+            int t = (int) (min_element(load.begin(), load.end()) - load.begin());
+            assigned[t].push_back(w);
+            load[t] += work[w].second->size();
+        }
+
+        auto run = [&](int t){
+            for (int w : assigned[t]) {
+                Parser &parser = *work[w].first;
+                for (int i : *work[w].second)
+                    res[i] = parser.feed(contents[i], lastLine + i + 1);
+            }
+        };
+        vector<thread> pool;
+        for (int t = 1; t < tMax; t++)
+            pool.emplace_back(run, t);
+        run(0);
+        for (auto &th : pool)
+            th.join();
+
+        for (auto &part : partitions) {
+            auto &ids = globalIds[part.first];
+            const Parser &parser = parsers.at(part.first);
+            while (ids.size() < parser.logClust.size()) {
+                ids.push_back((int) clusterIds.size());
+                clusterIds.emplace_back(part.first, (int) ids.size() - 1);
+            }
+            for (int i : part.second)
+                if (res[i] >= 0)
+                    res[i] = ids[res[i]];
+        }
+        return res;
+    }
+};
+
+class Ingestor {
+    /*
+     * Continuous ingestion of rolled log files (HDFSpartaa, HDFSpartab, ...) into
+     * one Parser kept in memory. Line IDs run on across files, counting the lines
+     * that fit the log format as LogParser.log_to_dataframe does. While a file is
+     * parsed, the next one is read, header-extracted and tokenized on a background
+     * thread, so the contents of at most two files are held in memory. Files may
+     * be gzip or zstd compressed, see LineReader. State is checkpointed at
+     * the end of ingest() and, if set, every checkpointEvery lines; restore()
+     * resumes from the last checkpoint, skipping the lines it already covers.
+     * If the parser counts lines by time bucket, the times are read from the
+     * header along with the contents and the window runs on across files.
+     */
+public:
+    Parser& parser;
+    LogFormat format;
+    int contentField;
+    int lastLine = 0;
+    string checkpointPath;
+    size_t checkpointEvery = 0;
+    // Position covered by the last checkpoint: file and lines of it parsed.
+    string resumeFile;
+    size_t resumeLines = 0;
+
+    Ingestor(Parser& parser, const string& logFormat, const string& content = "Content")
+            : parser(parser), format(logFormat){
+        contentField = format.indexOf(content);
+        if (contentField < 0)
+            throw invalid_argument("Log format " + logFormat + " lacks <" + content + ">");
+    }
+
+    void setCheckpoint(const string& path, size_t everyLines = 0){
+        checkpointPath = path;
+        checkpointEvery = everyLines;
+    }
+
+    static vector<string> expand(const vector<string>& patterns){
+        /*
+         * Files matching each glob pattern in name order, patterns kept in the
+         * given order; a pattern matching nothing is taken as a plain path.
+         */
+        vector<string> res;
+        for (const string& pattern : patterns) {
+#if __has_include(<glob.h>)
+            glob_t found;
+            if (glob(pattern.c_str(), 0, nullptr, &found) == 0) {
+                for (size_t f = 0; f < found.gl_pathc; f++)
+                    res.emplace_back(found.gl_pathv[f]);
+                globfree(&found);
+                continue;
+            }
+            globfree(&found);
+#endif
+            res.push_back(pattern);
+        }
+        return res;
+    }
+
+    bool restore(){
+        /*
+         * Loads the parser state and position of the checkpoint file, if any.
+         * Returns false when there is none to resume from.
+         */
+        ifstream in(checkpointPath, ios::binary);
+        if (checkpointPath.empty() || !in)
+            return false;
+        uint32_t magic = 0;
+        int32_t line = 0;
+        uint64_t lines = 0;
+        string file;
+        Parser::readState(in, magic);
+        if (magic != checkpointMagic)
+            throw runtime_error("Not an ingestion checkpoint: " + checkpointPath);
+        Parser::readState(in, line);
+        Parser::readString(in, file);
+        Parser::readState(in, lines);
+        parser.loadState(in);
+        lastLine = line;
+        resumeFile = std::move(file);
+        resumeLines = lines;
+        return true;
+    }
+
+    void checkpoint(){
+        if (checkpointPath.empty())
+            return;
+        // Written aside and renamed over, a crash leaves the previous checkpoint intact.
+        string tmp = checkpointPath + ".tmp";
+        {
+            ofstream out(tmp, ios::binary | ios::trunc);
+            Parser::writeState<uint32_t>(out, checkpointMagic);
+            Parser::writeState<int32_t>(out, lastLine);
+            Parser::writeString(out, resumeFile);
+            Parser::writeState<uint64_t>(out, resumeLines);
+            parser.saveState(out);
+            out.close();
+            if (!out)
+                throw runtime_error("Cannot write checkpoint: " + tmp);
+        }
+        filesystem::rename(tmp, checkpointPath);
+    }
+
+    size_t ingest(const vector<string>& patterns){
+        /*
+         * Parses the files of patterns in order and returns the number of lines
+         * parsed. Files before the checkpointed one are skipped.
+         */
+        vector<string> files = expand(patterns);
+        size_t first = 0;
+        auto resumed = find(files.begin(), files.end(), resumeFile);
+        if (!resumeFile.empty() && resumed != files.end())
+            first = resumed - files.begin();
+        else
+            resumeLines = 0;
+        if (first == files.size())
+            return 0;
+
+        // The Masker is shared with the read-ahead thread, keep it alive whatever setMasking does.
+        shared_ptr<const Masker> masker = parser.masker;
+        const Masker& tokenizer = parser.tokenizer();
+        // Header fields of the line times, if the parser counts lines by time bucket.
+        vector<int> timeFields;
+        if (parser.counters)
+            for (const string& field : parser.counters->fields) {
+                timeFields.push_back(format.indexOf(field));
+                if (timeFields.back() < 0)
+                    throw invalid_argument("Log format lacks the time field <" + field + ">");
+            }
+        auto load = [this, &tokenizer, &timeFields](string path){ return read(std::move(path), tokenizer, timeFields); };
+        future<Batch> next = async(launch::async, load, files[first]);
+        size_t parsed = 0;
+        size_t sinceCheckpoint = 0;
+        for (size_t f = first; f < files.size(); f++) {
+            Batch batch = next.get();
+            if (f + 1 < files.size())
+                next = async(launch::async, load, files[f + 1]);
+            size_t done = batch.path == resumeFile ? min(resumeLines, batch.lines()) : 0;
+            resumeFile = batch.path;
+            resumeLines = done;
+            while (done < batch.lines()) {
+                size_t chunk = batch.lines() - done;
+                if (checkpointEvery > 0)
+                    chunk = min(chunk, checkpointEvery - sinceCheckpoint);
+                parser.parseEach(chunk, lastLine, [&](size_t k, int logID){
+                    size_t line = done + k;
+                    int c = parser.feedTokens(batch.tokens.data() + batch.tokenStart[line],
+                                              batch.tokenStart[line + 1] - batch.tokenStart[line], logID);
+                    if (!batch.times.empty())
+                        parser.countLine(c, batch.times[line]);
+                });
+                done += chunk;
+                lastLine += (int) chunk;
+                parsed += chunk;
+                resumeLines = done;
+                sinceCheckpoint += chunk;
+                if (checkpointEvery > 0 && sinceCheckpoint == checkpointEvery) {
+                    checkpoint();
+                    sinceCheckpoint = 0;
+                }
+            }
+        }
+        if (checkpointEvery == 0 || sinceCheckpoint > 0)
+            checkpoint();
+        return parsed;
+    }
+
+private:
+    static constexpr uint32_t checkpointMagic = 0x4b504349; // "ICPK"
+
+    // One file, header-extracted and tokenized; views point into text (the Content fields) or at "<*>".
+    struct Batch {
+        string path;
+        vector<char> text;
+        vector<string_view> tokens;
+        // Tokens of line k are tokens[tokenStart[k], tokenStart[k + 1]).
+        vector<size_t> tokenStart{0};
+        // Time of every line when the parser counts by time bucket, see Parser::lineTime().
+        vector<int64_t> times;
+
+        size_t lines() const { return tokenStart.size() - 1; }
+    };
+
+    Batch read(string path, const Masker& tokenizer, const vector<int>& timeFields) const {
+        Batch batch;
+        batch.path = std::move(path);
+        // Contents are gathered first, views into text are only taken once it stops growing.
+        vector<size_t> contentEnd;
+        LineReader in(batch.path);
+        string_view line;
+        vector<string_view> fields, timeParts;
+        while (in.next(line)) {
+            if (!format.extract(line, fields))
+                continue;
+            if (!timeFields.empty()) {
+                timeParts.clear();
+                for (int field : timeFields)
+                    timeParts.push_back(fields[field]);
+                batch.times.push_back(Parser::lineTime(timeParts));
+            }
+            string_view content = fields[contentField];
+            batch.text.insert(batch.text.end(), content.begin(), content.end());
+            contentEnd.push_back(batch.text.size());
+        }
+        size_t start = 0;
+        for (size_t end : contentEnd) {
+            tokenizer.tokenize(string_view(batch.text.data() + start, end - start), batch.tokens);
+            batch.tokenStart.push_back(batch.tokens.size());
+            start = end;
+        }
+        return batch;
+    }
+};
+
+// Tools that embed the parser (benchmarks, drivers) define CSPELL_NO_MAIN before including this file.
+#ifndef CSPELL_NO_MAIN
 int main()
 {
 //    vector<string> lines = {"PacketResponder 1 for block blk_38865049064139660 terminating",
 //                            "PacketResponder 0 for block blk_-6952295868487656571 terminating",
 //                            "10.251.73.220:50010 is added to blk_7128370237687728475 size 67108864"};
-    string line;
     vector<string> lines;
 //    ifstream myfile("../HDFS100k");
 //    ifstream myfile("../HDFS_2k_Content");
-    ifstream myfile("../HDFSpartaa");
-    if(!myfile) //Always test the file open.
-    {
+    try {
+        // Plain, .gz or .zst alike.
+        LineReader myfile("../HDFSpartaa");
+        string_view next;
+        while (myfile.next(next))
+            lines.emplace_back(next);
+    } catch (const exception&) { //Always test the file open.
         std::cout<<"Error opening output file"<< std::endl;
         return -1;
     }
-    while (getline(myfile, line))
-        lines.push_back(line);
 
     auto p = Parser(.7);
     auto out =  p.parse(lines);
 
     cout << "OUT" << endl;
-}
\ No newline at end of file
+}
+#endif
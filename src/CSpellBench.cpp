@@ -0,0 +1,383 @@
+#define CSPELL_NO_MAIN
+#include "CSpell.cpp"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/*
+ * Microbenchmarks of the matching kernels and posting queries of the sequential
+ * Parser, fed with lines of Resources/HDFS_2k. Each kernel runs over inputs
+ * bucketed by token count, template count, hit ratio or range, and reports
+ * ns/op, heap allocations/op and, when perf_event_open is allowed, last-level
+ * cache misses/op.
+ *
+ *     CSpellBench [log file] [min ms per case]
+ */
+
+static atomic<long> allocations{0};
+
+void* operator new(size_t n) {
+    allocations.fetch_add(1, memory_order_relaxed);
+    if (void* p = malloc(n == 0 ? 1 : n))
+        return p;
+    throw bad_alloc();
+}
+
+// GCC pairs free() with the builtin operator new once these are inlined, but both are replaced above.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+#pragma GCC diagnostic pop
+
+class CacheMisses {
+public:
+    CacheMisses() {
+#ifdef __linux__
+        perf_event_attr attr{};
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = (int) syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+    }
+
+    ~CacheMisses() {
+#ifdef __linux__
+        if (fd >= 0)
+            close(fd);
+#endif
+    }
+
+    bool available() const { return fd >= 0; }
+
+    void start() {
+#ifdef __linux__
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    long long stop() {
+        long long count = 0;
+#ifdef __linux__
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(fd, &count, sizeof(count)) != sizeof(count))
+                count = 0;
+        }
+#endif
+        return count;
+    }
+
+private:
+    int fd = -1;
+};
+
+static CacheMisses cacheMisses;
+static double minMillis = 200;
+
+template <class F>
+void bench(const string& kernel, const string& params, size_t opsPerRound, F&& round) {
+    /*
+     * Repeats round (opsPerRound operations) until minMillis elapsed, after one
+     * warm-up round, and prints the per-operation averages.
+     */
+    if (opsPerRound == 0) {
+        printf("%-22s %-26s %12s\n", kernel.c_str(), params.c_str(), "no input");
+        return;
+    }
+    round();
+    size_t rounds = 0;
+    long allocs = allocations.load();
+    cacheMisses.start();
+    auto start = chrono::steady_clock::now();
+    chrono::duration<double, nano> elapsed{};
+    do {
+        round();
+        rounds++;
+        elapsed = chrono::steady_clock::now() - start;
+    } while (elapsed.count() < minMillis * 1e6);
+    long long misses = cacheMisses.stop();
+    double ops = (double) rounds * opsPerRound;
+    printf("%-22s %-26s %12.1f %12.2f", kernel.c_str(), params.c_str(),
+           elapsed.count() / ops, (double) (allocations.load() - allocs) / ops);
+    if (cacheMisses.available())
+        printf(" %12.2f", (double) misses / ops);
+    else
+        printf(" %12s", "n/a");
+    printf("\n");
+}
+
+static void latency(const string& kernel, const string& params, vector<double> nanos) {
+    // Percentiles of single-operation times, which the averages of bench() hide.
+    if (nanos.empty())
+        return;
+    sort(nanos.begin(), nanos.end());
+    auto at = [&](double q){ return nanos[min(nanos.size() - 1, (size_t) (q * nanos.size()))]; };
+    printf("%-22s %-26s %12.0f %12.0f %12.0f\n", kernel.c_str(), params.c_str(), at(.5), at(.99), nanos.back());
+}
+
+struct Line {
+    string content;
+    vector<string> tokens;
+    Tokens views;
+    Tokens constViews;
+};
+
+static Line makeLine(string content) {
+    Line line{std::move(content), {}, {}, {}};
+    line.tokens = split(line.content);
+    line.views.assign(line.tokens.begin(), line.tokens.end());
+    for (string_view tok : line.views)
+        if (tok != "<*>")
+            line.constViews.push_back(tok);
+    return line;
+}
+
+// Same line with every other token replaced by one no template contains.
+static Line makeMiss(const Line& hit, int salt) {
+    string content;
+    for (size_t t = 0; t < hit.tokens.size(); t++) {
+        if (!content.empty())
+            content += ' ';
+        content += t % 2 == 0 ? "miss" + to_string(salt) + "_" + to_string(t) : hit.tokens[t];
+    }
+    return makeLine(content);
+}
+
+static vector<const Line*> bucket(const vector<Line>& lines, size_t minTokens, size_t maxTokens) {
+    vector<const Line*> res;
+    for (const Line& line : lines)
+        if (line.tokens.size() >= minTokens && line.tokens.size() <= maxTokens)
+            res.push_back(&line);
+    return res;
+}
+
+// Queries mixing the first lines (hits) with their misses, hitPercent of them hits.
+static vector<const Line*> mix(const vector<Line>& hits, const vector<Line>& misses, int hitPercent, size_t n) {
+    vector<const Line*> res;
+    for (size_t i = 0; i < n && i < hits.size(); i++)
+        res.push_back((int) (i * 100 / n % 100) < hitPercent ? &hits[i] : &misses[i]);
+    return res;
+}
+
+int main(int argc, char** argv) {
+    string path = argc > 1 ? argv[1] : "Resources/HDFS_2k";
+    if (argc > 2)
+        minMillis = atof(argv[2]);
+    ifstream in(path);
+    if (!in) {
+        cerr << "Cannot open " << path << endl;
+        return 1;
+    }
+    LogFormat format("<Date> <Time> <Pid> <Level> <Component>: <Content>");
+    int contentField = format.indexOf("Content");
+    vector<Line> lines;
+    vector<string_view> fields;
+    string raw;
+    while (getline(in, raw))
+        if (format.extract(raw, fields))
+            lines.push_back(makeLine(string(fields[contentField])));
+    vector<Line> misses;
+    for (size_t i = 0; i < lines.size(); i++)
+        misses.push_back(makeMiss(lines[i], (int) i));
+    printf("%zu lines from %s, cache misses %s\n\n", lines.size(), path.c_str(),
+           cacheMisses.available() ? "from perf counters" : "unavailable");
+    printf("%-22s %-26s %12s %12s %12s\n", "kernel", "input", "ns/op", "allocs/op", "misses/op");
+
+    struct TokenBucket { const char* name; size_t min, max; };
+    const TokenBucket tokenBuckets[] = {{"tokens<=8", 0, 8}, {"tokens=9..16", 9, 16}, {"tokens>16", 17, SIZE_MAX}};
+
+    for (const auto& b : tokenBuckets) {
+        auto sel = bucket(lines, b.min, b.max);
+        bench("split", b.name, sel.size(), [&]{
+            for (const Line* line : sel) {
+                auto res = split(line->content);
+                asm volatile("" : : "r"(res.data()) : "memory");
+            }
+        });
+    }
+
+    Parser plain(.7);
+    Parser masked(.7);
+    masked.setMasking({"ip", "blk", "num"});
+    for (const auto& b : tokenBuckets) {
+        auto sel = bucket(lines, b.min, b.max);
+        for (Parser* p : {&plain, &masked}) {
+            bench("tokenize", string(b.name) + (p == &masked ? " masked" : ""), sel.size(), [&]{
+                for (const Line* line : sel) {
+                    p->scratch.reset();
+                    Tokens res(p->scratch.resource());
+                    p->tokenizer().tokenize(line->content, res);
+                    asm volatile("" : : "r"(res.data()) : "memory");
+                }
+            });
+        }
+    }
+
+    // Full parse: every line then has a cluster, giving realistic line/template pairs.
+    Parser full(.7);
+    vector<int> clusterOf(lines.size());
+    for (size_t i = 0; i < lines.size(); i++)
+        clusterOf[i] = full.feed(lines[i].content, (int) i + 1);
+
+    // Posting queries over the clusters of the full parse, ranges of one line to all of them.
+    full.setPostings(true);
+    const PostingIndex& index = full.postingIndex();
+    for (int span : {1, 100, (int) lines.size()}) {
+        string params = "range " + to_string(span) + " lines";
+        bench("PostingIndex.count", params, lines.size(), [&]{
+            for (size_t i = 0; i < lines.size(); i++) {
+                auto res = index.count(clusterOf[i], (int) i + 1, (int) i + span);
+                asm volatile("" : : "r"(res) : "memory");
+            }
+        });
+        vector<int> res;
+        bench("PostingIndex.lines", params, lines.size(), [&]{
+            for (size_t i = 0; i < lines.size(); i++) {
+                res.clear();
+                index.list(clusterOf[i]).range((int) i + 1, (int) i + span, res);
+            }
+        });
+    }
+
+    for (const auto& b : tokenBuckets) {
+        auto sel = bucket(lines, b.min, b.max);
+        ScratchArena arena;
+        bench("LCS", b.name, sel.size(), [&]{
+            for (const Line* line : sel) {
+                arena.reset();
+                pmr::vector<int> lengths(arena.resource());
+                Tokens res(arena.resource());
+                full.LCS(line->views, full.logClust[clusterOf[line - lines.data()]].logTemplate, lengths, res);
+            }
+        });
+        bench("getTemplate", b.name, sel.size(), [&]{
+            for (const Line* line : sel) {
+                arena.reset();
+                const auto &tmpl = full.logClust[clusterOf[line - lines.data()]].logTemplate;
+                pmr::vector<int> lengths(arena.resource());
+                Tokens lcs(arena.resource()), res(arena.resource());
+                full.LCS(line->views, tmpl, lengths, lcs);
+                full.getTemplate(lcs, tmpl, res);
+            }
+        });
+    }
+
+    // Parsers holding the templates of the first lines, for each template count.
+    for (size_t templates : {16, 128, 1024}) {
+        Parser p(.7);
+        size_t used = 0;
+        while (used < lines.size() && p.logClust.size() < templates) {
+            p.feed(lines[used].content, (int) used + 1);
+            used++;
+        }
+        string count = to_string(p.logClust.size()) + " templates";
+        vector<Line> hits(lines.begin(), lines.begin() + used);
+        vector<Line> localMisses(misses.begin(), misses.begin() + used);
+        FrozenParser frozen(p);
+        for (int hitPercent : {100, 50, 0}) {
+            auto queries = mix(hits, localMisses, hitPercent, used);
+            string params = count + " hit " + to_string(hitPercent) + "%";
+            bench("prefixTreeMatch", params, queries.size(), [&]{
+                for (const Line* q : queries) {
+                    auto res = p.prefixTreeMatch(p.trieRoot, q->constViews, 0);
+                    asm volatile("" : : "r"(&res) : "memory");
+                }
+            });
+            bench("simpleLoopMatch", params, queries.size(), [&]{
+                for (const Line* q : queries) {
+                    p.scratch.reset();
+                    Tokens constViews(q->constViews, p.scratch.resource());
+                    auto res = p.simpleLoopMatch(p.logClust, constViews);
+                    asm volatile("" : : "r"(&res) : "memory");
+                }
+            });
+            bench("LCSMatch", params, queries.size(), [&]{
+                for (const Line* q : queries) {
+                    p.scratch.reset();
+                    Tokens views(q->views, p.scratch.resource());
+                    auto res = p.LCSMatch(p.logClust, views);
+                    asm volatile("" : : "r"(&res) : "memory");
+                }
+            });
+            // Tokenizing and all three matches, against the inverted index of the frozen templates.
+            bench("FrozenParser.classify", params, queries.size(), [&]{
+                for (const Line* q : queries) {
+                    int res = frozen.classify(q->content);
+                    asm volatile("" : : "r"(res) : "memory");
+                }
+            });
+        }
+        bench("add+removeSeqToTrie", count, p.logClust.size(), [&]{
+            for (TemplateCluster& c : p.logClust) {
+                p.removeSeqFromPrefixTree(p.trieRoot, c);
+                p.addSeqToPrefixTree(p.trieRoot, c);
+            }
+        });
+        // Generalization of the last constant token, moved in the trie and back.
+        vector<TemplateCluster> generalized;
+        for (const TemplateCluster& c : p.logClust) {
+            generalized.emplace_back(c.logTemplate);
+            auto &tmpl = generalized.back().logTemplate;
+            auto last = find_if(tmpl.rbegin(), tmpl.rend(), [](const string& s){ return s != "<*>"; });
+            if (last != tmpl.rend())
+                *last = "<*>";
+        }
+        bench("remove+addSeqToTrie", count + " generalize", 2 * p.logClust.size(), [&]{
+            for (size_t c = 0; c < p.logClust.size(); c++) {
+                p.removeSeqFromPrefixTree(p.trieRoot, p.logClust[c]);
+                p.addSeqToPrefixTree(p.trieRoot, generalized[c]);
+                p.removeSeqFromPrefixTree(p.trieRoot, generalized[c]);
+                p.addSeqToPrefixTree(p.trieRoot, p.logClust[c]);
+            }
+        });
+        bench("rewriteSeqInPrefixTree", count + " generalize", 2 * p.logClust.size(), [&]{
+            for (size_t c = 0; c < p.logClust.size(); c++) {
+                p.scratch.reset();
+                p.rewriteSeqInPrefixTree(p.trieRoot, p.logClust[c].logTemplate, generalized[c]);
+                p.rewriteSeqInPrefixTree(p.trieRoot, generalized[c].logTemplate, p.logClust[c]);
+            }
+        });
+    }
+
+    // Lines and their misses in turn, so the template count keeps growing.
+    printf("\n%-22s %-26s %12s %12s %12s\n", "kernel", "input", "p50 ns", "p99 ns", "max ns");
+    for (bool deferred : {false, true}) {
+        Parser p(.7);
+        p.progress = false;
+        p.setDeferredMatching(deferred);
+        vector<double> nanos;
+        int logID = 0;
+        for (size_t i = 0; i < lines.size(); i++) {
+            for (const Line* line : {&lines[i], &misses[i]}) {
+                auto start = chrono::steady_clock::now();
+                p.parseEach(1, logID, [&](size_t, int id){ p.feed(line->content, id); });
+                nanos.push_back(chrono::duration<double, nano>(chrono::steady_clock::now() - start).count());
+                logID++;
+            }
+        }
+        p.applyDeferred(true);
+        latency("feed", to_string(p.logClust.size()) + " templates" + (deferred ? " deferred" : ""), nanos);
+    }
+    return 0;
+}
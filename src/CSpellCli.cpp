@@ -0,0 +1,983 @@
+#define CSPELL_NO_MAIN
+#include "CSpell.cpp"
+#include "Md5.h"
+#include "ThreadPool.h"
+
+#include <csignal>
+#include <poll.h>
+#include <pthread.h>
+#include <sstream>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/*
+ * Command line driver of the LogParser pipeline without Python: header
+ * extraction, parsing, parameter extraction and output, file by file as
+ * LogParser.parse_file does, into the output directory:
+ *     <file>_structured.csv  LineId, the header fields, EventId, EventTemplate, ParameterList
+ *     <file>_templates.csv   EventId, EventTemplate, Occurrences
+ * or <file>_structured.cols with --columnar (see ColumnarLog.h), and with
+ * --time-buckets the line counts per template and time bucket:
+ *     eventCounts.csv        Time (bucket start, epoch seconds), EventId, Cluster, Count
+ * Line IDs and templates run on across the files; with --state they also run
+ * on across invocations, the parser being loaded from and saved to that file.
+ * With --serve the parser is kept loaded and classifies lines sent over a
+ * UNIX socket or stdin, see ParseDaemon.
+ *
+ *     cspell --format FORMAT [options] FILE|GLOB...
+ *     cspell --format FORMAT --serve SOCKET|- [--state FILE] [options]
+ */
+
+struct Options {
+    string format;
+    float tau = .5;
+    string delimiters = Masker::defaultDelimiters;
+    vector<string> maskRules;
+    int threads = 1;
+    string outDir = "./result/";
+    string statePath;
+    string templatesPath;
+    bool columnar = false;
+    bool keepParameters = true;
+    size_t maxLength = 4096;
+    vector<string> inputs;
+    string serve;
+    int checkpointEvery = 60;
+    // Parser memory budgets of --serve in bytes, 0 for none.
+    size_t softBudget = 0;
+    size_t hardBudget = 0;
+    // Line counts per template by buckets of bucketSeconds (0 for none), the last bucketRing kept open.
+    int64_t bucketSeconds = 0;
+    size_t bucketRing = 60;
+    vector<string> timeFields{"Date", "Time"};
+};
+
+static void usage(FILE* out) {
+    fprintf(out,
+            "Usage: cspell --format FORMAT [options] FILE|GLOB...\n"
+            "  -f, --format FORMAT      log format, e.g. \"<Date> <Time> <Level>: <Content>\"\n"
+            "  -t, --tau TAU            template similarity threshold in [0, 1] (default 0.5)\n"
+            "  -d, --delimiters CHARS   token delimiters (default whitespace and \"=:,\")\n"
+            "  -m, --mask RULES         comma separated masking rules: ip, hex, blk, num or globs\n"
+            "  -j, --threads N          threads formatting the structured output (default 1)\n"
+            "  -o, --output DIR         output directory (default ./result/)\n"
+            "  -s, --state FILE         load the parser from FILE if present, save it there at the end\n"
+            "      --templates FILE     start with the templates of FILE, one per line\n"
+            "      --columnar           write <file>_structured.cols instead of <file>_structured.csv\n"
+            "      --no-parameters      leave out the ParameterList column\n"
+            "      --max-length N       skip lines longer than N characters (default 4096)\n"
+            "      --serve SOCKET|-     classify lines sent over a UNIX socket, or stdin/stdout for -\n"
+            "      --checkpoint-every S with --serve and --state, save the parser every S seconds (default 60,\n"
+            "                           0 only on shutdown)\n"
+            "      --memory-budget SOFT[,HARD]\n"
+            "                           with --serve, compact the parser past SOFT MiB and drop its line IDs\n"
+            "                           past HARD MiB\n"
+            "      --time-buckets S[,N] count the lines of every template by buckets of S seconds, N of them\n"
+            "                           open at a time (default 60), into DIR/eventCounts.csv\n"
+            "      --time-fields LIST   comma separated header fields holding the line time (default Date,Time)\n"
+            "  -h, --help               show this help\n");
+}
+
+static vector<string> splitList(const string& list) {
+    vector<string> res;
+    size_t i = 0;
+    while (i <= list.size()) {
+        size_t next = min(list.find(',', i), list.size());
+        if (next > i)
+            res.push_back(list.substr(i, next - i));
+        i = next + 1;
+    }
+    return res;
+}
+
+static Options parseArgs(int argc, char** argv) {
+    Options opts;
+    for (int a = 1; a < argc; a++) {
+        string arg = argv[a];
+        auto value = [&]() -> string {
+            if (a + 1 >= argc)
+                throw invalid_argument("Missing value for " + arg);
+            return argv[++a];
+        };
+        // Whole value parsed by convert(text, &used), or a usage error.
+        auto number = [&](auto convert) {
+            string text = value();
+            try {
+                size_t used = 0;
+                auto res = convert(text, &used);
+                if (used == text.size())
+                    return res;
+            } catch (const logic_error&) {
+            }
+            throw invalid_argument("Bad value for " + arg + ": " + text);
+        };
+        if (arg == "-f" || arg == "--format")
+            opts.format = value();
+        else if (arg == "-t" || arg == "--tau")
+            opts.tau = number([](const string& s, size_t* used){ return stof(s, used); });
+        else if (arg == "-d" || arg == "--delimiters")
+            opts.delimiters = value();
+        else if (arg == "-m" || arg == "--mask")
+            opts.maskRules = splitList(value());
+        else if (arg == "-j" || arg == "--threads")
+            opts.threads = number([](const string& s, size_t* used){ return stoi(s, used); });
+        else if (arg == "-o" || arg == "--output")
+            opts.outDir = value();
+        else if (arg == "-s" || arg == "--state")
+            opts.statePath = value();
+        else if (arg == "--templates")
+            opts.templatesPath = value();
+        else if (arg == "--columnar")
+            opts.columnar = true;
+        else if (arg == "--no-parameters")
+            opts.keepParameters = false;
+        else if (arg == "--max-length")
+            opts.maxLength = number([](const string& s, size_t* used){ return stoul(s, used); });
+        else if (arg == "--serve")
+            opts.serve = value();
+        else if (arg == "--checkpoint-every")
+            opts.checkpointEvery = number([](const string& s, size_t* used){ return stoi(s, used); });
+        else if (arg == "--memory-budget") {
+            string text = value();
+            vector<string> limits = splitList(text);
+            try {
+                if (limits.empty() || limits.size() > 2)
+                    throw invalid_argument(text);
+                size_t used = 0;
+                for (size_t l = 0; l < limits.size(); l++) {
+                    size_t mib = stoul(limits[l], &used);
+                    if (used != limits[l].size())
+                        throw invalid_argument(text);
+                    (l == 0 ? opts.softBudget : opts.hardBudget) = mib << 20;
+                }
+            } catch (const logic_error&) {
+                throw invalid_argument("Bad value for " + arg + ": " + text);
+            }
+        }
+        else if (arg == "--time-buckets") {
+            string text = value();
+            vector<string> parts = splitList(text);
+            try {
+                if (parts.empty() || parts.size() > 2)
+                    throw invalid_argument(text);
+                size_t used = 0;
+                opts.bucketSeconds = stoll(parts[0], &used);
+                if (used != parts[0].size() || opts.bucketSeconds <= 0)
+                    throw invalid_argument(text);
+                if (parts.size() == 2) {
+                    opts.bucketRing = stoul(parts[1], &used);
+                    if (used != parts[1].size() || opts.bucketRing == 0)
+                        throw invalid_argument(text);
+                }
+            } catch (const logic_error&) {
+                throw invalid_argument("Bad value for " + arg + ": " + text);
+            }
+        }
+        else if (arg == "--time-fields")
+            opts.timeFields = splitList(value());
+        else if (arg == "-h" || arg == "--help") {
+            usage(stdout);
+            exit(0);
+        } else if (arg.size() > 1 && arg[0] == '-')
+            throw invalid_argument("Unknown option " + arg);
+        else
+            opts.inputs.push_back(arg);
+    }
+    if (opts.format.empty())
+        throw invalid_argument("No log format given (--format)");
+    if (opts.inputs.empty() && opts.serve.empty())
+        throw invalid_argument("No input files given");
+    if (!opts.inputs.empty() && !opts.serve.empty())
+        throw invalid_argument("Input files and --serve are exclusive");
+    // Files need every line ID for their structured output.
+    if ((opts.softBudget > 0 || opts.hardBudget > 0) && opts.serve.empty())
+        throw invalid_argument("--memory-budget needs --serve");
+    if (opts.tau < 0 || opts.tau > 1)
+        throw invalid_argument("tau must be in [0, 1]");
+    if (opts.delimiters.empty())
+        throw invalid_argument("Empty delimiter set");
+    opts.threads = max(opts.threads, 1);
+    return opts;
+}
+
+// Field as pandas.DataFrame.to_csv writes it: quoted only if it holds a comma, quote or line break.
+static void appendCsv(string& out, string_view field) {
+    if (field.find_first_of(",\"\r\n") == string_view::npos) {
+        out += field;
+        return;
+    }
+    out += '"';
+    for (char c : field) {
+        if (c == '"')
+            out += '"';
+        out += c;
+    }
+    out += '"';
+}
+
+// Python repr() of a list of str, the ParameterList cell LogParser writes.
+static void appendPyList(string& out, const vector<string_view>& values) {
+    static const char* hexDigits = "0123456789abcdef";
+    string item;
+    item += '[';
+    for (size_t v = 0; v < values.size(); v++) {
+        string_view s = values[v];
+        char quote = s.find('\'') != string_view::npos && s.find('"') == string_view::npos ? '"' : '\'';
+        if (v > 0)
+            item += ", ";
+        item += quote;
+        for (char c : s) {
+            unsigned char u = c;
+            if (c == '\\' || c == quote) {
+                item += '\\';
+                item += c;
+            } else if (c == '\n')
+                item += "\\n";
+            else if (c == '\r')
+                item += "\\r";
+            else if (c == '\t')
+                item += "\\t";
+            else if (u < 0x20 || u == 0x7f) {
+                item += "\\x";
+                item += hexDigits[u >> 4];
+                item += hexDigits[u & 15];
+            } else
+                item += c;
+        }
+        item += quote;
+    }
+    item += ']';
+    appendCsv(out, item);
+}
+
+class CliDriver {
+    /*
+     * Runs the pipeline over the input files with one Parser. Each file is held
+     * in memory while it is parsed and written, as LogParser.parse_file does.
+     */
+public:
+    const Options& opts;
+    LogFormat format;
+    int contentField;
+    Parser parser;
+    unique_ptr<ThreadPool> pool;
+    int lastLine = 0;
+    // Header fields of the line times with --time-buckets.
+    vector<int> timeFields;
+
+    explicit CliDriver(const Options& opts)
+            : opts(opts), format(opts.format), parser(opts.tau){
+        contentField = format.indexOf("Content");
+        if (contentField < 0)
+            throw invalid_argument("Log format " + opts.format + " lacks <Content>");
+        if (!opts.maskRules.empty() || opts.delimiters != Masker::defaultDelimiters)
+            parser.setMasking(opts.maskRules, opts.delimiters);
+        if (opts.threads > 1)
+            pool = make_unique<ThreadPool>(opts.threads);
+        if (opts.bucketSeconds > 0) {
+            for (const string& field : opts.timeFields) {
+                timeFields.push_back(format.indexOf(field));
+                if (timeFields.back() < 0)
+                    throw invalid_argument("Log format " + opts.format + " lacks the time field <" + field + ">");
+            }
+            filesystem::create_directories(opts.outDir);
+            parser.setTimeBuckets(opts.bucketSeconds, opts.bucketRing,
+                                  (filesystem::path(opts.outDir) / "eventCounts.csv").string(), opts.timeFields);
+        }
+    }
+
+    void run() {
+        filesystem::create_directories(opts.outDir);
+        loadState();
+        for (const string& file : Ingestor::expand(opts.inputs))
+            parseFile(file);
+        finishCounts();
+        saveState();
+    }
+
+    int64_t lineTime(const vector<string_view>& fields, vector<string_view>& parts) const {
+        parts.clear();
+        for (int field : timeFields)
+            parts.push_back(fields[field]);
+        return Parser::lineTime(parts);
+    }
+
+    void finishCounts() {
+        // Closes the open buckets at the end of the input.
+        if (!parser.counters)
+            return;
+        parser.flushCounts();
+        if (parser.counters->late > 0 || parser.counters->unparsed > 0)
+            fprintf(stderr, "Time buckets: %llu lines older than the open buckets, %llu without a readable time\n",
+                    (unsigned long long) parser.counters->late, (unsigned long long) parser.counters->unparsed);
+    }
+
+    void loadState() {
+        // Then the templates of --templates missing from the state.
+        ifstream in;
+        if (!opts.statePath.empty())
+            in.open(opts.statePath, ios::binary);
+        if (in.is_open()) {
+            parser.loadState(in);
+            // Line IDs resume after the last one assigned, as LogParser.set_last_line_id does.
+            for (int c = 0; c < parser.logClust.size(); c++)
+                for (int id : parser.lineIds(c))
+                    lastLine = max(lastLine, id);
+            fprintf(stderr, "Loaded %zu templates from %s, last line ID %d\n",
+                    parser.logClust.size(), opts.statePath.c_str(), lastLine);
+        }
+        if (!opts.templatesPath.empty()) {
+            size_t added = parser.loadTemplates(opts.templatesPath, opts.threads);
+            fprintf(stderr, "Added %zu templates from %s\n", added, opts.templatesPath.c_str());
+        }
+    }
+
+    void saveState() {
+        if (!opts.statePath.empty())
+            writeSnapshot(snapshot());
+    }
+
+    string snapshot() const {
+        ostringstream out(ios::binary);
+        parser.saveState(out);
+        return out.str();
+    }
+
+    void writeSnapshot(const string& bytes) const {
+        // Written aside and renamed over, a crash leaves the previous state intact.
+        string tmp = opts.statePath + ".tmp";
+        {
+            ofstream out(tmp, ios::binary | ios::trunc);
+            out.write(bytes.data(), (streamsize) bytes.size());
+            out.close();
+            if (!out)
+                throw runtime_error("Cannot write parser state: " + tmp);
+        }
+        filesystem::rename(tmp, opts.statePath);
+    }
+
+    bool acceptable(string_view line) const {
+        // readlines() keeps the newline, LogParser counts it in the length.
+        return line.size() + 1 <= opts.maxLength;
+    }
+
+private:
+    string outPath(const string& file, const string& suffix) const {
+        return (filesystem::path(opts.outDir) / (filesystem::path(file).filename().string() + suffix)).string();
+    }
+
+public:
+    static bool nonAscii(string_view line) {
+        for (char c : line)
+            if ((unsigned char) c >= 0x80)
+                return true;
+        return false;
+    }
+
+    static string replaceNonAscii(string_view line) {
+        // Each run of non-ASCII bytes becomes "<NASCII>", as re.sub(r'[^\x00-\x7F]+', ...) does.
+        string res;
+        for (size_t i = 0; i < line.size();) {
+            if ((unsigned char) line[i] < 0x80) {
+                res += line[i++];
+                continue;
+            }
+            res += "<NASCII>";
+            while (i < line.size() && (unsigned char) line[i] >= 0x80)
+                i++;
+        }
+        return res;
+    }
+
+private:
+    void parseFile(const string& file) {
+        vector<string> lines;
+        vector<string_view> fields;
+        size_t tooLong = 0;
+        {
+            LineReader in(file);
+            string_view line;
+            while (in.next(line)) {
+                if (!acceptable(line)) {
+                    tooLong++;
+                    continue;
+                }
+                string normalized = nonAscii(line) ? replaceNonAscii(line) : string(line);
+                if (format.extract(normalized, fields))
+                    lines.push_back(std::move(normalized));
+            }
+        }
+        if (tooLong > 0)
+            fprintf(stderr, "%s: skipped %zu lines longer than %zu characters\n", file.c_str(), tooLong, opts.maxLength);
+
+        vector<string_view> contents(lines.size());
+        vector<int64_t> times;
+        vector<string_view> parts;
+        for (size_t i = 0; i < lines.size(); i++) {
+            format.extract(lines[i], fields);
+            contents[i] = fields[contentField];
+            if (!timeFields.empty())
+                times.push_back(lineTime(fields, parts));
+        }
+        parser.parseEach(contents.size(), lastLine, [&](size_t k, int logID){
+            int c = parser.feed(contents[k], logID);
+            if (!times.empty())
+                parser.countLine(c, times[k]);
+        });
+
+        if (opts.columnar) {
+            string path = outPath(file, "_structured.cols");
+            filesystem::remove(path);
+            ColumnarWriter out(path);
+            parser.writeColumns(out, contents, lastLine, opts.keepParameters);
+        } else
+            writeStructured(outPath(file, "_structured.csv"), lines, contents);
+        writeTemplates(outPath(file, "_templates.csv"));
+        printf("%s: %zu lines, %zu templates\n", file.c_str(), lines.size(), parser.logClust.size());
+        lastLine += (int) lines.size();
+    }
+
+    vector<string> eventIds() const {
+        vector<string> res;
+        res.reserve(parser.logClust.size());
+        for (const TemplateCluster& c : parser.logClust)
+            res.push_back(Md5::hex(joined(c.logTemplate), 8));
+        return res;
+    }
+
+    static string joined(const vector<string>& logTemplate) {
+        string res;
+        for (const string& tok : logTemplate) {
+            if (!res.empty())
+                res += ' ';
+            res += tok;
+        }
+        return res;
+    }
+
+    void writeTemplates(const string& path) {
+        ofstream out(path, ios::trunc);
+        out << "EventId,EventTemplate,Occurrences\n";
+        vector<string> ids = eventIds();
+        string row;
+        for (int c = 0; c < parser.logClust.size(); c++) {
+            row = ids[c];
+            row += ',';
+            appendCsv(row, joined(parser.logClust[c].logTemplate));
+            row += ',';
+            row += to_string(parser.lineIds(c).size());
+            row += '\n';
+            out << row;
+        }
+        out.close();
+        if (!out)
+            throw runtime_error("Cannot write " + path);
+    }
+
+    void writeStructured(const string& path, const vector<string>& lines, const vector<string_view>& contents) {
+        ofstream out(path, ios::trunc);
+        out << "LineId";
+        for (const string& header : format.headers)
+            out << ',' << header;
+        out << ",EventId,EventTemplate" << (opts.keepParameters ? ",ParameterList" : "") << '\n';
+
+        vector<int> clusterOf = parser.clustersOf(lastLine, lines.size());
+        vector<string> ids = eventIds();
+        vector<string> templates;
+        templates.reserve(parser.logClust.size());
+        for (const TemplateCluster& c : parser.logClust) {
+            templates.emplace_back();
+            appendCsv(templates.back(), joined(c.logTemplate));
+        }
+
+        // Rows are formatted by chunks, on the pool if any, and written in order.
+        const size_t chunk = 1 << 16;
+        vector<string> rows;
+        for (size_t begin = 0; begin < lines.size(); begin += chunk) {
+            size_t n = min(chunk, lines.size() - begin);
+            rows.assign(n, string());
+            auto formatRows = [&](size_t b, size_t e, int){
+                vector<string_view> fields, params;
+                for (size_t i = b; i < e; i++)
+                    formatRow(begin + i, lines, contents, clusterOf, ids, templates, fields, params, rows[i]);
+            };
+            if (pool)
+                pool->run(n, 256, formatRows);
+            else
+                formatRows(0, n, 0);
+            for (const string& row : rows)
+                out << row;
+        }
+        out.close();
+        if (!out)
+            throw runtime_error("Cannot write " + path);
+    }
+
+    void formatRow(size_t i, const vector<string>& lines, const vector<string_view>& contents,
+                   const vector<int>& clusterOf, const vector<string>& ids, const vector<string>& templates,
+                   vector<string_view>& fields, vector<string_view>& params, string& row) const {
+        row = to_string(lastLine + (int) i + 1);
+        format.extract(lines[i], fields);
+        for (string_view field : fields) {
+            row += ',';
+            appendCsv(row, field);
+        }
+        int c = clusterOf[i];
+        row += ',';
+        if (c >= 0)
+            row += ids[c];
+        row += ',';
+        if (c >= 0)
+            row += templates[c];
+        if (opts.keepParameters) {
+            params.clear();
+            if (c >= 0)
+                Parser::parameters(parser.logClust[c].logTemplate, contents[i], params, parser.splitter.get());
+            row += ',';
+            appendPyList(row, params);
+        }
+        row += '\n';
+    }
+};
+
+// Set by SIGINT/SIGTERM, polled by the accept loop and the stdin session.
+static atomic<bool> stopRequested{false};
+
+class ParseDaemon {
+    /*
+     * Long-running classification service: the parser is loaded once and every
+     * client (UNIX socket connection, or stdin/stdout) sends frames
+     *     [uint32 size][size bytes]
+     * integers little-endian, a string being [uint32 length][bytes]:
+     *     'L' [uint8 flags][uint32 n] string * n   raw log lines to parse
+     *     'C'                                      checkpoint the state now
+     * Each frame is answered in order, so a client may pipeline frames:
+     *     'R' [uint32 n] ([int32 lineId][int32 cluster][uint32 version]
+     *                     (string template if flags & 2)
+     *                     ([uint32 k] string * k parameters if flags & 1)) * n
+     *     'C' [uint8 saved]
+     *     'E' string                              bad frame, the connection is closed
+     * Lines that do not fit the format (or are too long) get line ID 0 and
+     * cluster -1. A reply describes the clusters once the whole frame is parsed.
+     * The frames of all clients go through the one Parser in arrival order and
+     * line IDs run on across them. With --state the parser is checkpointed on a
+     * background thread every --checkpoint-every seconds if lines arrived, and
+     * on shutdown (SIGINT, SIGTERM or end of stdin).
+     */
+public:
+    static constexpr uint32_t maxFrame = 64u << 20;
+
+    explicit ParseDaemon(CliDriver& driver) : driver(driver), opts(driver.opts) {}
+
+    void serve() {
+        driver.loadState();
+        // Replies may go to stdout.
+        driver.parser.progress = false;
+        if (opts.softBudget > 0 || opts.hardBudget > 0)
+            driver.parser.setMemoryBudget(opts.softBudget, opts.hardBudget, [this](const MemoryUsage& usage, bool hard){
+                fprintf(stderr, "cspell: parser uses %zu bytes (trie %zu, templates %zu, line IDs %zu), %s\n",
+                        usage.total(), usage.trie + usage.trieClusters, usage.templates, usage.lineIds,
+                        hard ? "dropping line IDs" : "compacting");
+                driver.parser.relieveMemory(hard);
+            });
+        struct sigaction stop{};
+        stop.sa_handler = [](int){ stopRequested = true; };
+        // No SA_RESTART: a blocked read of stdin returns EINTR and sees the request.
+        sigaction(SIGINT, &stop, nullptr);
+        sigaction(SIGTERM, &stop, nullptr);
+        signal(SIGPIPE, SIG_IGN);
+
+        thread checkpointer = spawn([this]{ checkpointLoop(); });
+        try {
+            if (opts.serve == "-")
+                session(STDIN_FILENO, STDOUT_FILENO);
+            else
+                listenOn(opts.serve);
+        } catch (...) {
+            stopCheckpoints(checkpointer);
+            throw;
+        }
+        stopCheckpoints(checkpointer);
+        {
+            lock_guard<mutex> l(parserLock);
+            driver.finishCounts();
+        }
+        checkpoint();
+    }
+
+private:
+    CliDriver& driver;
+    const Options& opts;
+    // Serializes the parser; checkpointLock orders snapshots with their writes.
+    mutex parserLock;
+    mutex checkpointLock;
+    bool dirty = false;
+    mutex stateLock;
+    condition_variable changed;
+    bool stopping = false;
+    set<int> clients;
+    int sessions = 0;
+
+    template <class F>
+    static thread spawn(F&& f) {
+        // Signals are left to the main thread, which polls for them.
+        sigset_t block, old;
+        sigemptyset(&block);
+        sigaddset(&block, SIGINT);
+        sigaddset(&block, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &block, &old);
+        thread res(std::forward<F>(f));
+        pthread_sigmask(SIG_SETMASK, &old, nullptr);
+        return res;
+    }
+
+    void stopCheckpoints(thread& checkpointer) {
+        {
+            lock_guard<mutex> l(stateLock);
+            stopping = true;
+        }
+        changed.notify_all();
+        checkpointer.join();
+    }
+
+    void listenOn(const string& path) {
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path))
+            throw invalid_argument("Socket path too long: " + path);
+        strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+        // A socket left by a previous run is replaced, any other file is not.
+        error_code ec;
+        if (filesystem::exists(path, ec)) {
+            if (!filesystem::is_socket(path, ec))
+                throw runtime_error("Not a socket: " + path);
+            filesystem::remove(path, ec);
+        }
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+            throw runtime_error("Cannot create socket");
+        if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(fd, 64) != 0) {
+            close(fd);
+            throw runtime_error("Cannot listen on " + path + ": " + strerror(errno));
+        }
+        fprintf(stderr, "Listening on %s\n", path.c_str());
+
+        while (!stopRequested) {
+            pollfd p{fd, POLLIN, 0};
+            if (poll(&p, 1, 200) <= 0)
+                continue;
+            int client = accept(fd, nullptr, nullptr);
+            if (client < 0)
+                continue;
+            {
+                lock_guard<mutex> l(stateLock);
+                clients.insert(client);
+                sessions++;
+            }
+            spawn([this, client]{
+                try {
+                    session(client, client);
+                } catch (const exception& e) {
+                    fprintf(stderr, "cspell: %s\n", e.what());
+                }
+                lock_guard<mutex> l(stateLock);
+                clients.erase(client);
+                close(client);
+                if (--sessions == 0)
+                    changed.notify_all();
+            }).detach();
+        }
+        close(fd);
+        filesystem::remove(path, ec);
+
+        // Wake the sessions blocked in read() and wait for them to finish their frame.
+        unique_lock<mutex> l(stateLock);
+        for (int client : clients)
+            shutdown(client, SHUT_RDWR);
+        changed.wait(l, [this]{ return sessions == 0; });
+    }
+
+    void session(int in, int out) {
+        vector<char> frame;
+        string reply;
+        while (readFrame(in, frame, reply)) {
+            bool ok = handle(frame, reply);
+            if (!writeAll(out, reply) || !ok)
+                return;
+            reply.clear();
+        }
+        if (!reply.empty())
+            writeAll(out, reply);
+    }
+
+    static bool readAll(int fd, char* buf, size_t n, bool& eof) {
+        size_t got = 0;
+        eof = false;
+        while (got < n) {
+            ssize_t r = read(fd, buf + got, n - got);
+            if (r > 0) {
+                got += (size_t) r;
+                continue;
+            }
+            if (r < 0 && errno == EINTR && !stopRequested)
+                continue;
+            eof = r == 0 && got == 0;
+            return false;
+        }
+        return true;
+    }
+
+    static bool writeAll(int fd, const string& data) {
+        size_t done = 0;
+        while (done < data.size()) {
+            ssize_t r = write(fd, data.data() + done, data.size() - done);
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r <= 0)
+                return false;
+            done += (size_t) r;
+        }
+        return true;
+    }
+
+    // False at end of input; an oversized frame leaves an error reply in reply.
+    static bool readFrame(int fd, vector<char>& frame, string& reply) {
+        char header[4];
+        bool eof;
+        if (!readAll(fd, header, sizeof(header), eof))
+            return false;
+        uint32_t size = getU32(header);
+        if (size == 0 || size > maxFrame) {
+            error(reply, "Bad frame size " + to_string(size));
+            return false;
+        }
+        frame.resize(size);
+        return readAll(fd, frame.data(), size, eof);
+    }
+
+    static uint32_t getU32(const char* p) {
+        auto b = reinterpret_cast<const unsigned char*>(p);
+        return (uint32_t) b[0] | (uint32_t) b[1] << 8 | (uint32_t) b[2] << 16 | (uint32_t) b[3] << 24;
+    }
+
+    static void putU32(string& out, uint32_t v) {
+        for (int i = 0; i < 4; i++)
+            out += (char) (v >> (8 * i));
+    }
+
+    static void putString(string& out, string_view s) {
+        putU32(out, (uint32_t) s.size());
+        out += s;
+    }
+
+    // Reply frame: size placeholder, filled by finish().
+    static void begin(string& reply, char kind) {
+        reply.assign(4, '\0');
+        reply += kind;
+    }
+
+    static void finish(string& reply) {
+        uint32_t size = (uint32_t) reply.size() - 4;
+        for (int i = 0; i < 4; i++)
+            reply[i] = (char) (size >> (8 * i));
+    }
+
+    static void error(string& reply, const string& message) {
+        begin(reply, 'E');
+        putString(reply, message);
+        finish(reply);
+    }
+
+    class FrameReader {
+    public:
+        FrameReader(const vector<char>& frame) : p(frame.data()), end(frame.data() + frame.size()) {}
+
+        bool u8(uint8_t& v) {
+            if (end - p < 1)
+                return false;
+            v = (uint8_t) *p++;
+            return true;
+        }
+
+        bool u32(uint32_t& v) {
+            if (end - p < 4)
+                return false;
+            v = getU32(p);
+            p += 4;
+            return true;
+        }
+
+        bool str(string_view& s) {
+            uint32_t len;
+            if (!u32(len) || (size_t) (end - p) < len)
+                return false;
+            s = string_view(p, len);
+            p += len;
+            return true;
+        }
+
+        bool done() const { return p == end; }
+
+    private:
+        const char* p;
+        const char* end;
+    };
+
+    // Returns false when the connection must be closed after the reply.
+    bool handle(const vector<char>& frame, string& reply) {
+        FrameReader in(frame);
+        uint8_t kind = 0;
+        in.u8(kind);
+        if (kind == 'C' && in.done()) {
+            bool saved = checkpoint();
+            begin(reply, 'C');
+            reply += (char) saved;
+            finish(reply);
+            return true;
+        }
+        uint8_t flags = 0;
+        uint32_t n = 0;
+        if (kind != 'L' || !in.u8(flags) || !in.u32(n) || n > frame.size() / 4) {
+            error(reply, "Bad frame");
+            return false;
+        }
+        vector<string_view> lines(n);
+        for (string_view& line : lines)
+            if (!in.str(line)) {
+                error(reply, "Truncated frame");
+                return false;
+            }
+        if (!in.done()) {
+            error(reply, "Trailing bytes in frame");
+            return false;
+        }
+        classify(lines, flags, reply);
+        return true;
+    }
+
+    void classify(const vector<string_view>& lines, uint8_t flags, string& reply) {
+        // Contents of the lines fitting the format; normalized copies are reserved, views stay valid.
+        vector<string> normalized;
+        normalized.reserve(lines.size());
+        vector<string_view> contents;
+        vector<int64_t> times;
+        vector<int> contentOf(lines.size(), -1);
+        vector<string_view> fields, parts;
+        for (size_t i = 0; i < lines.size(); i++) {
+            string_view line = lines[i];
+            if (!driver.acceptable(line))
+                continue;
+            if (CliDriver::nonAscii(line)) {
+                normalized.push_back(CliDriver::replaceNonAscii(line));
+                line = normalized.back();
+            }
+            if (!driver.format.extract(line, fields))
+                continue;
+            contentOf[i] = (int) contents.size();
+            contents.push_back(fields[driver.contentField]);
+            if (!driver.timeFields.empty())
+                times.push_back(driver.lineTime(fields, parts));
+        }
+
+        vector<int> clusterOf(contents.size());
+        vector<string_view> params;
+        begin(reply, 'R');
+        putU32(reply, (uint32_t) lines.size());
+        lock_guard<mutex> l(parserLock);
+        Parser& parser = driver.parser;
+        int first = driver.lastLine;
+        parser.parseEach(contents.size(), first, [&](size_t k, int logID){
+            clusterOf[k] = parser.feed(contents[k], logID);
+            if (!times.empty())
+                parser.countLine(clusterOf[k], times[k]);
+        });
+        driver.lastLine += (int) contents.size();
+        dirty = dirty || !contents.empty();
+        for (size_t i = 0; i < lines.size(); i++) {
+            int k = contentOf[i];
+            int c = k < 0 ? -1 : clusterOf[k];
+            const TemplateCluster* cluster = c >= 0 ? &parser.logClust[c] : nullptr;
+            putU32(reply, k < 0 ? 0 : (uint32_t) (first + k + 1));
+            putU32(reply, (uint32_t) c);
+            putU32(reply, cluster ? cluster->version : 0);
+            if (flags & 2) {
+                string text;
+                if (cluster)
+                    for (const string& tok : cluster->logTemplate)
+                        text += (text.empty() ? "" : " ") + tok;
+                putString(reply, text);
+            }
+            if (flags & 1) {
+                params.clear();
+                if (cluster)
+                    Parser::parameters(cluster->logTemplate, contents[k], params, parser.splitter.get());
+                putU32(reply, (uint32_t) params.size());
+                for (string_view p : params)
+                    putString(reply, p);
+            }
+        }
+        finish(reply);
+    }
+
+    bool checkpoint() {
+        /*
+         * Saves the state if --state is set; the snapshot is taken under the
+         * parser lock, written to disk outside it.
+         */
+        if (opts.statePath.empty())
+            return false;
+        lock_guard<mutex> order(checkpointLock);
+        string bytes;
+        {
+            lock_guard<mutex> l(parserLock);
+            bytes = driver.snapshot();
+            dirty = false;
+        }
+        driver.writeSnapshot(bytes);
+        return true;
+    }
+
+    void checkpointLoop() {
+        if (opts.statePath.empty() || opts.checkpointEvery <= 0)
+            return;
+        unique_lock<mutex> l(stateLock);
+        while (!changed.wait_for(l, chrono::seconds(opts.checkpointEvery), [this]{ return stopping; })) {
+            l.unlock();
+            bool due;
+            {
+                lock_guard<mutex> p(parserLock);
+                due = dirty;
+            }
+            try {
+                if (due)
+                    checkpoint();
+            } catch (const exception& e) {
+                fprintf(stderr, "cspell: %s\n", e.what());
+            }
+            l.lock();
+        }
+    }
+};
+
+int main(int argc, char** argv) {
+    Options opts;
+    try {
+        opts = parseArgs(argc, argv);
+    } catch (const invalid_argument& e) {
+        fprintf(stderr, "cspell: %s\n", e.what());
+        usage(stderr);
+        return 2;
+    }
+    try {
+        CliDriver driver(opts);
+        if (opts.serve.empty())
+            driver.run();
+        else
+            ParseDaemon(driver).serve();
+    } catch (const exception& e) {
+        fprintf(stderr, "cspell: %s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
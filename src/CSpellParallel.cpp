@@ -4,74 +4,89 @@
 #include <vector>
 #include <regex>
 #include <map>
+#include <numeric>
 #include <optional>
 #include <set>
 #include <cassert>
 #include <fstream>
 #include <shared_mutex>
 #include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <string_view>
+#include <memory>
+#include "SegmentedVector.h"
+#include "ThreadPool.h"
 
 using namespace std;
 
-vector<string> split(string s, const string& delimiter = "[\\s=:,]"){
+vector<string> split(string_view s, const string& delimiter = "[\\s=:,]"){
     vector<string> res;
 
-    regex rgx(delimiter);
-    sregex_token_iterator iter(s.begin(),s.end(),
-                               rgx,-1);
-    sregex_token_iterator end;
+    // Compiling the regex costs more than splitting a line, keep the last one per thread.
+    static thread_local pair<string, regex> cached;
+    if (cached.first != delimiter || delimiter.empty())
+        cached = {delimiter, regex(delimiter)};
+    cregex_token_iterator iter(s.data(), s.data() + s.size(),
+                               cached.second, -1);
+    cregex_token_iterator end;
     for ( ; iter != end; ++iter){
-        if (*iter != "")
-            res.push_back(*iter);
+        if (iter->length() != 0)
+            res.emplace_back(iter->first, iter->second);
     }
 
     return res;
 }
 
-vector<string> LCS(vector<string> seq1, vector<string> seq2) {
-    vector<vector<int>> lengths(seq1.size()+1,vector<int>(seq2.size()+1));
+vector<string> LCS(const vector<string>& seq1, const vector<string>& seq2) {
+    // Row-major (seq1.size()+1) x (seq2.size()+1) table in a single allocation.
+    const size_t cols = seq2.size()+1;
+    vector<int> lengths((seq1.size()+1) * cols);
+    auto at = [&lengths, cols](size_t i, size_t j) -> int& { return lengths[i*cols + j]; };
     for (int i = 0; i < seq1.size() ; i++){
         for (int j = 0; j < seq2.size(); j++) {
 //                printf("i: %d j:%d\n", i, j);
             if (seq1[i] == seq2[j])
-                lengths[i+1][j+1] = lengths[i][j]+1;
+                at(i+1, j+1) = at(i, j)+1;
             else
-                lengths[i+1][j+1] = max(lengths[i+1][j], lengths[i][j+1]);
+                at(i+1, j+1) = max(at(i+1, j), at(i, j+1));
         }
     }
     vector<string> result;
     auto lenOfSeq1= seq1.size();
     auto lenOfSeq2 = seq2.size();
     while (lenOfSeq1 != 0 && lenOfSeq2 != 0){
-        if (lengths[lenOfSeq1][lenOfSeq2] == lengths[lenOfSeq1-1][lenOfSeq2])
+        if (at(lenOfSeq1, lenOfSeq2) == at(lenOfSeq1-1, lenOfSeq2))
             lenOfSeq1--;
-        else if (lengths[lenOfSeq1][lenOfSeq2] == lengths[lenOfSeq1][lenOfSeq2-1])
+        else if (at(lenOfSeq1, lenOfSeq2) == at(lenOfSeq1, lenOfSeq2-1))
             lenOfSeq2--;
         else{
             assert(seq1[lenOfSeq1-1] == seq2[lenOfSeq2-1] && "Error in LCS");
-            result.insert(result.begin(), seq1[lenOfSeq1-1]);
+            result.push_back(seq1[lenOfSeq1-1]);
             lenOfSeq1--;
             lenOfSeq2--;
         }
     }
+    reverse(result.begin(), result.end());
     return result;
 }
 
-vector<string> getTemplate(vector<string> lcs, vector<string> seq) {
+vector<string> getTemplate(const vector<string>& lcs, const vector<string>& seq) {
     vector<string> res;
     if (lcs.empty())
         return res;
 
-    reverse(lcs.begin(), lcs.end());
+    res.reserve(seq.size());
+    size_t next = 0;
     int i = 0;
     for (const string& tok : seq) {
         i++;
-        if (tok == lcs[lcs.size() - 1]){
+        if (tok == lcs[next]){
             res.push_back(tok);
-            lcs.erase(lcs.begin() + lcs.size() - 1);
+            next++;
         }else
             res.emplace_back("<*>");
-        if (lcs.empty())
+        if (next == lcs.size())
             break;
     }
     if (i < seq.size())
@@ -79,69 +94,87 @@ vector<string> getTemplate(vector<string> lcs, vector<string> seq) {
     return res;
 }
 
-class LockWrapper{
+class TemplateCluster{
+    /*
+     * The template is published as immutable versions: readers load the current
+     * one with a single atomic read and never block, a generalization installs a
+     * new version and bumps the version counter. Older versions stay alive with
+     * the cluster, since trie leaves and in-flight readers may still point to them.
+     * Writers of the template are serialized by Parser::trieLock.
+     */
 public:
-    mutable shared_mutex mutex;
-    mutable shared_mutex switchLock;
+    vector<int> logIds;
 
-    bool promoteLock(){
-        bool res = switchLock.try_lock();
-        if (!res)
-            return false;
-        mutex.unlock_shared();
-        mutex.lock();
-        return true;
+    TemplateCluster() : TemplateCluster(vector<string>()) {}
+    TemplateCluster(vector<string> tmp){
+        setTemplate(std::move(tmp));
+    }
+    TemplateCluster(vector<string> tmp, vector<int> ids)
+            : logIds(std::move(ids)){
+        setTemplate(std::move(tmp));
     }
+    TemplateCluster(const TemplateCluster& other)
+            : TemplateCluster(other.logTemplate(), other.lineIds()){}
 
-    void demoteLock(){
-        mutex.unlock();
-        mutex.lock_shared();
-        switchLock.unlock();
+    const vector<string>& logTemplate() const {
+        return *current.load(memory_order_acquire);
     }
 
-    void writeLock(){
-        switchLock.lock();
-        mutex.lock();
+    unsigned version() const {
+        return seq.load(memory_order_acquire);
     }
 
-    void writeUnlock(){
-        mutex.unlock();
-        switchLock.unlock();
+    // Latest version, shared with the trie. Writers only.
+    const shared_ptr<const vector<string>>& templateVersion() const {
+        return versions.back();
     }
-};
 
-class TemplateCluster : public LockWrapper{
-public:
-    vector<string> logTemplate;
-    vector<int> logIds;
+    void setTemplate(vector<string> tmp){
+        versions.push_back(make_shared<const vector<string>>(std::move(tmp)));
+        current.store(versions.back().get(), memory_order_release);
+        seq.fetch_add(1, memory_order_release);
+    }
 
-    TemplateCluster(){}
-    TemplateCluster(vector<string> tmp)
-            : logTemplate(std::move(tmp)){}
-    TemplateCluster(vector<string> tmp, vector<int> ids)
-            : logTemplate(tmp), logIds(ids){}
+    void addId(int logID){
+        lockIds();
+        logIds.push_back(logID);
+        unlockIds();
+    }
+
+    vector<int> lineIds() const {
+        lockIds();
+        vector<int> res = logIds;
+        unlockIds();
+        return res;
+    }
 
-    TemplateCluster(const TemplateCluster& other) {
-//        lock_guard<shared_mutex> l(other.mutex);
-        logTemplate = other.logTemplate;
-        logIds = other.logIds;
+    template <class F>
+    void updateIds(F&& f){
+        lockIds();
+        f(logIds);
+        unlockIds();
     }
-    TemplateCluster(TemplateCluster&& other)  noexcept {
-        lock_guard<shared_mutex> l(other.mutex);
-        logTemplate = other.logTemplate;
-        logIds = other.logIds;
+
+private:
+    atomic<const vector<string>*> current{nullptr};
+    atomic<unsigned> seq{0};
+    vector<shared_ptr<const vector<string>>> versions;
+    mutable atomic_flag idLock = ATOMIC_FLAG_INIT;
+
+    void lockIds() const {
+        while (idLock.test_and_set(memory_order_acquire))
+            this_thread::yield();
     }
-    TemplateCluster& operator=(TemplateCluster&& other)  noexcept {
-        lock_guard<shared_mutex> l1(this->mutex), l2(other.mutex);
-        swap(logTemplate, other.logTemplate);
-        swap(logIds, other.logIds);
-        return *this;
+
+    void unlockIds() const {
+        idLock.clear(memory_order_release);
     }
 };
 
-class TrieNode : public LockWrapper{
+class TrieNode{
 public:
-    optional<TemplateCluster> cluster;
+    // Template version the leaf was created with, shared with its TemplateCluster.
+    shared_ptr<const vector<string>> cluster;
     string token;
     int templateNo;
     map<string , TrieNode> child;
@@ -150,389 +183,596 @@ public:
     TrieNode(string token, int templateNo)
             : token(std::move(token)), templateNo(templateNo){}
 
-    TrieNode(optional<TemplateCluster> cluster,
+    TrieNode(shared_ptr<const vector<string>> cluster,
              string token,
              int templateNo,
              const map<string, TrieNode> &child) :
             cluster(std::move(cluster)), token(std::move(token)), templateNo(templateNo), child(child) {}
-
-    TrieNode(const TrieNode& other) {
-        lock_guard<shared_mutex> l(other.mutex);
-        if (other.cluster.has_value())
-            cluster = other.cluster.value();
-        token = other.token;
-        templateNo = other.templateNo;
-        child = other.child;
-    }
-    TrieNode(TrieNode&& other)  noexcept {
-        lock_guard<shared_mutex> l(other.mutex);
-        swap(cluster, other.cluster);
-        token = other.token;
-        templateNo = other.templateNo;
-        child = other.child;
-    }
-    TrieNode& operator=(TrieNode&& other)  noexcept {
-        lock_guard<shared_mutex> l1(this->mutex), l2(other.mutex);
-        swap(cluster, other.cluster);
-        swap(token, other.token);
-        swap(templateNo, other.templateNo);
-        swap(child, other.child);
-        return *this;
-    }
-    TrieNode& operator=(const TrieNode&& other)  noexcept {
-        lock_guard<shared_mutex> l1(this->mutex), l2(other.mutex);
-        if (other.cluster.has_value())
-            cluster = other.cluster.value();
-        token = other.token;
-        templateNo = other.templateNo;
-        child = other.child;
-        return *this;
-    }
 };
 
+// Clusters never move once added, so TemplateCluster* stay valid while other threads append.
+using ClusterTable = SegmentedVector<TemplateCluster>;
+
 class Parser{
 public:
-    vector<TemplateCluster> logClust;
+    ClusterTable logClust;
     TrieNode trieRoot;
+    // Guards the trie; template generalizations are published under it in exclusive mode.
+    mutable shared_mutex trieLock;
     float tau;
     int id = 0;
-    mutable shared_mutex clustLock;
+    unsigned long epoch = 0;
+    shared_ptr<ThreadPool> executor;
+    size_t grain = 64;
+
+    struct Speculation {
+        unsigned long epoch;
+        int cluster;
+        bool create;
+        bool generalize;
+        vector<string> newTemplate;
+    };
 
     Parser() : tau(.5) {}
     explicit Parser(float tau)
             : tau(tau){}
-    Parser(vector<TemplateCluster> logClust, TrieNode trieRoot, float tau)
-            : logClust(logClust), trieRoot(trieRoot), tau(tau){}
+    Parser(const vector<TemplateCluster>& logClust, TrieNode trieRoot, float tau)
+            : trieRoot(trieRoot), tau(tau){
+        for (const auto &clust : logClust)
+            this->logClust.push_back(clust);
+    }
 
-    void addTemplate(string newTemplate){
-        auto logTemplate = split(std::move(newTemplate));
-        addTemplate(logTemplate);
+    void addTemplate(const string& newTemplate){
+        addTemplate(split(newTemplate));
     }
 
     void addTemplate(vector<string> newTemplate){
-        auto newCluster = TemplateCluster(std::move(newTemplate));
-        clustLock.lock();
-        logClust.push_back(newCluster);
-        clustLock.unlock();
+        auto &newCluster = logClust.emplace_back(std::move(newTemplate));
+        unique_lock<shared_mutex> l(trieLock);
         addSeqToPrefixTree(trieRoot, newCluster);
     }
 
-    void purgeIDs(){
-        clustLock.lock();
-        int max = 0;
-        for (auto &clust: logClust) {
-            int tmp = *std::max_element(clust.logIds.begin(), clust.logIds.end());
-            max = tmp > max ? tmp : max;
+    size_t addTemplates(const vector<string>& templates){
+        /*
+         * addTemplate() for a template library, skipping duplicates of an earlier
+         * template or of one already in logClust. Templates are split on the
+         * executor if there is one, and the trie is built under a single exclusive
+         * lock, in the order of the constant tokens so a shared prefix is walked
+         * once. The result is that of addTemplate() on the kept templates.
+         */
+        size_t n = templates.size();
+        vector<vector<string>> toks(n);
+        auto splitRange = [&](size_t begin, size_t end, int){
+            for (size_t i = begin; i < end; i++)
+                toks[i] = split(templates[i]);
+        };
+        if (executor)
+            executor->run(n, grain, splitRange);
+        else
+            splitRange(0, n, 0);
+        vector<vector<string_view>> consts(n);
+        for (size_t i = 0; i < n; i++)
+            for (const string& tok : toks[i])
+                if (tok != "<*>")
+                    consts[i].push_back(tok);
+
+        // Equal constant tokens form a run, within it equal templates are adjacent and the first one is kept.
+        vector<size_t> order(n);
+        iota(order.begin(), order.end(), 0);
+        sort(order.begin(), order.end(), [&](size_t a, size_t b){
+            if (consts[a] != consts[b])
+                return consts[a] < consts[b];
+            return toks[a] != toks[b] ? toks[a] < toks[b] : a < b;
+        });
+        set<vector<string>> known;
+        for (size_t c = 0; c < logClust.size(); c++)
+            known.insert(logClust[c].logTemplate());
+        vector<bool> keep(n);
+        for (size_t k = 0; k < n; k++) {
+            size_t i = order[k];
+            keep[i] = !(k > 0 && toks[order[k - 1]] == toks[i]) && !known.count(toks[i]);
         }
-        for (auto &clust: logClust) {
-            int tmp = *std::max_element(clust.logIds.begin(), clust.logIds.end());
-            if (tmp < max)
-                clust.logIds.clear();
-            else{
-                clust.logIds.clear();
-                clust.logIds.push_back(max);
+        // Clusters first, in input order, so the leaves can share their template versions.
+        // Copied, consts views the tokens.
+        vector<TemplateCluster*> added(n, nullptr);
+        for (size_t i = 0; i < n; i++)
+            if (keep[i])
+                added[i] = &logClust.emplace_back(toks[i]);
+
+        unique_lock<shared_mutex> l(trieLock);
+        vector<TrieNode*> path{&trieRoot};
+        const vector<string_view>* last = nullptr;
+        size_t count = 0;
+        for (size_t runStart = 0, runEnd; runStart < n; runStart = runEnd) {
+            const auto &run = consts[order[runStart]];
+            int kept = 0;
+            size_t first = n;
+            for (runEnd = runStart; runEnd < n && consts[order[runEnd]] == run; runEnd++) {
+                if (keep[order[runEnd]]) {
+                    kept++;
+                    first = min(first, order[runEnd]);
+                }
             }
+            if (kept == 0)
+                continue;
+            count += kept;
+            size_t shared = 0;
+            if (last)
+                while (shared < last->size() && shared < run.size() && (*last)[shared] == run[shared])
+                    shared++;
+            last = &run;
+            path.resize(shared + 1);
+            for (size_t d = 1; d < path.size(); d++)
+                path[d]->templateNo += kept;
+            for (size_t d = shared; d < run.size(); d++) {
+                auto &children = path.back()->child;
+                string tok(run[d]);
+                auto it = children.end();
+                if (!children.empty() && children.rbegin()->first >= tok)
+                    it = children.lower_bound(tok);
+                if (it == children.end() || it->first != tok)
+                    it = children.emplace_hint(it, piecewise_construct, forward_as_tuple(tok), forward_as_tuple(tok, 0));
+                it->second.templateNo += kept;
+                path.push_back(&it->second);
+            }
+            if (!path.back()->cluster)
+                path.back()->cluster = added[first]->templateVersion();
         }
-        clustLock.unlock();
-        purgeTreeIDs(trieRoot);
-
+        return count;
     }
 
-    void purgeTreeIDs(TrieNode& tree){
-        tree.writeLock();
-        if (tree.cluster.has_value()){
-            tree.cluster.value().logIds.clear();
+    void purgeIDs(){
+        int max = 0;
+        for (size_t c = 0; c < logClust.size(); c++) {
+            logClust[c].updateIds([&max](vector<int>& ids){
+                if (!ids.empty()) {
+                    int tmp = *std::max_element(ids.begin(), ids.end());
+                    max = tmp > max ? tmp : max;
+                }
+            });
         }
-        for (auto &child: tree.child) {
-            purgeTreeIDs(child.second);
+        for (size_t c = 0; c < logClust.size(); c++) {
+            logClust[c].updateIds([max](vector<int>& ids){
+                bool hasMax = std::find(ids.begin(), ids.end(), max) != ids.end();
+                ids.clear();
+                if (hasMax)
+                    ids.push_back(max);
+            });
         }
-        tree.writeUnlock();
-
     }
 
-    void removeSeqFromPrefixTree(TrieNode& prefixTreeRoot, vector<string> logTemplate){
-//        printf("ID: %d removeSeqFromPrefixTree\n", id);
-
-        auto parentIter = &prefixTreeRoot;
-        vector<string> seq;
-        copy_if (logTemplate.begin(), logTemplate.end(),
-                 back_inserter(seq),
-                 [](const string& s){return s != "<*>";});
-        (*parentIter).mutex.lock_shared();
-        for (const string& tok : seq) {
-            // Assume parentIter locked as Shared
-
-            checkExists:
-            // WARNING: possible deletion after finding the branch.
-            if ((*parentIter).child.count(tok)){
-                parentIter->child[tok].mutex.lock_shared();
-                auto matched = &(*parentIter).child[tok];
-                if ((*matched).templateNo == 1){
-                    if (!(*parentIter).promoteLock()){
-                        (*parentIter).mutex.unlock_shared();
-                        (*parentIter).mutex.lock_shared();
-                        goto checkExists;
-                    }
-                    // WARNING: possible unsafe destruction of branch with active locks.
-                    (*parentIter).child.erase(tok);
-                    (*parentIter).demoteLock();
+    void removeSeqFromPrefixTree(TrieNode& prefixTreeRoot, const vector<string>& logTemplate){
+        /*
+         * Caller holds trieLock exclusively.
+         */
+        auto parentn = &prefixTreeRoot;
+        for (const string& tok : logTemplate) {
+            if (tok == "<*>")
+                continue;
+            auto matched = parentn->child.find(tok);
+            if (matched != parentn->child.end()){
+                if (matched->second.templateNo == 1){
+                    parentn->child.erase(matched);
                     break;
                 }else {
-                    if (!(*matched).promoteLock()){
-                        (*matched).mutex.unlock_shared();
-                        goto checkExists;
-                    }
-                    (*matched).templateNo--;
-                    (*matched).demoteLock();
-                    auto old = parentIter;
-                    parentIter = matched;
-                    (*old).mutex.unlock_shared();
+                    matched->second.templateNo--;
+                    parentn = &matched->second;
                 }
             }
         }
-        (*parentIter).mutex.unlock_shared();
     }
 
-    void addSeqToPrefixTree(TrieNode& prefixTreeRoot, TemplateCluster newCluster){
-//        printf("ID: %d addSeqToPrefixTree\n", id);
+    void addSeqToPrefixTree(TrieNode& prefixTreeRoot, const TemplateCluster& newCluster){
+        /*
+         * Caller holds trieLock exclusively.
+         */
+        auto parentn = &prefixTreeRoot;
+        for (const string& tok : newCluster.logTemplate()) {
+            if (tok == "<*>")
+                continue;
+            auto res = parentn->child.try_emplace(tok, tok, 0);
+            res.first->second.templateNo++;
+            parentn = &res.first->second;
+        }
+        // If empty leaf add cluster
+        if (!parentn->cluster)
+            parentn->cluster = newCluster.templateVersion();
+    }
 
-        auto parentIter = &prefixTreeRoot;
-        vector<string> seq;
-        copy_if (newCluster.logTemplate.begin(), newCluster.logTemplate.end(),
-                 back_inserter(seq),
-                 [](const string& s){return s != "<*>";});
+    void rewriteSeqInPrefixTree(TrieNode& prefixTreeRoot, const vector<string>& oldTemplate,
+                                const TemplateCluster& cluster){
+        /*
+         * Caller holds trieLock exclusively. Same result as removeSeqFromPrefixTree
+         * of oldTemplate then addSeqToPrefixTree of cluster, in one walk that keeps
+         * the nodes of the shared constant prefix and only rewrites the divergent
+         * suffix, so the exclusive section of a generalization stays short. From the
+         * first node counting a single template, which the pair would erase and
+         * rebuild, the shared nodes are reset instead.
+         */
+        vector<const string*> oldConst, newConst;
+        for (const string& tok : oldTemplate)
+            if (tok != "<*>")
+                oldConst.push_back(&tok);
+        for (const string& tok : cluster.logTemplate())
+            if (tok != "<*>")
+                newConst.push_back(&tok);
+
+        vector<TrieNode*> path;
+        path.reserve(oldConst.size());
+        size_t single = oldConst.size();
+        auto parentn = &prefixTreeRoot;
+        for (const string* tok : oldConst) {
+            auto matched = parentn->child.find(*tok);
+            if (matched == parentn->child.end()) {
+                removeSeqFromPrefixTree(prefixTreeRoot, oldTemplate);
+                addSeqToPrefixTree(prefixTreeRoot, cluster);
+                return;
+            }
+            parentn = &matched->second;
+            if (single == oldConst.size() && parentn->templateNo == 1)
+                single = path.size();
+            path.push_back(parentn);
+        }
 
-        (*parentIter).writeLock();
-        for (const string& tok : seq) {
-            // Assume parentIter locked
-            if (parentIter->child.count(tok)) {
-                parentIter->child[tok].templateNo++;
+        size_t shared = 0;
+        while (shared < oldConst.size() && shared < newConst.size() && *oldConst[shared] == *newConst[shared])
+            shared++;
+        auto nodeAt = [&](size_t depth){ return depth == 0 ? &prefixTreeRoot : path[depth - 1]; };
+
+        if (single < shared) {
+            for (size_t d = single; d < shared; d++) {
+                TrieNode* node = path[d];
+                node->cluster.reset();
+                node->templateNo = 1;
+                for (auto it = node->child.begin(); it != node->child.end();)
+                    it = d + 1 < shared && &it->second == path[d + 1] ? next(it) : node->child.erase(it);
             }
-            else{
-                parentIter->child.insert({tok,TrieNode(tok, 1)});
+        } else {
+            if (shared == oldConst.size() && shared == newConst.size())
+                return;
+            for (size_t d = shared; d < oldConst.size(); d++) {
+                if (path[d]->templateNo == 1) {
+                    nodeAt(d)->child.erase(*oldConst[d]);
+                    break;
+                }
+                path[d]->templateNo--;
             }
-            (*parentIter).demoteLock();
-            auto old = parentIter;
-            // Lock child and unlock parent
-            parentIter->child[tok].writeLock();
-            parentIter = &parentIter->child[tok];
-            (*old).mutex.unlock_shared();
         }
-        // If empty leaf add cluster
-        if (!parentIter->cluster.has_value()) {
-            parentIter->cluster = newCluster;
+
+        parentn = nodeAt(shared);
+        for (size_t d = shared; d < newConst.size(); d++) {
+            auto res = parentn->child.try_emplace(*newConst[d], *newConst[d], 0);
+            res.first->second.templateNo++;
+            parentn = &res.first->second;
         }
-        (*parentIter).writeUnlock();
+        if (!parentn->cluster)
+            parentn->cluster = cluster.templateVersion();
     }
 
-    optional<TemplateCluster*> LCSMatch(vector<TemplateCluster> &cluster, vector<string> logMsg){
-        /*
-         * Returns reference to matching TemplateCluster locked as shared.
-         */
-//        printf("ID: %d LCSMatch\n", id);
-
+    optional<TemplateCluster*> LCSMatch(ClusterTable &cluster, const vector<string>& logMsg){
         optional<TemplateCluster *> res;
-        set<string> msgSet;
-        for (const string& w : logMsg) {
-            msgSet.insert(w);
-        }
+        set<string_view> msgSet(logMsg.begin(), logMsg.end());
         double msgLen = logMsg.size();
         int maxLen = -1;
+        size_t maxTemplateLen = 0;
         optional<TemplateCluster *> maxLCS;
 
-        for (TemplateCluster& templateCluster : cluster) {
-            templateCluster.mutex.lock_shared();
-            set<string> tempSet;
-            for (auto w : templateCluster.logTemplate) {
-                tempSet.insert(w);
-            }
-            set<string> intersect;
-            set_intersection(msgSet.begin(), msgSet.end(), tempSet.begin(), tempSet.end(),
-                             inserter(intersect, intersect.begin()));
-            if (intersect.size() < .5 * msgLen) {
-                templateCluster.mutex.unlock_shared();
+        for (size_t c = 0, n = cluster.size(); c < n; c++) {
+            TemplateCluster& templateCluster = cluster[c];
+            const vector<string>& logTemplate = templateCluster.logTemplate();
+            set<string_view> tempSet(logTemplate.begin(), logTemplate.end());
+            size_t intersect = count_if(tempSet.begin(), tempSet.end(),
+                                        [&msgSet](string_view w) { return msgSet.count(w) > 0; });
+            if (intersect < .5 * msgLen)
                 continue;
-            }
-            auto lcs = LCS(logMsg, templateCluster.logTemplate);
+            auto lcs = LCS(logMsg, logTemplate);
             int lenLcs = lcs.size();
             if (lenLcs > maxLen ||
-                (lenLcs == maxLen &&
-                 templateCluster.logTemplate.size() < (*maxLCS.value()).logTemplate.size())){
+                (lenLcs == maxLen && logTemplate.size() < maxTemplateLen)){
                 maxLen = lenLcs;
-                // Unlock previous maximum
-                if (maxLCS.has_value())
-                    (*maxLCS.value()).mutex.unlock_shared();
+                maxTemplateLen = logTemplate.size();
                 maxLCS = optional(&templateCluster);
             }
-
-            // Keep maximum value locked
-            if (maxLCS.value() != &templateCluster){
-                templateCluster.mutex.unlock_shared();
-            }
         }
 
         if (maxLen >= tau * msgLen)
             res = maxLCS;
-        else {
-            // Unlock max cluster if not selected
-            if (maxLCS.has_value())
-                (*maxLCS.value()).mutex.unlock_shared();
-        }
 
         return res;
     }
 
-    optional<TemplateCluster*> simpleLoopMatch(vector<TemplateCluster> &cluster, vector<string> constLogMsg){
-        /*
-         * Returns reference to matching TemplateCluster locked as shared.
-         */
-//        printf("ID: %d simpleLoopMatch\n", id);
-
-        for (TemplateCluster& templateCluster : cluster) {
-            templateCluster.mutex.lock_shared();
-            if (templateCluster.logTemplate.size() < .5 * constLogMsg.size()) {
-                templateCluster.mutex.unlock_shared();
+    optional<TemplateCluster*> simpleLoopMatch(ClusterTable &cluster, const vector<string>& constLogMsg){
+        set<string_view> tokenSet(constLogMsg.begin(), constLogMsg.end());
+        for (size_t c = 0, n = cluster.size(); c < n; c++) {
+            TemplateCluster& templateCluster = cluster[c];
+            const vector<string>& logTemplate = templateCluster.logTemplate();
+            if (logTemplate.size() < .5 * constLogMsg.size())
                 continue;
-            }
-            set<string> tokenSet;
-            for (string w : constLogMsg) {
-                tokenSet.insert(w);
-            }
-            if (all_of(templateCluster.logTemplate.cbegin(), templateCluster.logTemplate.cend(),
-                       [&tokenSet](const string &tok) { return tok == "<*>" || tokenSet.count(tok); })) {
-//                templateCluster.mutex.unlock_shared();
+            if (all_of(logTemplate.cbegin(), logTemplate.cend(),
+                       [&tokenSet](const string &tok) { return tok == "<*>" || tokenSet.count(tok); }))
                 return &templateCluster;
-            }
-            templateCluster.mutex.unlock_shared();
         }
         return nullopt;
     }
 
-    vector<string> prefixTreeMatch(TrieNode &prefixTree, vector<string> constLogMsg, int start){
-//        printf("ID: %d prefixTreeMatch\n", id);
-
-        prefixTree.mutex.lock_shared();
+    shared_ptr<const vector<string>> prefixTreeMatch(TrieNode &prefixTree, const vector<string>& constLogMsg, int start){
+        shared_lock<shared_mutex> l(trieLock);
+        const TrieNode *node = &prefixTree;
         for (int i = start; i < constLogMsg.size(); i++) {
-//            WARNING: possible deletion after finding the branch.
-            if (prefixTree.child.count(constLogMsg[i])){
-                prefixTree.child.at(constLogMsg[i]).mutex.lock_shared();
-                TrieNode *child = &(prefixTree.child.at(constLogMsg[i]));
-                if ((*child).cluster.has_value()) {
-                    vector<string> tmp = (*child).cluster.value().logTemplate;
-                    vector<string> constLM;
-                    copy_if(tmp.begin(), tmp.end(),
-                            back_inserter(constLM),
-                            [](string s) { return s != "<*>"; });
-                    if (constLM.size() >= tau * constLogMsg.size()){
-                        (*child).mutex.unlock_shared();
-                        prefixTree.mutex.unlock_shared();
-                        return (*child).cluster.value().logTemplate;
-                    }
-                } else {
-                    auto res = prefixTreeMatch((*child), constLogMsg, i + 1);
-                    (*child).mutex.unlock_shared();
-                    prefixTree.mutex.unlock_shared();
+            auto child = node->child.find(constLogMsg[i]);
+            if (child == node->child.end())
+                continue;
+            if (child->second.cluster) {
+                const vector<string> &tmp = *child->second.cluster;
+                auto constLen = count_if(tmp.begin(), tmp.end(),
+                                         [](const string& s) { return s != "<*>"; });
+                if (constLen >= tau * constLogMsg.size())
+                    return child->second.cluster;
+            } else
+                // Continue the match from the next token inside the child.
+                node = &child->second;
+        }
+        return nullptr;
+    }
+
+    const vector<string>& generalize(TemplateCluster& cluster, const vector<string>& tokMsg){
+        /*
+         * Generalizes the template of cluster with tokMsg. The new template is
+         * computed from a snapshot and published only if no other thread published
+         * a version in between, otherwise it is recomputed from the newer one.
+         */
+        while (true) {
+            unsigned version = cluster.version();
+            const vector<string> &current = cluster.logTemplate();
+            auto newTemplate = getTemplate(LCS(tokMsg, current), current);
+            if (newTemplate == current)
+                return current;
+            unique_lock<shared_mutex> l(trieLock);
+            if (cluster.version() != version)
+                continue;
+            // current stays alive as an older version of the cluster.
+            cluster.setTemplate(std::move(newTemplate));
+            rewriteSeqInPrefixTree(trieRoot, current, cluster);
+            epoch++;
+            // Versions are never freed before the cluster, the reference stays valid.
+            return *cluster.templateVersion();
+        }
+    }
+
+    int findCluster(const vector<string>& logTemplate){
+        // First cluster with the template, the one the sequential engine assigns the line to.
+        for (int c = 0; c < logClust.size(); c++)
+            if (logClust[c].logTemplate() == logTemplate)
+                return c;
+        return -1;
+    }
+
+    Speculation speculate(const vector<string>& tokMsg){
+        /*
+         * Computes, without mutating anything, what the sequential parser would do
+         * with tokMsg in the current state. Only valid while epoch does not change.
+         */
+        Speculation res{epoch, -1, false, false, {}};
+        vector<string> constLogMsg;
+        constLogMsg.reserve(tokMsg.size());
+        copy_if (tokMsg.begin(), tokMsg.end(),
+                 back_inserter(constLogMsg),
+                 [](const string& s){return s != "<*>";});
+        auto trieMatch = prefixTreeMatch(trieRoot, constLogMsg, 0);
+        const vector<string> *templateMatch = trieMatch.get();
+        if (templateMatch == nullptr){
+            optional<TemplateCluster *> matchCluster = simpleLoopMatch(logClust, constLogMsg);
+            if (!matchCluster.has_value()){
+                matchCluster = LCSMatch(logClust, tokMsg);
+                if (!matchCluster.has_value()){
+                    res.create = true;
+                    return res;
+                }
+                auto &matchClustTemplate = matchCluster.value()->logTemplate();
+                auto newTemplate = getTemplate(LCS(tokMsg, matchClustTemplate), matchClustTemplate);
+                if (newTemplate != matchClustTemplate){
+                    res.cluster = (int) logClust.indexOf(matchCluster.value());
+                    res.generalize = true;
+                    res.newTemplate = std::move(newTemplate);
                     return res;
                 }
-                (*child).mutex.unlock_shared();
             }
+            templateMatch = &matchCluster.value()->logTemplate();
+        }
+        res.cluster = findCluster(*templateMatch);
+        return res;
+    }
+
+    int commit(Speculation& spec, const vector<string>& tokMsg, int logID){
+        /*
+         * Applies the speculation of line logID, re-executing it first if an earlier
+         * line mutated the state it was taken on. Must be called in line ID order.
+         */
+        if (spec.epoch != epoch)
+            spec = speculate(tokMsg);
+        if (spec.create){
+            auto &newCluster = logClust.emplace_back(tokMsg, vector<int>{logID});
+            unique_lock<shared_mutex> l(trieLock);
+            addSeqToPrefixTree(trieRoot, newCluster);
+            epoch++;
+            return (int) logClust.size() - 1;
+        }
+        if (spec.generalize){
+            auto &matchCluster = logClust[spec.cluster];
+            unique_lock<shared_mutex> l(trieLock);
+            const vector<string> &current = matchCluster.logTemplate();
+            matchCluster.setTemplate(std::move(spec.newTemplate));
+            rewriteSeqInPrefixTree(trieRoot, current, matchCluster);
+            epoch++;
+            l.unlock();
+            spec.cluster = findCluster(matchCluster.logTemplate());
+        }
+        if (spec.cluster >= 0)
+            logClust[spec.cluster].addId(logID);
+        return spec.cluster;
+    }
+
+    vector<TemplateCluster> parseOrdered(const vector<string>& content, const int lastLine=0, int threads=0){
+        /*
+         * Deterministic mode: all threads tokenize a batch of lines and speculate their
+         * match against a frozen state, then this thread commits the batch in line ID
+         * order. A speculation taken before an earlier line of the batch changed the
+         * clusters or the trie is re-executed at commit time, so the result is exactly
+         * the one of the sequential parser. The batch shrinks after mutations and grows
+         * back while lines keep validating. With an executor set, its workers speculate
+         * and threads is ignored; otherwise threads are started for the call.
+         */
+        bool pooled = executor != nullptr;
+        int tMax = pooled ? executor->size() : threads > 0 ? threads : max(1, (int) thread::hardware_concurrency());
+        const size_t minBatch = 16 * tMax, maxBatch = 4096 * tMax;
+        size_t batch = 256 * tMax;
+        vector<vector<string>> tokens(maxBatch);
+        vector<Speculation> specs(maxBatch);
+
+        size_t begin = 0, end = 0;
+        atomic<size_t> next(0);
+        mutex phaseLock;
+        condition_variable phase;
+        int generation = 0, pending = 0;
+        bool done = false;
+
+        const size_t step = 16;
+        auto speculateRange = [&](size_t from, size_t to){
+            for (size_t i = from; i < to; i++) {
+                tokens[i - begin] = split(content[i], "[\\s=:,]");
+                specs[i - begin] = speculate(tokens[i - begin]);
+            }
+        };
+        auto speculateBatch = [&](){
+            for (size_t from = next.fetch_add(step); from < end; from = next.fetch_add(step))
+                speculateRange(from, min(from + step, end));
+        };
+        auto worker = [&](){
+            int seen = 0;
+            unique_lock<mutex> l(phaseLock);
+            while (true) {
+                phase.wait(l, [&]{ return done || generation != seen; });
+                if (done)
+                    return;
+                seen = generation;
+                l.unlock();
+                speculateBatch();
+                l.lock();
+                if (--pending == 0)
+                    phase.notify_all();
+            }
+        };
+        vector<thread> workers;
+        for (int t = 1; t < tMax && !pooled; t++)
+            workers.emplace_back(worker);
+
+        while (begin < content.size()) {
+            end = min(content.size(), begin + batch);
+            if (pooled) {
+                executor->run(end - begin, step, [&](size_t from, size_t to, int){
+                    speculateRange(begin + from, begin + to);
+                });
+            } else {
+                next = begin;
+                {
+                    lock_guard<mutex> l(phaseLock);
+                    pending = tMax - 1;
+                    generation++;
+                }
+                phase.notify_all();
+                speculateBatch();
+                {
+                    unique_lock<mutex> l(phaseLock);
+                    phase.wait(l, [&]{ return pending == 0; });
+                }
+            }
+
+            unsigned long startEpoch = epoch;
+            for (size_t i = begin; i < end; i++)
+                commit(specs[i - begin], tokens[i - begin], (int) i + 1 + lastLine);
+            batch = epoch != startEpoch ? max(minBatch, batch / 2) : min(maxBatch, batch * 2);
+            begin = end;
+        }
+
+        {
+            lock_guard<mutex> l(phaseLock);
+            done = true;
         }
-        prefixTree.mutex.unlock_shared();
-        return {};
-//        return vector<string>();
+        phase.notify_all();
+        for (auto& th : workers)
+            th.join();
+        return logClust.snapshot();
     }
 
-    void parallel_parse(vector<string> content, int start, int end, int lastLine=0, int ID=0){
+    void parallel_parse(const vector<string>& content, int start, int end, int lastLine=0, int ID=0){
         printf("ID: %d start: %d end: %d.\n", ID, start, end);
 
         this->id = ID;
         for (int i = start+1; i <= end; i++) {
 //            printf("ID: %d line: %d.\n", ID, i);
-            int logID = i+lastLine;
-            vector<string> tokMsg = split(content.at(i-1), "[\\s=:,]");
-            vector<string> constLogMsg;
-            copy_if (tokMsg.begin(), tokMsg.end(),
-                     back_inserter(constLogMsg),
-                     [](string s){return s != "<*>";});
-            vector<string> templateMatch = prefixTreeMatch(trieRoot, constLogMsg, 0);
-            if (templateMatch.empty()){
-                clustLock.lock_shared();
-                optional<TemplateCluster *> matchCluster = simpleLoopMatch(logClust, constLogMsg);
-                clustLock.unlock_shared();
+            feed(content.at(i-1), i+lastLine);
+        }
+
+    }
+
+    void feed(string_view logMsg, int logID){
+        /*
+         * Parses one line; safe to call from several threads at once.
+         */
+        vector<string> tokMsg = split(logMsg, "[\\s=:,]");
+        vector<string> constLogMsg;
+        constLogMsg.reserve(tokMsg.size());
+        copy_if (tokMsg.begin(), tokMsg.end(),
+                 back_inserter(constLogMsg),
+                 [](const string& s){return s != "<*>";});
+        auto trieMatch = prefixTreeMatch(trieRoot, constLogMsg, 0);
+        const vector<string> *templateMatch = trieMatch.get();
+        if (templateMatch == nullptr){
+            optional<TemplateCluster *> matchCluster = simpleLoopMatch(logClust, constLogMsg);
+            if (!matchCluster.has_value()){
+                matchCluster = LCSMatch(logClust, tokMsg);
                 if (!matchCluster.has_value()){
-                    clustLock.lock_shared();
-                    matchCluster = LCSMatch(logClust, tokMsg);
-                    clustLock.unlock_shared();
-                    lockCheckpoint:
-                    if (!matchCluster.has_value()){
-                        vector<int> ids = {logID};
-                        auto newCluster = TemplateCluster(tokMsg, ids);
-//                        printf("ID: %d ADDING\n", id);
-                        clustLock.lock();
-                        logClust.push_back(newCluster);
-                        addSeqToPrefixTree(trieRoot, newCluster);
-                        clustLock.unlock();
-                    }else{
-                        auto matchClustTemplate = matchCluster.value()->logTemplate;
-                        auto newTemplate = getTemplate(LCS(tokMsg, matchClustTemplate), matchClustTemplate);
-                        if (newTemplate != matchClustTemplate){
-//                            printf("ID: %d UPDATING\n", id);
-                            removeSeqFromPrefixTree(trieRoot, matchCluster.value()->logTemplate);
-                            if (!(*matchCluster.value()).promoteLock()){
-                                (*matchCluster.value()).mutex.unlock_shared();
-                                (*matchCluster.value()).mutex.lock_shared();
-                                goto lockCheckpoint;
-                            }
-                            (*matchCluster.value()).logTemplate = newTemplate;
-                            (*matchCluster.value()).demoteLock();
-                            addSeqToPrefixTree(trieRoot, *matchCluster.value());
-                        }
-                        templateMatch = matchCluster.value()->logTemplate;
-                        (*matchCluster.value()).mutex.unlock_shared();
-                    }
+//                    printf("ID: %d ADDING\n", id);
+                    auto &newCluster = logClust.emplace_back(std::move(tokMsg), vector<int>{logID});
+                    unique_lock<shared_mutex> l(trieLock);
+                    addSeqToPrefixTree(trieRoot, newCluster);
                 }else{
-                    templateMatch = matchCluster.value()->logTemplate;
-                    (*matchCluster.value()).mutex.unlock_shared();
+                    templateMatch = &generalize(*matchCluster.value(), tokMsg);
                 }
+            }else{
+                templateMatch = &matchCluster.value()->logTemplate();
             }
-            if (!templateMatch.empty()){
-                clustLock.lock_shared();
-                for (TemplateCluster& cluster : logClust) {
-                    clusterCheckpoint:
-                    cluster.mutex.lock_shared();
-                    if (templateMatch == cluster.logTemplate) {
-                        if (!cluster.promoteLock()){
-                            cluster.mutex.unlock_shared();
-                            goto clusterCheckpoint;
-                        }
-                        cluster.logIds.push_back(logID);
-                        cluster.writeUnlock();
-                        break;
-                    }
-                    cluster.mutex.unlock_shared();
+        }
+        if (templateMatch != nullptr && !templateMatch->empty()){
+            for (size_t c = 0; c < logClust.size(); c++) {
+                const vector<string> &logTemplate = logClust[c].logTemplate();
+                if (&logTemplate == templateMatch || logTemplate == *templateMatch) {
+                    logClust[c].addId(logID);
+                    break;
                 }
-                clustLock.unlock_shared();
             }
         }
-
     }
 
-    vector<TemplateCluster> parse(const vector<string> content, const int lastLine=0){
-        vector<thread> threads;
-//        int tMax = thread::hardware_concurrency()/2;
-        int tMax = min(((int)thread::hardware_concurrency()), 4);
-//        int tMax = 2;
-
-        int chunk = (int)content.size() / tMax;
-        for (int i = 0; i < tMax; ++i) {
-            int start = chunk * i;
-            threads.emplace_back(&Parser::parallel_parse, this,content, start, chunk * (i+1), lastLine, i);
-        }
-
-        for (auto& th : threads)
-            th.join();
+    void setExecutor(int threads, const string& placement = "none", size_t grain = 64){
+        /*
+         * Worker pool used by parse(): threads workers (0 for one per hardware thread),
+         * pinned with placement "none", "compact" or "spread", taking grain lines at a
+         * time. The pool persists across parse() and parseOrdered() calls and can be
+         * shared via executor.
+         */
+        executor = make_shared<ThreadPool>(threads, placement);
+        this->grain = max<size_t>(grain, 1);
+    }
 
-        return logClust;
+    vector<TemplateCluster> parse(const vector<string>& content, const int lastLine=0){
+        if (!executor)
+            setExecutor(0);
+        executor->run(content.size(), grain, [&](size_t begin, size_t end, int){
+            for (size_t i = begin; i < end; i++)
+                feed(content[i], (int) i + 1 + lastLine);
+        });
+        return logClust.snapshot();
     }
 };
 
@@ -8,6 +8,7 @@
 #include <cassert>
 #include <chrono>
 #include <ctime>
+#include <cstring>
 #include <fstream>
 #include <thread>
 #include <future>
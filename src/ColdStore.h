@@ -0,0 +1,255 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "MemoryUsage.h"
+
+/*
+ * On-disk store for templates evicted from the parser's hot set. The file is
+ * an append-only log of records
+ *     evict:   [int32 0][int32 lastSeen][uint32 hits][uint32 tokens]
+ *              ([uint32 length][bytes]) * tokens [uint32 ids][int32 id] * ids
+ *     promote: [int32 1][int32 entry]
+ * where entries are numbered by the order of their evict records. Only the
+ * posting lists (token -> live entries) and the entry offsets stay in memory;
+ * templates are read back for the few entries that share enough tokens with
+ * the line being matched. A fresh store truncates the file instead of
+ * replaying it, for a parser that does not resume the one that wrote it.
+ */
+class ColdStore {
+public:
+    struct Entry {
+        std::vector<std::string> logTemplate;
+        std::vector<int> logIds;
+        int lastSeen = 0;
+        std::uint32_t hits = 0;
+    };
+
+    explicit ColdStore(std::string path, bool fresh = false)
+            : path(std::move(path)) {
+        if (fresh)
+            std::ofstream(this->path, std::ios::binary | std::ios::trunc);
+        else
+            replay();
+        file.open(this->path, std::ios::in | std::ios::out | std::ios::binary | std::ios::app);
+        if (!file)
+            throw std::runtime_error("Cannot open cold template store: " + this->path);
+    }
+
+    const std::string& getPath() const { return path; }
+
+    // Number of entries that have not been promoted back.
+    std::size_t size() const { return live; }
+
+    // Heap bytes of the in-memory index: entry offsets and token posting lists.
+    std::size_t bytes() const {
+        std::size_t res = MemoryUsage::of(offsets) + MemoryUsage::of(constTokens);
+        for (const auto& posting : postings)
+            res += sizeof(posting) + MemoryUsage::treeNode + MemoryUsage::of(posting.first) +
+                   MemoryUsage::of(posting.second);
+        return res;
+    }
+
+    int put(const Entry& entry) {
+        file.clear();
+        file.seekp(0, std::ios::end);
+        auto offset = (std::uint64_t) file.tellp();
+        write<std::int32_t>(EVICT);
+        write<std::int32_t>(entry.lastSeen);
+        write<std::uint32_t>(entry.hits);
+        write<std::uint32_t>((std::uint32_t) entry.logTemplate.size());
+        for (const std::string& tok : entry.logTemplate) {
+            write<std::uint32_t>((std::uint32_t) tok.size());
+            file.write(tok.data(), (std::streamsize) tok.size());
+        }
+        write<std::uint32_t>((std::uint32_t) entry.logIds.size());
+        file.write(reinterpret_cast<const char*>(entry.logIds.data()),
+                   (std::streamsize) (entry.logIds.size() * sizeof(std::int32_t)));
+        file.flush();
+        if (!file)
+            throw std::runtime_error("Cannot write cold template store: " + path);
+        return index(offset, entry.logTemplate);
+    }
+
+    Entry read(int entry) {
+        file.clear();
+        file.seekg((std::streamoff) offsets.at(entry));
+        Entry res;
+        if (!readEntry(file, res))
+            throw std::runtime_error("Cannot read cold template store: " + path);
+        return res;
+    }
+
+    // Reads an entry and removes it from the store.
+    Entry take(int entry) {
+        Entry res = read(entry);
+        file.clear();
+        file.seekp(0, std::ios::end);
+        write<std::int32_t>(PROMOTE);
+        write<std::int32_t>(entry);
+        file.flush();
+        if (!file)
+            throw std::runtime_error("Cannot write cold template store: " + path);
+        unindex(entry, res.logTemplate);
+        return res;
+    }
+
+    /*
+     * Live entries worth matching against a line whose distinct tokens are
+     * msgSet (sorted): those sharing at least minShared tokens, the LCSMatch
+     * prefilter, and those whose constant tokens all appear in the line, the
+     * simpleLoopMatch condition.
+     */
+    template <class Tokens>
+    void candidates(const Tokens& msgSet, double minShared, std::vector<int>& out) const {
+        out.clear();
+        std::vector<int> hits;
+        std::vector<int> constHits;
+        for (auto tok : msgSet) {
+            auto it = postings.find(tok);
+            if (it == postings.end())
+                continue;
+            hits.insert(hits.end(), it->second.begin(), it->second.end());
+            if (tok != "<*>")
+                constHits.insert(constHits.end(), it->second.begin(), it->second.end());
+        }
+        std::sort(hits.begin(), hits.end());
+        std::sort(constHits.begin(), constHits.end());
+        for (std::size_t i = 0; i < hits.size();) {
+            std::size_t j = i;
+            while (j < hits.size() && hits[j] == hits[i])
+                j++;
+            int entry = hits[i];
+            auto c = std::equal_range(constHits.begin(), constHits.end(), entry);
+            if (j - i >= minShared || (std::size_t) (c.second - c.first) == constTokens[entry])
+                out.push_back(entry);
+            i = j;
+        }
+    }
+
+private:
+    enum Kind : std::int32_t { EVICT = 0, PROMOTE = 1 };
+
+    std::string path;
+    std::fstream file;
+    std::vector<std::uint64_t> offsets;
+    std::vector<std::size_t> constTokens;
+    std::map<std::string, std::vector<int>, std::less<>> postings;
+    std::size_t live = 0;
+
+    template <class T>
+    void write(T value) {
+        file.write(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    template <class T>
+    static bool read(std::istream& in, T& value) {
+        return (bool) in.read(reinterpret_cast<char*>(&value), sizeof(value));
+    }
+
+    static std::vector<std::string> distinct(const std::vector<std::string>& logTemplate) {
+        std::vector<std::string> res(logTemplate);
+        std::sort(res.begin(), res.end());
+        res.erase(std::unique(res.begin(), res.end()), res.end());
+        return res;
+    }
+
+    int index(std::uint64_t offset, const std::vector<std::string>& logTemplate) {
+        int entry = (int) offsets.size();
+        offsets.push_back(offset);
+        constTokens.push_back(0);
+        for (const std::string& tok : distinct(logTemplate)) {
+            postings[tok].push_back(entry);
+            if (tok != "<*>")
+                constTokens[entry]++;
+        }
+        live++;
+        return entry;
+    }
+
+    void unindex(int entry, const std::vector<std::string>& logTemplate) {
+        for (const std::string& tok : distinct(logTemplate)) {
+            auto it = postings.find(tok);
+            if (it == postings.end())
+                continue;
+            auto &list = it->second;
+            list.erase(std::remove(list.begin(), list.end(), entry), list.end());
+            if (list.empty())
+                postings.erase(it);
+        }
+        live--;
+    }
+
+    // Reads an evict record from its kind field on.
+    static bool readEntry(std::istream& in, Entry& res) {
+        std::int32_t kind;
+        std::uint32_t n;
+        if (!read(in, kind) || kind != EVICT || !read(in, res.lastSeen) || !read(in, res.hits) || !read(in, n))
+            return false;
+        res.logTemplate.resize(n);
+        for (std::string& tok : res.logTemplate) {
+            std::uint32_t len;
+            if (!read(in, len))
+                return false;
+            tok.resize(len);
+            if (!in.read(tok.data(), len))
+                return false;
+        }
+        if (!read(in, n))
+            return false;
+        res.logIds.resize(n);
+        return (bool) in.read(reinterpret_cast<char*>(res.logIds.data()), (std::streamsize) (n * sizeof(std::int32_t)));
+    }
+
+    void replay() {
+        std::ifstream in(path, std::ios::binary | std::ios::ate);
+        if (!in)
+            return;
+        auto end = (std::uint64_t) in.tellg();
+        in.seekg(0);
+        std::uint64_t pos = 0;
+        std::vector<bool> promoted;
+        std::vector<std::vector<std::string>> templates;
+        while (pos < end) {
+            std::int32_t kind;
+            if (!read(in, kind))
+                break;
+            in.seekg((std::streamoff) pos);
+            if (kind == EVICT) {
+                Entry entry;
+                if (!readEntry(in, entry))
+                    break;
+                offsets.push_back(pos);
+                templates.push_back(std::move(entry.logTemplate));
+                promoted.push_back(false);
+            } else if (kind == PROMOTE) {
+                std::int32_t entry;
+                if (!read(in, kind) || !read(in, entry) || entry < 0 || entry >= (int) promoted.size())
+                    break;
+                promoted[entry] = true;
+            } else
+                break;
+            pos = (std::uint64_t) in.tellg();
+        }
+        in.close();
+        // Drop a torn trailing record left by an interrupted write.
+        if (pos < end)
+            std::filesystem::resize_file(path, pos);
+
+        std::vector<std::uint64_t> all;
+        all.swap(offsets);
+        for (int entry = 0; entry < (int) all.size(); entry++) {
+            index(all[entry], templates[entry]);
+            if (promoted[entry]) {
+                unindex(entry, templates[entry]);
+            }
+        }
+    }
+};
@@ -0,0 +1,368 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#if __has_include(<sys/mman.h>)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define CSPELL_COLUMNS_MMAP 1
+#endif
+
+/*
+ * Columnar binary layout for parse results, the native counterpart of
+ * _structured.csv / _templates.csv. A file is a sequence of segments, each
+ * appended in one write and readable on its own:
+ *     [uint32 magic][uint32 version][uint64 segment bytes]
+ *     lineIds      int32  * rows
+ *     clusterIds   int32  * rows
+ *     paramRows    uint64 * rows        end of each row's parameters in paramEnds
+ *     paramEnds    uint64 * parameters  end of each parameter in params
+ *     params       bytes                parameters back to back
+ *     templateIds  int32  * templates
+ *     templateEnds uint64 * templates
+ *     templateText bytes                space-joined templates
+ *     footer       Footer               section offsets, line ID range, previous footer
+ * Sections start 8-byte aligned and use the native byte order, so a mapped
+ * file is read in place. The file always ends with the footer of its last
+ * segment, which makes the last line ID an O(1) lookup. Each segment carries
+ * the templates as of its writing; the latest segment has the current ones.
+ * Version 1 joined a row's parameters with '\n', which lost empty ones at
+ * the end; its files are rejected rather than misread.
+ */
+namespace columnar {
+
+constexpr std::uint32_t segmentMagic = 0x47505343; // "CSPG"
+constexpr std::uint32_t footerMagic = 0x46505343;  // "CSPF"
+constexpr std::uint32_t version = 2;
+constexpr std::uint64_t none = UINT64_MAX;
+
+struct Footer {
+    std::uint32_t magic;
+    std::uint32_t version;
+    std::uint64_t rows;
+    std::uint64_t templates;
+    std::uint64_t parameters;
+    std::int32_t firstLineId;
+    std::int32_t lastLineId;
+    // Absolute file offsets of the sections.
+    std::uint64_t lineIds;
+    std::uint64_t clusterIds;
+    std::uint64_t paramRows;
+    std::uint64_t paramEnds;
+    std::uint64_t params;
+    std::uint64_t templateIds;
+    std::uint64_t templateEnds;
+    std::uint64_t templateText;
+    std::uint64_t start;
+    std::uint64_t previous;
+};
+
+constexpr std::size_t headerSize = 16;
+
+inline std::size_t aligned(std::size_t n) {
+    return (n + 7) & ~(std::size_t) 7;
+}
+
+} // namespace columnar
+
+class ColumnarWriter {
+public:
+    explicit ColumnarWriter(std::string path)
+            : path(std::move(path)) {
+        recover();
+    }
+
+    const std::string& getPath() const { return path; }
+
+    // Last line ID written so far, 0 for an empty file.
+    int lastLineId() const { return lastLine; }
+
+    void addRow(int lineId, int clusterId, const std::vector<std::string_view>& params) {
+        lineIds.push_back(lineId);
+        clusterIds.push_back(clusterId);
+        // Each parameter has its own end, so empty ones survive wherever they are.
+        for (std::string_view param : params) {
+            paramText.insert(paramText.end(), param.begin(), param.end());
+            paramEnds.push_back(paramText.size());
+        }
+        paramRows.push_back(paramEnds.size());
+    }
+
+    void addTemplate(int clusterId, const std::vector<std::string>& logTemplate) {
+        templateIds.push_back(clusterId);
+        for (std::size_t t = 0; t < logTemplate.size(); t++) {
+            if (t > 0)
+                templateText.push_back(' ');
+            templateText.insert(templateText.end(), logTemplate[t].begin(), logTemplate[t].end());
+        }
+        templateEnds.push_back(templateText.size());
+    }
+
+    // Appends the buffered rows and templates as one segment.
+    void flush() {
+        if (lineIds.empty() && templateIds.empty())
+            return;
+        using namespace columnar;
+        std::vector<char> seg(headerSize);
+        Footer f{};
+        f.magic = footerMagic;
+        f.version = version;
+        f.rows = lineIds.size();
+        f.templates = templateIds.size();
+        f.parameters = paramEnds.size();
+        f.firstLineId = lineIds.empty() ? lastLine : lineIds.front();
+        f.lastLineId = lineIds.empty() ? lastLine : lineIds.back();
+        f.start = end;
+        f.previous = lastFooter;
+        f.lineIds = section(seg, lineIds.data(), lineIds.size() * sizeof(std::int32_t));
+        f.clusterIds = section(seg, clusterIds.data(), clusterIds.size() * sizeof(std::int32_t));
+        f.paramRows = section(seg, paramRows.data(), paramRows.size() * sizeof(std::uint64_t));
+        f.paramEnds = section(seg, paramEnds.data(), paramEnds.size() * sizeof(std::uint64_t));
+        f.params = section(seg, paramText.data(), paramText.size());
+        f.templateIds = section(seg, templateIds.data(), templateIds.size() * sizeof(std::int32_t));
+        f.templateEnds = section(seg, templateEnds.data(), templateEnds.size() * sizeof(std::uint64_t));
+        f.templateText = section(seg, templateText.data(), templateText.size());
+        std::uint64_t footerAt = end + seg.size();
+        seg.resize(seg.size() + sizeof(Footer));
+        std::memcpy(seg.data() + seg.size() - sizeof(Footer), &f, sizeof(Footer));
+        std::uint32_t header[2] = {segmentMagic, version};
+        std::uint64_t bytes = seg.size();
+        std::memcpy(seg.data(), header, sizeof(header));
+        std::memcpy(seg.data() + sizeof(header), &bytes, sizeof(bytes));
+
+        std::ofstream out(path, std::ios::binary | std::ios::app);
+        out.write(seg.data(), (std::streamsize) seg.size());
+        out.close();
+        if (!out)
+            throw std::runtime_error("Cannot write columnar output: " + path);
+        end += seg.size();
+        lastFooter = footerAt;
+        lastLine = f.lastLineId;
+        lineIds.clear();
+        clusterIds.clear();
+        paramRows.clear();
+        paramEnds.clear();
+        paramText.clear();
+        templateIds.clear();
+        templateEnds.clear();
+        templateText.clear();
+    }
+
+private:
+    std::string path;
+    std::uint64_t end = 0;
+    std::uint64_t lastFooter = columnar::none;
+    int lastLine = 0;
+    std::vector<std::int32_t> lineIds;
+    std::vector<std::int32_t> clusterIds;
+    std::vector<std::uint64_t> paramRows;
+    std::vector<std::uint64_t> paramEnds;
+    std::vector<char> paramText;
+    std::vector<std::int32_t> templateIds;
+    std::vector<std::uint64_t> templateEnds;
+    std::vector<char> templateText;
+
+    // Appends a section to seg, returns its offset in the file.
+    std::uint64_t section(std::vector<char>& seg, const void* data, std::size_t bytes) const {
+        std::size_t at = seg.size();
+        seg.resize(columnar::aligned(at + bytes));
+        if (bytes > 0)
+            std::memcpy(seg.data() + at, data, bytes);
+        return end + at;
+    }
+
+    void recover() {
+        /*
+         * Walks the segments from the start and drops a torn trailing one left
+         * by an interrupted append; the last complete footer gives the state.
+         * A segment of another format version is not appended to.
+         */
+        using namespace columnar;
+        std::ifstream in(path, std::ios::binary | std::ios::ate);
+        if (!in)
+            return;
+        auto size = (std::uint64_t) in.tellg();
+        std::uint64_t pos = 0;
+        while (pos + headerSize + sizeof(Footer) <= size) {
+            std::uint32_t header[2];
+            std::uint64_t bytes;
+            Footer f;
+            in.seekg((std::streamoff) pos);
+            if (!in.read(reinterpret_cast<char*>(header), sizeof(header)) ||
+                !in.read(reinterpret_cast<char*>(&bytes), sizeof(bytes)))
+                break;
+            if (header[0] == segmentMagic && header[1] != version)
+                throw std::runtime_error("Columnar output of another format version: " + path);
+            if (header[0] != segmentMagic || bytes < headerSize + sizeof(Footer) || pos + bytes > size)
+                break;
+            in.seekg((std::streamoff) (pos + bytes - sizeof(Footer)));
+            if (!in.read(reinterpret_cast<char*>(&f), sizeof(f)) || f.magic != footerMagic || f.start != pos)
+                break;
+            lastFooter = pos + bytes - sizeof(Footer);
+            lastLine = f.lastLineId;
+            pos += bytes;
+        }
+        in.close();
+        end = pos;
+        if (pos < size)
+            std::filesystem::resize_file(path, pos);
+    }
+};
+
+/*
+ * Read-only view of a columnar file, mapped into memory where mmap exists.
+ * Columns are returned as pointers into the mapping, valid while the reader
+ * lives; only the pages of the columns actually touched are read.
+ */
+class ColumnarReader {
+public:
+    struct Segment {
+        std::size_t rows;
+        std::size_t templates;
+        int firstLineId;
+        int lastLineId;
+        const std::int32_t* lineIds;
+        const std::int32_t* clusterIds;
+        const std::uint64_t* paramRows;
+        const std::uint64_t* paramEnds;
+        const char* params;
+        const std::int32_t* templateIds;
+        const std::uint64_t* templateEnds;
+        const char* templateText;
+    };
+
+    explicit ColumnarReader(const std::string& path) {
+        map(path);
+        using namespace columnar;
+        if (size == 0)
+            return;
+        if (size < sizeof(Footer))
+            throw std::runtime_error("Not a columnar file: " + path);
+        // Footers differ in size between versions, the leading header tells them apart.
+        std::uint32_t header[2];
+        std::memcpy(header, base, sizeof(header));
+        if (header[0] == segmentMagic && header[1] != version)
+            throw std::runtime_error("Unsupported columnar file version: " + path);
+        std::uint64_t at = size - sizeof(Footer);
+        while (at != none) {
+            Footer f;
+            if (at + sizeof(Footer) > size)
+                throw std::runtime_error("Corrupt columnar file: " + path);
+            std::memcpy(&f, base + at, sizeof(f));
+            if (f.magic != footerMagic || f.version != version)
+                throw std::runtime_error("Corrupt columnar file: " + path);
+            segments.push_back(Segment{
+                    (std::size_t) f.rows, (std::size_t) f.templates, f.firstLineId, f.lastLineId,
+                    reinterpret_cast<const std::int32_t*>(base + f.lineIds),
+                    reinterpret_cast<const std::int32_t*>(base + f.clusterIds),
+                    reinterpret_cast<const std::uint64_t*>(base + f.paramRows),
+                    reinterpret_cast<const std::uint64_t*>(base + f.paramEnds),
+                    base + f.params,
+                    reinterpret_cast<const std::int32_t*>(base + f.templateIds),
+                    reinterpret_cast<const std::uint64_t*>(base + f.templateEnds),
+                    base + f.templateText});
+            at = f.previous;
+        }
+        std::reverse(segments.begin(), segments.end());
+    }
+
+    ColumnarReader(const ColumnarReader&) = delete;
+    ColumnarReader& operator=(const ColumnarReader&) = delete;
+
+    ~ColumnarReader() {
+#ifdef CSPELL_COLUMNS_MMAP
+        if (mapped != nullptr)
+            munmap(mapped, size);
+#endif
+    }
+
+    // Reads only the trailing footer.
+    static int lastLineId(const std::string& path) {
+        using namespace columnar;
+        std::ifstream in(path, std::ios::binary | std::ios::ate);
+        if (!in || (std::uint64_t) in.tellg() < sizeof(Footer))
+            return 0;
+        Footer f;
+        in.seekg(-(std::streamoff) sizeof(Footer), std::ios::end);
+        if (!in.read(reinterpret_cast<char*>(&f), sizeof(f)) || f.magic != footerMagic)
+            throw std::runtime_error("Corrupt columnar file: " + path);
+        return f.lastLineId;
+    }
+
+    const std::vector<Segment>& getSegments() const { return segments; }
+
+    int lastLineId() const { return segments.empty() ? 0 : segments.back().lastLineId; }
+
+    std::size_t rows() const {
+        std::size_t n = 0;
+        for (const Segment& s : segments)
+            n += s.rows;
+        return n;
+    }
+
+    static std::vector<std::string_view> params(const Segment& s, std::size_t row) {
+        std::vector<std::string_view> res;
+        std::size_t first = row == 0 ? 0 : s.paramRows[row - 1];
+        for (std::size_t p = first; p < s.paramRows[row]; p++) {
+            std::size_t begin = p == 0 ? 0 : s.paramEnds[p - 1];
+            res.emplace_back(s.params + begin, s.paramEnds[p] - begin);
+        }
+        return res;
+    }
+
+    static std::string_view templateText(const Segment& s, std::size_t t) {
+        std::size_t begin = t == 0 ? 0 : s.templateEnds[t - 1];
+        return std::string_view(s.templateText + begin, s.templateEnds[t] - begin);
+    }
+
+private:
+    const char* base = nullptr;
+    std::size_t size = 0;
+    void* mapped = nullptr;
+    std::vector<char> copy;
+    std::vector<Segment> segments;
+
+    void map(const std::string& path) {
+#ifdef CSPELL_COLUMNS_MMAP
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error("Cannot open columnar file: " + path);
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            ::close(fd);
+            throw std::runtime_error("Cannot open columnar file: " + path);
+        }
+        size = (std::size_t) st.st_size;
+        if (size > 0) {
+            mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped == MAP_FAILED) {
+                mapped = nullptr;
+                ::close(fd);
+                throw std::runtime_error("Cannot map columnar file: " + path);
+            }
+            base = static_cast<const char*>(mapped);
+        }
+        ::close(fd);
+#else
+        std::ifstream in(path, std::ios::binary | std::ios::ate);
+        if (!in)
+            throw std::runtime_error("Cannot open columnar file: " + path);
+        size = (std::size_t) in.tellg();
+        copy.resize(size);
+        in.seekg(0);
+        in.read(copy.data(), (std::streamsize) size);
+        base = copy.data();
+#endif
+    }
+};
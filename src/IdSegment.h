@@ -0,0 +1,198 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "MemoryUsage.h"
+
+/*
+ * Append-only on-disk segment holding the line IDs spilled out of
+ * TemplateCluster::logIds. The file is a sequence of blocks
+ *     [int32 cluster][uint32 count][int32 id] * count
+ * and is never rewritten: spilling appends a block, and the per-cluster
+ * block index is rebuilt by skipping through the headers when reopened.
+ * Renumbering clusters appends a block with cluster remapMarker whose
+ * entries are the new number of every old cluster (-1 for dropped ones);
+ * it applies to all the blocks before it. Remaps are composed in memory
+ * and written as one block before the next append or read, or by flush(),
+ * so a parser renumbering often adds one block per retention step rather
+ * than one per merge. A fresh segment truncates the file instead of
+ * rebuilding the index, for a parser that does not resume the one that
+ * wrote it.
+ */
+class IdSegment {
+public:
+    struct Block {
+        std::uint64_t offset;
+        std::uint32_t count;
+    };
+
+    static constexpr std::int32_t remapMarker = -1;
+
+    explicit IdSegment(std::string path, bool fresh = false)
+            : path(std::move(path)) {
+        if (fresh)
+            std::ofstream(this->path, std::ios::binary | std::ios::trunc);
+        else
+            rebuildIndex();
+        file.open(this->path, std::ios::in | std::ios::out | std::ios::binary | std::ios::app);
+        if (!file)
+            throw std::runtime_error("Cannot open line ID segment: " + this->path);
+    }
+
+    ~IdSegment() {
+        try {
+            flush();
+        } catch (const std::exception&) {
+            // The remap is lost with the file, as with an append interrupted by a crash.
+        }
+    }
+
+    const std::string& getPath() const { return path; }
+
+    void append(int cluster, const int* ids, std::size_t n) {
+        if (n == 0)
+            return;
+        flush();
+        std::uint64_t offset = write(cluster, ids, n);
+        indexOf(cluster).push_back({offset, (std::uint32_t) n});
+    }
+
+    void remap(const std::vector<int>& to) {
+        // Old cluster c of the segment is at pending[c] before to applies, at c past its end.
+        std::vector<int> composed(std::max(pending.size(), to.size()));
+        for (std::size_t c = 0; c < composed.size(); c++) {
+            int mid = c < pending.size() ? pending[c] : (int) c;
+            composed[c] = mid < 0 || mid >= (int) to.size() ? mid : to[mid];
+        }
+        pending = std::move(composed);
+    }
+
+    // Writes the remaps made since the last append, read or flush as one block.
+    void flush() {
+        if (pending.empty())
+            return;
+        static_assert(sizeof(int) == sizeof(std::int32_t), "remap entries are written as int32");
+        std::vector<int> to;
+        to.swap(pending);
+        write(remapMarker, to.data(), to.size());
+        applyRemap(to.data(), to.size());
+    }
+
+    std::size_t count(int cluster) {
+        flush();
+        std::size_t res = 0;
+        if (cluster < (int) index.size())
+            for (const Block& b : index[cluster])
+                res += b.count;
+        return res;
+    }
+
+    // Heap bytes of the in-memory block index and pending remap, the IDs themselves are on disk.
+    std::size_t bytes() const {
+        std::size_t res = MemoryUsage::of(index) + MemoryUsage::of(pending);
+        for (const auto& blocks : index)
+            res += MemoryUsage::of(blocks);
+        return res;
+    }
+
+    // Spilled IDs of a cluster in the order they were appended.
+    std::vector<int> read(int cluster) {
+        std::vector<int> res;
+        flush();
+        if (cluster >= (int) index.size())
+            return res;
+        res.reserve(count(cluster));
+        file.clear();
+        for (const Block& b : index[cluster]) {
+            std::size_t old = res.size();
+            res.resize(old + b.count);
+            file.seekg((std::streamoff) b.offset);
+            file.read(reinterpret_cast<char*>(res.data() + old), (std::streamsize) (b.count * sizeof(std::int32_t)));
+        }
+        if (!file)
+            throw std::runtime_error("Cannot read line ID segment: " + path);
+        return res;
+    }
+
+private:
+    std::string path;
+    std::fstream file;
+    std::vector<std::vector<Block>> index;
+    // Remap not written yet, from the numbering of the last remap block on.
+    std::vector<int> pending;
+
+    // Appends a block, returns the offset of its entries.
+    std::uint64_t write(int cluster, const int* ids, std::size_t n) {
+        file.clear();
+        file.seekp(0, std::ios::end);
+        std::uint64_t offset = (std::uint64_t) file.tellp() + sizeof(std::int32_t) + sizeof(std::uint32_t);
+        auto clusterNo = (std::int32_t) cluster;
+        auto count = (std::uint32_t) n;
+        file.write(reinterpret_cast<const char*>(&clusterNo), sizeof(clusterNo));
+        file.write(reinterpret_cast<const char*>(&count), sizeof(count));
+        file.write(reinterpret_cast<const char*>(ids), (std::streamsize) (n * sizeof(std::int32_t)));
+        file.flush();
+        if (!file)
+            throw std::runtime_error("Cannot write line ID segment: " + path);
+        return offset;
+    }
+
+    std::vector<Block>& indexOf(int cluster) {
+        if (cluster >= (int) index.size())
+            index.resize(cluster + 1);
+        return index[cluster];
+    }
+
+    void applyRemap(const int* to, std::size_t n) {
+        std::vector<std::vector<Block>> remapped;
+        for (std::size_t c = 0; c < index.size(); c++) {
+            int target = c < n ? to[c] : (int) c;
+            // Clusters mapped to -1 left the parser, their blocks are dropped.
+            if (target < 0)
+                continue;
+            if (target >= (int) remapped.size())
+                remapped.resize(target + 1);
+            auto &blocks = remapped[target];
+            blocks.insert(blocks.end(), index[c].begin(), index[c].end());
+        }
+        // Keep each cluster's blocks in file order, as read() promises.
+        for (auto &blocks : remapped)
+            std::sort(blocks.begin(), blocks.end(),
+                      [](const Block& a, const Block& b) { return a.offset < b.offset; });
+        index = std::move(remapped);
+    }
+
+    void rebuildIndex() {
+        std::ifstream in(path, std::ios::binary | std::ios::ate);
+        if (!in)
+            return;
+        auto end = (std::uint64_t) in.tellg();
+        std::uint64_t pos = 0;
+        const std::uint64_t header = sizeof(std::int32_t) + sizeof(std::uint32_t);
+        while (pos + header <= end) {
+            std::int32_t cluster;
+            std::uint32_t count;
+            in.seekg((std::streamoff) pos);
+            in.read(reinterpret_cast<char*>(&cluster), sizeof(cluster));
+            in.read(reinterpret_cast<char*>(&count), sizeof(count));
+            if (!in || pos + header + (std::uint64_t) count * sizeof(std::int32_t) > end)
+                break;
+            if (cluster == remapMarker) {
+                std::vector<int> to(count);
+                in.read(reinterpret_cast<char*>(to.data()), (std::streamsize) (count * sizeof(std::int32_t)));
+                applyRemap(to.data(), to.size());
+            } else
+                indexOf(cluster).push_back({pos + header, count});
+            pos += header + (std::uint64_t) count * sizeof(std::int32_t);
+        }
+        in.close();
+        // Drop a torn trailing block left by an interrupted append.
+        if (pos < end)
+            std::filesystem::resize_file(path, pos);
+    }
+};
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include "MemoryUsage.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define CSPELL_LCS_AVX2 1
+#include <immintrin.h>
+#endif
+
+/*
+ * Dense integer IDs for tokens, so LCS compares ints instead of strings.
+ * Views handed to the map point into strings kept in a deque, whose
+ * elements never move.
+ */
+class TokenIds {
+public:
+    static constexpr int unknown = -1;
+
+    TokenIds() : generation(nextGeneration++) {}
+    TokenIds(const TokenIds&) = delete;
+    TokenIds& operator=(const TokenIds&) = delete;
+    TokenIds(TokenIds&&) = default;
+    TokenIds& operator=(TokenIds&&) = default;
+
+    int intern(std::string_view tok) {
+        auto it = ids.find(tok);
+        if (it != ids.end())
+            return it->second;
+        int id = (int) store.size();
+        ids.emplace(store.emplace_back(tok), id);
+        return id;
+    }
+
+    // unknown for a token no template contains, it matches nothing.
+    int find(std::string_view tok) const {
+        auto it = ids.find(tok);
+        return it == ids.end() ? unknown : it->second;
+    }
+
+    // Differs between dictionaries, so IDs cached against one are not used with another.
+    std::uint64_t getGeneration() const { return generation; }
+
+    std::size_t bytes() const {
+        std::size_t res = store.size() * sizeof(std::string) + ids.bucket_count() * sizeof(void*) +
+                          ids.size() * (sizeof(std::pair<const std::string_view, int>) + MemoryUsage::hashNode);
+        for (const std::string& tok : store)
+            res += MemoryUsage::of(tok);
+        return res;
+    }
+
+private:
+    static inline std::atomic<std::uint64_t> nextGeneration{1};
+    std::uint64_t generation;
+    std::deque<std::string> store;
+    std::unordered_map<std::string_view, int> ids;
+};
+
+/*
+ * LCS lengths of one message against a block of up to `lanes` templates at
+ * once (inter-sequence vectorization). Templates are laid out column-major:
+ * token j of lane l is tokens[j * lanes + l], lanes shorter than the block
+ * are filled with `padding`, which matches nothing and therefore leaves the
+ * length of that lane unchanged. Each lane runs the exact recurrence of
+ * Parser::LCS, only the length is returned.
+ */
+class LcsBatch {
+public:
+    static constexpr int lanes = 8;
+    static constexpr int padding = -2;
+
+    // rows is a workspace of workspaceSize(columns) ints, scores receives `lanes` lengths.
+    static void score(const int* msg, std::size_t n, const int* tokens, std::size_t columns,
+                      int* rows, int* scores) {
+        static const auto kernel = hasAvx2() ? scoreAvx2 : scoreScalar;
+        kernel(msg, n, tokens, columns, rows, scores);
+    }
+
+    static std::size_t workspaceSize(std::size_t columns) {
+        return 2 * (columns + 1) * lanes;
+    }
+
+    static bool hasAvx2() {
+#ifdef CSPELL_LCS_AVX2
+        return __builtin_cpu_supports("avx2");
+#else
+        return false;
+#endif
+    }
+
+    static void scoreScalar(const int* msg, std::size_t n, const int* tokens, std::size_t columns,
+                            int* rows, int* scores) {
+        int* prev = rows;
+        int* cur = rows + (columns + 1) * lanes;
+        std::fill(prev, prev + (columns + 1) * lanes, 0);
+        std::fill(cur, cur + lanes, 0);
+        for (std::size_t i = 0; i < n; i++) {
+            for (std::size_t j = 0; j < columns; j++) {
+                const int* tok = tokens + j * lanes;
+                for (int l = 0; l < lanes; l++) {
+                    int diag = prev[j * lanes + l];
+                    int up = prev[(j + 1) * lanes + l];
+                    int left = cur[j * lanes + l];
+                    cur[(j + 1) * lanes + l] = tok[l] == msg[i] ? diag + 1 : std::max(up, left);
+                }
+            }
+            std::swap(prev, cur);
+        }
+        std::copy(prev + columns * lanes, prev + (columns + 1) * lanes, scores);
+    }
+
+#ifdef CSPELL_LCS_AVX2
+    __attribute__((target("avx2")))
+    static void scoreAvx2(const int* msg, std::size_t n, const int* tokens, std::size_t columns,
+                          int* rows, int* scores) {
+        static_assert(lanes == 8, "one 256-bit register of 32-bit lanes");
+        auto prev = reinterpret_cast<__m256i*>(rows);
+        auto cur = prev + columns + 1;
+        const __m256i one = _mm256_set1_epi32(1);
+        for (std::size_t j = 0; j <= columns; j++)
+            _mm256_storeu_si256(prev + j, _mm256_setzero_si256());
+        _mm256_storeu_si256(cur, _mm256_setzero_si256());
+        for (std::size_t i = 0; i < n; i++) {
+            const __m256i m = _mm256_set1_epi32(msg[i]);
+            __m256i diag = _mm256_loadu_si256(prev);
+            __m256i left = _mm256_setzero_si256();
+            for (std::size_t j = 0; j < columns; j++) {
+                __m256i tok = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(tokens + j * lanes));
+                __m256i up = _mm256_loadu_si256(prev + j + 1);
+                __m256i eq = _mm256_cmpeq_epi32(tok, m);
+                __m256i val = _mm256_blendv_epi8(_mm256_max_epi32(up, left), _mm256_add_epi32(diag, one), eq);
+                _mm256_storeu_si256(cur + j + 1, val);
+                diag = up;
+                left = val;
+            }
+            std::swap(prev, cur);
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(scores), _mm256_loadu_si256(prev + columns));
+    }
+#else
+    static void scoreAvx2(const int* msg, std::size_t n, const int* tokens, std::size_t columns,
+                          int* rows, int* scores) {
+        scoreScalar(msg, n, tokens, columns, rows, scores);
+    }
+#endif
+};
@@ -0,0 +1,301 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#ifdef CSPELL_WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef CSPELL_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+/*
+ * Line-by-line reader for plain, gzip and zstd log files, told apart by their
+ * magic bytes. Reading and decompression run on a dedicated thread which fills
+ * a ring of blocks, each cut after its last newline so that every block holds
+ * whole lines; the consumer splits blocks into lines without copying. A line
+ * longer than a block grows that block.
+ *
+ * Codecs are compiled in with CSPELL_WITH_ZLIB / CSPELL_WITH_ZSTD (set by the
+ * build when the libraries are found); opening a file of a missing codec throws.
+ */
+class LineReader {
+public:
+    enum class Codec { plain, gzip, zstd };
+
+    explicit LineReader(const std::string& path, std::size_t blockSize = 1 << 20, std::size_t blocks = 4)
+            : ring(std::max<std::size_t>(blocks, 2)) {
+        for (Block& b : ring)
+            b.data.resize(std::max<std::size_t>(blockSize, 1));
+        source = open(path);
+        producer = std::thread(&LineReader::produce, this);
+    }
+
+    LineReader(const LineReader&) = delete;
+    LineReader& operator=(const LineReader&) = delete;
+
+    ~LineReader() {
+        {
+            std::lock_guard<std::mutex> l(lock);
+            stopping = true;
+        }
+        changed.notify_all();
+        producer.join();
+    }
+
+    static Codec detect(const unsigned char* magic, std::size_t n) {
+        if (n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+            return Codec::gzip;
+        if (n >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd)
+            return Codec::zstd;
+        return Codec::plain;
+    }
+
+    Codec getCodec() const { return codec; }
+
+    // Next line without its '\n', valid until the following call; false at end of input.
+    bool next(std::string_view& line) {
+        while (current == nullptr || pos >= current->used) {
+            if (!advance())
+                return false;
+        }
+        const char* begin = current->data.data() + pos;
+        const char* nl = static_cast<const char*>(std::memchr(begin, '\n', current->used - pos));
+        std::size_t len = nl == nullptr ? current->used - pos : (std::size_t) (nl - begin);
+        line = std::string_view(begin, len);
+        pos += len + 1;
+        return true;
+    }
+
+private:
+    class Source {
+    public:
+        virtual ~Source() = default;
+        // Fills at most n bytes, 0 at end of input.
+        virtual std::size_t read(char* out, std::size_t n) = 0;
+    };
+
+    class PlainSource : public Source {
+    public:
+        explicit PlainSource(std::FILE* file) : file(file) {}
+        ~PlainSource() override { std::fclose(file); }
+
+        std::size_t read(char* out, std::size_t n) override {
+            std::size_t got = std::fread(out, 1, n, file);
+            if (got == 0 && std::ferror(file))
+                throw std::runtime_error("Cannot read log file");
+            return got;
+        }
+
+    private:
+        std::FILE* file;
+    };
+
+#ifdef CSPELL_WITH_ZLIB
+    class GzipSource : public Source {
+    public:
+        explicit GzipSource(const std::string& path) : file(gzopen(path.c_str(), "rb")) {
+            if (file == nullptr)
+                throw std::runtime_error("Cannot open log file: " + path);
+            gzbuffer(file, 256 * 1024);
+        }
+        ~GzipSource() override { gzclose(file); }
+
+        std::size_t read(char* out, std::size_t n) override {
+            int got = gzread(file, out, (unsigned) std::min<std::size_t>(n, 1u << 30));
+            int err = Z_OK;
+            const char* message = gzerror(file, &err);
+            // A stream cut short ends with Z_BUF_ERROR rather than a failed read.
+            if (got < 0 || (got == 0 && err != Z_OK))
+                throw std::runtime_error(std::string("Cannot inflate log file: ") + message);
+            return (std::size_t) got;
+        }
+
+    private:
+        gzFile file;
+    };
+#endif
+
+#ifdef CSPELL_WITH_ZSTD
+    class ZstdSource : public Source {
+    public:
+        explicit ZstdSource(std::FILE* file)
+                : file(file), stream(ZSTD_createDStream()), in(ZSTD_DStreamInSize()) {
+            if (stream == nullptr)
+                throw std::runtime_error("Cannot create zstd stream");
+        }
+        ~ZstdSource() override {
+            ZSTD_freeDStream(stream);
+            std::fclose(file);
+        }
+
+        std::size_t read(char* out, std::size_t n) override {
+            ZSTD_outBuffer output{out, n, 0};
+            while (output.pos == 0) {
+                if (input.pos == input.size) {
+                    input.src = in.data();
+                    input.size = std::fread(in.data(), 1, in.size(), file);
+                    input.pos = 0;
+                    if (input.size == 0) {
+                        if (std::ferror(file) || pending != 0)
+                            throw std::runtime_error("Truncated zstd log file");
+                        return 0;
+                    }
+                }
+                pending = ZSTD_decompressStream(stream, &output, &input);
+                if (ZSTD_isError(pending))
+                    throw std::runtime_error(std::string("Cannot decompress log file: ") + ZSTD_getErrorName(pending));
+            }
+            return output.pos;
+        }
+
+    private:
+        std::FILE* file;
+        ZSTD_DStream* stream;
+        std::vector<char> in;
+        ZSTD_inBuffer input{nullptr, 0, 0};
+        // Non-zero while a frame is incomplete.
+        std::size_t pending = 0;
+    };
+#endif
+
+    struct Block {
+        std::vector<char> data;
+        std::size_t used = 0;
+    };
+
+    Codec codec = Codec::plain;
+    std::unique_ptr<Source> source;
+    std::vector<Block> ring;
+    // Blocks [head, head + filled) of the ring are ready for the consumer.
+    std::size_t head = 0;
+    std::size_t filled = 0;
+    bool finished = false;
+    bool stopping = false;
+    std::exception_ptr failure;
+    std::mutex lock;
+    std::condition_variable changed;
+    std::thread producer;
+
+    // Consumer side.
+    Block* current = nullptr;
+    std::size_t pos = 0;
+
+    std::unique_ptr<Source> open(const std::string& file) {
+        std::FILE* f = std::fopen(file.c_str(), "rb");
+        if (f == nullptr)
+            throw std::runtime_error("Cannot open log file: " + file);
+        unsigned char magic[4];
+        std::size_t n = std::fread(magic, 1, sizeof(magic), f);
+        codec = detect(magic, n);
+        if (codec == Codec::gzip) {
+#ifdef CSPELL_WITH_ZLIB
+            std::fclose(f);
+            return std::make_unique<GzipSource>(file);
+#else
+            std::fclose(f);
+            throw std::runtime_error("Built without zlib, cannot read " + file);
+#endif
+        }
+        std::rewind(f);
+        if (codec == Codec::zstd) {
+#ifdef CSPELL_WITH_ZSTD
+            return std::make_unique<ZstdSource>(f);
+#else
+            std::fclose(f);
+            throw std::runtime_error("Built without zstd, cannot read " + file);
+#endif
+        }
+        return std::make_unique<PlainSource>(f);
+    }
+
+    bool advance() {
+        std::unique_lock<std::mutex> l(lock);
+        if (current != nullptr) {
+            // Hand the consumed block back to the producer.
+            current = nullptr;
+            head = (head + 1) % ring.size();
+            filled--;
+            changed.notify_all();
+        }
+        changed.wait(l, [this]{ return filled > 0 || finished; });
+        if (filled == 0) {
+            if (failure)
+                std::rethrow_exception(failure);
+            return false;
+        }
+        current = &ring[head];
+        pos = 0;
+        return true;
+    }
+
+    void produce() {
+        // Partial last line of the previous block, moved to the front of the next one.
+        std::vector<char> carry;
+        std::size_t slot = 0;
+        try {
+            bool eof = false;
+            while (!eof) {
+                {
+                    std::unique_lock<std::mutex> l(lock);
+                    changed.wait(l, [this]{ return stopping || filled < ring.size(); });
+                    if (stopping)
+                        return;
+                }
+                // Only this thread touches blocks outside [head, head + filled).
+                Block& b = ring[slot];
+                if (b.data.size() < carry.size())
+                    b.data.resize(carry.size());
+                std::copy(carry.begin(), carry.end(), b.data.begin());
+                std::size_t size = carry.size();
+                carry.clear();
+                std::size_t cut = 0;
+                while (true) {
+                    if (size == b.data.size()) {
+                        if (cut > 0)
+                            break;
+                        // No line ends in this block yet.
+                        b.data.resize(2 * b.data.size());
+                    }
+                    std::size_t got = source->read(b.data.data() + size, b.data.size() - size);
+                    if (got == 0) {
+                        eof = true;
+                        cut = size;
+                        break;
+                    }
+                    auto first = b.data.begin() + size;
+                    auto nl = std::find(std::make_reverse_iterator(first + got), std::make_reverse_iterator(first), '\n');
+                    if (nl.base() != first)
+                        cut = (std::size_t) (nl.base() - b.data.begin());
+                    size += got;
+                }
+                carry.assign(b.data.begin() + cut, b.data.begin() + size);
+                b.used = cut;
+                if (cut == 0)
+                    continue;
+                std::lock_guard<std::mutex> l(lock);
+                filled++;
+                slot = (slot + 1) % ring.size();
+                changed.notify_all();
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> l(lock);
+            failure = std::current_exception();
+        }
+        std::lock_guard<std::mutex> l(lock);
+        finished = true;
+        changed.notify_all();
+    }
+};
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/*
+ * Header extraction for log formats such as
+ *     <Date> <Time> <Pid> <Level> <Component>: <Content>
+ * Equivalent to the '^(?P<Date>.*?) (?P<Time>.*?) ... (?P<Content>.*?)$'
+ * regex generated by the Python LogParser: every field but the last ends at
+ * the first occurrence of the literal that follows it, the last field takes
+ * the rest of the line.
+ */
+class LogFormat {
+public:
+    std::vector<std::string> headers;
+
+    LogFormat() = default;
+    explicit LogFormat(const std::string& format) {
+        size_t i = 0;
+        std::string literal;
+        while (i < format.size()) {
+            size_t open = format.find('<', i);
+            size_t close = open == std::string::npos ? std::string::npos : format.find('>', open);
+            if (close == std::string::npos) {
+                literal += format.substr(i);
+                break;
+            }
+            literal += format.substr(i, open - i);
+            if (headers.empty())
+                prefix = literal;
+            else
+                separators.push_back(literal);
+            literal.clear();
+            headers.push_back(format.substr(open + 1, close - open - 1));
+            i = close + 1;
+        }
+        if (headers.empty())
+            throw std::invalid_argument("Log format without fields: " + format);
+        suffix = literal;
+    }
+
+    int indexOf(const std::string& header) const {
+        for (int h = 0; h < (int) headers.size(); h++)
+            if (headers[h] == header)
+                return h;
+        return -1;
+    }
+
+    // Fields are views into line; returns false if the line does not fit the format.
+    bool extract(std::string_view line, std::vector<std::string_view>& fields) const {
+        fields.clear();
+        line = strip(line);
+        if (line.compare(0, prefix.size(), prefix) != 0)
+            return false;
+        if (line.size() < prefix.size() + suffix.size() ||
+            line.compare(line.size() - suffix.size(), suffix.size(), suffix) != 0)
+            return false;
+        size_t pos = prefix.size();
+        size_t end = line.size() - suffix.size();
+        for (const std::string& sep : separators) {
+            size_t next = line.find(sep, pos);
+            if (next == std::string_view::npos || next > end)
+                return false;
+            fields.push_back(line.substr(pos, next - pos));
+            pos = next + sep.size();
+        }
+        if (pos > end)
+            return false;
+        fields.push_back(line.substr(pos, end - pos));
+        return true;
+    }
+
+private:
+    std::string prefix;
+    std::vector<std::string> separators;
+    std::string suffix;
+
+    static std::string_view strip(std::string_view s) {
+        const char* ws = " \t\n\r\f\v";
+        size_t b = s.find_first_not_of(ws);
+        if (b == std::string_view::npos)
+            return {};
+        return s.substr(b, s.find_last_not_of(ws) - b + 1);
+    }
+};
@@ -0,0 +1,202 @@
+#pragma once
+
+#include <cctype>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/*
+ * Variable masking applied before template matching. High-cardinality
+ * tokens (IPs, block IDs, hex values, numbers, user patterns) are replaced
+ * by "<*>" while the line is being tokenized, so they never reach the trie
+ * or create spurious clusters.
+ *
+ * Rules are compiled once: builtins become bits checked by hand-written
+ * scanners, custom patterns become globs ('*' any run, '?' any char, '#'
+ * a run of digits) dispatched on their first byte. A line is scanned once,
+ * splitting on the delimiter set and masking each token as it is emitted.
+ */
+class Masker {
+public:
+    static constexpr const char* defaultDelimiters = " \t\n\r\f\v=:,";
+
+    explicit Masker(const std::vector<std::string>& rules,
+                    const std::string& delimiters = defaultDelimiters) {
+        for (bool& d : delim)
+            d = false;
+        for (unsigned char c : delimiters)
+            delim[c] = true;
+        for (const std::string& rule : rules) {
+            if (rule == "ip")
+                builtins |= IP;
+            else if (rule == "hex")
+                builtins |= HEX;
+            else if (rule == "blk")
+                builtins |= BLOCK_ID;
+            else if (rule == "num")
+                builtins |= NUMBER;
+            else if (rule.empty())
+                throw std::invalid_argument("Empty masking rule");
+            else {
+                auto no = (int) custom.size();
+                custom.push_back(rule);
+                unsigned char first = rule[0];
+                if (first == '*' || first == '?')
+                    anyStart.push_back(no);
+                else if (first == '#')
+                    for (unsigned char c = '0'; c <= '9'; c++)
+                        byStart[c].push_back(no);
+                else
+                    byStart[first].push_back(no);
+            }
+        }
+    }
+
+    // Out is any vector of strings or string_views; views point into line or at "<*>".
+    template <class Out>
+    void tokenize(std::string_view line, Out& out) const {
+        const char* s = line.data();
+        size_t n = line.size();
+        size_t i = 0;
+        while (i < n) {
+            while (i < n && delim[(unsigned char) s[i]])
+                i++;
+            size_t start = i;
+            while (i < n && !delim[(unsigned char) s[i]])
+                i++;
+            if (i == start)
+                break;
+            if (matches(s + start, i - start))
+                out.emplace_back("<*>");
+            else
+                out.emplace_back(s + start, i - start);
+        }
+    }
+
+    std::vector<std::string> tokenize(std::string_view line) const {
+        std::vector<std::string> res;
+        tokenize(line, res);
+        return res;
+    }
+
+    bool matches(const char* tok, size_t len) const {
+        if ((builtins & NUMBER) && isNumber(tok, len))
+            return true;
+        if ((builtins & IP) && isIp(tok, len))
+            return true;
+        if ((builtins & BLOCK_ID) && isBlockId(tok, len))
+            return true;
+        if ((builtins & HEX) && isHex(tok, len))
+            return true;
+        for (int no : byStart[(unsigned char) tok[0]])
+            if (glob(custom[no].data(), custom[no].size(), tok, len))
+                return true;
+        for (int no : anyStart)
+            if (glob(custom[no].data(), custom[no].size(), tok, len))
+                return true;
+        return false;
+    }
+
+private:
+    enum Builtin : unsigned { IP = 1, HEX = 2, BLOCK_ID = 4, NUMBER = 8 };
+
+    bool delim[256];
+    unsigned builtins = 0;
+    std::vector<std::string> custom;
+    std::vector<int> byStart[256];
+    std::vector<int> anyStart;
+
+    static bool isDigit(char c) { return c >= '0' && c <= '9'; }
+
+    static size_t digits(const char* s, size_t i, size_t n) {
+        while (i < n && isDigit(s[i]))
+            i++;
+        return i;
+    }
+
+    // [-+]?\d+(\.\d+)?
+    static bool isNumber(const char* s, size_t n) {
+        size_t i = (s[0] == '-' || s[0] == '+') ? 1 : 0;
+        size_t j = digits(s, i, n);
+        if (j == i)
+            return false;
+        if (j < n && s[j] == '.') {
+            size_t k = digits(s, j + 1, n);
+            if (k == j + 1)
+                return false;
+            j = k;
+        }
+        return j == n;
+    }
+
+    // /?\d{1,3}(\.\d{1,3}){3}
+    static bool isIp(const char* s, size_t n) {
+        size_t i = s[0] == '/' ? 1 : 0;
+        for (int part = 0; part < 4; part++) {
+            if (part > 0) {
+                if (i >= n || s[i] != '.')
+                    return false;
+                i++;
+            }
+            size_t j = digits(s, i, n);
+            if (j == i || j - i > 3)
+                return false;
+            i = j;
+        }
+        return i == n;
+    }
+
+    // blk_-?\d+
+    static bool isBlockId(const char* s, size_t n) {
+        if (n < 5 || s[0] != 'b' || s[1] != 'l' || s[2] != 'k' || s[3] != '_')
+            return false;
+        size_t i = s[4] == '-' ? 5 : 4;
+        return i < n && digits(s, i, n) == n;
+    }
+
+    // 0x[0-9a-fA-F]+ or a bare run of 8+ hex digits mixing digits and letters
+    static bool isHex(const char* s, size_t n) {
+        size_t i = 0;
+        bool prefixed = n > 2 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X');
+        if (prefixed)
+            i = 2;
+        else if (n < 8)
+            return false;
+        bool digit = false, letter = false;
+        for (; i < n; i++) {
+            if (isDigit(s[i]))
+                digit = true;
+            else if ((s[i] >= 'a' && s[i] <= 'f') || (s[i] >= 'A' && s[i] <= 'F'))
+                letter = true;
+            else
+                return false;
+        }
+        return prefixed || (digit && letter);
+    }
+
+    static bool glob(const char* p, size_t pn, const char* s, size_t sn) {
+        size_t pi = 0, si = 0;
+        size_t starP = std::string::npos, starS = 0;
+        while (si < sn) {
+            if (pi < pn && p[pi] == '#' && isDigit(s[si])) {
+                // '#' is possessive: it always takes the whole digit run.
+                si = digits(s, si, sn);
+                pi++;
+            } else if (pi < pn && (p[pi] == '?' || (p[pi] == s[si] && p[pi] != '*' && p[pi] != '#'))) {
+                pi++;
+                si++;
+            } else if (pi < pn && p[pi] == '*') {
+                starP = pi++;
+                starS = si;
+            } else if (starP != std::string::npos) {
+                pi = starP + 1;
+                si = ++starS;
+            } else
+                return false;
+        }
+        while (pi < pn && p[pi] == '*')
+            pi++;
+        return pi == pn;
+    }
+};
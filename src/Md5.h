@@ -0,0 +1,100 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+/*
+ * MD5 digest (RFC 1321), for the EventId of a template: the first 8 hex
+ * digits of md5(' '.join(template)), as LogParser.cluster_to_df computes it
+ * with hashlib.
+ */
+class Md5 {
+public:
+    static std::string hex(std::string_view data, std::size_t digits = 32) {
+        static const char* hexDigits = "0123456789abcdef";
+        unsigned char d[16];
+        digest(data, d);
+        std::string res;
+        for (std::size_t i = 0; i < 16; i++) {
+            res += hexDigits[d[i] >> 4];
+            res += hexDigits[d[i] & 15];
+        }
+        res.resize(std::min<std::size_t>(digits, 32));
+        return res;
+    }
+
+    static void digest(std::string_view data, unsigned char out[16]) {
+        std::uint32_t h[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+        std::size_t full = data.size() / 64 * 64;
+        for (std::size_t off = 0; off < full; off += 64)
+            block(h, reinterpret_cast<const unsigned char*>(data.data()) + off);
+        // Last partial block, the 0x80 marker and the bit length, in one or two blocks.
+        unsigned char tail[128] = {};
+        std::size_t rest = data.size() - full;
+        std::memcpy(tail, data.data() + full, rest);
+        tail[rest] = 0x80;
+        std::size_t tailSize = rest + 1 + 8 <= 64 ? 64 : 128;
+        std::uint64_t bits = (std::uint64_t) data.size() * 8;
+        for (int i = 0; i < 8; i++)
+            tail[tailSize - 8 + i] = (unsigned char) (bits >> (8 * i));
+        for (std::size_t off = 0; off < tailSize; off += 64)
+            block(h, tail + off);
+        for (int i = 0; i < 4; i++)
+            for (int b = 0; b < 4; b++)
+                out[4 * i + b] = (unsigned char) (h[i] >> (8 * b));
+    }
+
+private:
+    static std::uint32_t rotl(std::uint32_t x, int c) { return x << c | x >> (32 - c); }
+
+    static void block(std::uint32_t h[4], const unsigned char* p) {
+        static const std::uint32_t k[64] = {
+            0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+            0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+            0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+            0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+            0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+            0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+            0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+            0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391};
+        static const int r[64] = {
+            7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+            5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+            4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+            6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21};
+        std::uint32_t w[16];
+        for (int i = 0; i < 16; i++)
+            w[i] = (std::uint32_t) p[4 * i] | (std::uint32_t) p[4 * i + 1] << 8 |
+                   (std::uint32_t) p[4 * i + 2] << 16 | (std::uint32_t) p[4 * i + 3] << 24;
+        std::uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+        for (int i = 0; i < 64; i++) {
+            std::uint32_t f;
+            int g;
+            if (i < 16) {
+                f = (b & c) | (~b & d);
+                g = i;
+            } else if (i < 32) {
+                f = (d & b) | (~d & c);
+                g = (5 * i + 1) % 16;
+            } else if (i < 48) {
+                f = b ^ c ^ d;
+                g = (3 * i + 5) % 16;
+            } else {
+                f = c ^ (b | ~d);
+                g = 7 * i % 16;
+            }
+            std::uint32_t t = d;
+            d = c;
+            c = b;
+            b = b + rotl(a + f + k[i] + w[g], r[i]);
+            a = t;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+    }
+};
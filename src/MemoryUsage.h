@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/*
+ * Heap bytes held by the state of a parser, by component, as estimated by
+ * Parser::memoryUsage(). Containers count their capacity, strings their
+ * buffer unless it is the inline small-string one, and tree and hash nodes
+ * the allocator's per-node bookkeeping on top of their payload, so the sum
+ * tracks RSS rather than the logical size.
+ */
+struct MemoryUsage {
+    // Trie nodes and their keys and tokens.
+    std::size_t trie = 0;
+    // Copies of the templates (and line IDs) of the clusters held by trie leaves.
+    std::size_t trieClusters = 0;
+    // logClust and its templates.
+    std::size_t templates = 0;
+    // logIds of the clusters in memory.
+    std::size_t lineIds = 0;
+    // Posting index of line IDs, if enabled.
+    std::size_t postings = 0;
+    // Token dictionary of LCSMatch.
+    std::size_t tokens = 0;
+    // Scratch arena, spill and cold store indexes, deferred matching queues.
+    std::size_t caches = 0;
+
+    std::size_t total() const {
+        return trie + trieClusters + templates + lineIds + postings + tokens + caches;
+    }
+
+    // malloc header of a block, and the colour and links of a red-black tree node.
+    static constexpr std::size_t blockOverhead = sizeof(void*);
+    static constexpr std::size_t treeNode = 4 * sizeof(void*) + blockOverhead;
+    // Next link and cached hash of an unordered container node.
+    static constexpr std::size_t hashNode = 2 * sizeof(void*) + blockOverhead;
+
+    static std::size_t of(const std::string& s) {
+        const char* data = s.data();
+        auto self = reinterpret_cast<const char*>(&s);
+        // Short strings live inside the object.
+        if (data >= self && data < self + sizeof(s))
+            return 0;
+        return s.capacity() + 1 + blockOverhead;
+    }
+
+    template <class T>
+    static std::size_t of(const std::vector<T>& v) {
+        return v.capacity() == 0 ? 0 : v.capacity() * sizeof(T) + blockOverhead;
+    }
+
+    static std::size_t of(const std::vector<std::string>& v) {
+        std::size_t res = of<std::string>(v);
+        for (const std::string& s : v)
+            res += of(s);
+        return res;
+    }
+};
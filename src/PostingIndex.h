@@ -0,0 +1,329 @@
+#pragma once
+
+#include <algorithm>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+/*
+ * Sorted line IDs of one template, compressed in blocks of up to blockSize
+ * IDs: a skip entry per block keeps its first and last ID, its size and the
+ * offset of its deltas, which follow as LEB128 varints. Range counts only
+ * decode the two boundary blocks, lookups binary-search the skip entries.
+ * IDs normally arrive in increasing order and are appended to the open last
+ * block; an out-of-order ID rebuilds the list.
+ */
+class PostingList {
+public:
+    static constexpr std::size_t blockSize = 128;
+
+    struct Skip {
+        int first;
+        int last;
+        std::uint32_t offset;
+        std::uint32_t count;
+    };
+
+    void add(int id) {
+        if (!skips.empty() && id <= skips.back().last) {
+            insert(id);
+            return;
+        }
+        if (skips.empty() || skips.back().count == blockSize) {
+            skips.push_back(Skip{id, id, (std::uint32_t) deltas.size(), 1});
+        } else {
+            Skip& s = skips.back();
+            put((std::uint32_t) (id - s.last));
+            s.last = id;
+            s.count++;
+        }
+        total++;
+    }
+
+    std::size_t size() const { return total; }
+
+    bool empty() const { return total == 0; }
+
+    std::size_t bytes() const {
+        return skips.capacity() * sizeof(Skip) + deltas.capacity();
+    }
+
+    int back() const { return skips.empty() ? INT_MIN : skips.back().last; }
+
+    // Number of IDs in [lo, hi].
+    std::size_t count(int lo, int hi) const {
+        if (lo > hi)
+            return 0;
+        std::size_t b = firstBlock(lo);
+        std::size_t e = lastBlock(hi);
+        if (b >= e)
+            return 0;
+        if (e - b == 1)
+            return countIn(b, lo, hi);
+        std::size_t res = countIn(b, lo, hi) + countIn(e - 1, lo, hi);
+        for (std::size_t k = b + 1; k + 1 < e; k++)
+            res += skips[k].count;
+        return res;
+    }
+
+    // Appends the IDs in [lo, hi] to out.
+    void range(int lo, int hi, std::vector<int>& out) const {
+        if (lo > hi)
+            return;
+        int buf[blockSize];
+        for (std::size_t k = firstBlock(lo), e = lastBlock(hi); k < e; k++) {
+            std::size_t n = decode(k, buf);
+            for (std::size_t i = 0; i < n; i++)
+                if (buf[i] >= lo && buf[i] <= hi)
+                    out.push_back(buf[i]);
+        }
+    }
+
+    std::vector<int> all() const {
+        std::vector<int> res;
+        res.reserve(total);
+        range(INT_MIN, INT_MAX, res);
+        return res;
+    }
+
+    // Adds every ID of other; both stay sorted.
+    void merge(const PostingList& other) {
+        if (other.empty())
+            return;
+        if (empty() || other.skips.front().first > back()) {
+            for (int id : other.all())
+                add(id);
+            return;
+        }
+        std::vector<int> a = all(), b = other.all(), merged(a.size() + b.size());
+        std::merge(a.begin(), a.end(), b.begin(), b.end(), merged.begin());
+        assign(merged);
+    }
+
+    /*
+     * Forward cursor for intersections: seek() moves to the first ID >= target,
+     * skipping whole blocks through the skip entries.
+     */
+    class Cursor {
+    public:
+        explicit Cursor(const PostingList& list) : list(list) { load(0); }
+
+        bool done() const { return block >= list.skips.size(); }
+
+        int value() const { return buf[pos]; }
+
+        void next() {
+            if (++pos == n)
+                load(block + 1);
+        }
+
+        void seek(int target) {
+            if (done() || value() >= target)
+                return;
+            if (list.skips[block].last < target) {
+                auto it = std::lower_bound(list.skips.begin() + (std::ptrdiff_t) block + 1, list.skips.end(), target,
+                                           [](const Skip& s, int t){ return s.last < t; });
+                load((std::size_t) (it - list.skips.begin()));
+                if (done())
+                    return;
+            }
+            pos = (std::size_t) (std::lower_bound(buf + pos, buf + n, target) - buf);
+        }
+
+    private:
+        const PostingList& list;
+        std::size_t block = 0;
+        std::size_t pos = 0;
+        std::size_t n = 0;
+        int buf[blockSize];
+
+        void load(std::size_t k) {
+            block = k;
+            pos = 0;
+            n = done() ? 0 : list.decode(k, buf);
+        }
+    };
+
+private:
+    std::vector<Skip> skips;
+    std::vector<std::uint8_t> deltas;
+    std::size_t total = 0;
+
+    void put(std::uint32_t v) {
+        while (v >= 0x80) {
+            deltas.push_back((std::uint8_t) (v | 0x80));
+            v >>= 7;
+        }
+        deltas.push_back((std::uint8_t) v);
+    }
+
+    std::size_t decode(std::size_t k, int* out) const {
+        const Skip& s = skips[k];
+        const std::uint8_t* p = deltas.data() + s.offset;
+        int id = s.first;
+        out[0] = id;
+        for (std::uint32_t i = 1; i < s.count; i++) {
+            std::uint32_t v = 0;
+            int shift = 0;
+            while (*p & 0x80) {
+                v |= (std::uint32_t) (*p++ & 0x7f) << shift;
+                shift += 7;
+            }
+            v |= (std::uint32_t) *p++ << shift;
+            id += (int) v;
+            out[i] = id;
+        }
+        return s.count;
+    }
+
+    // First block whose last ID is >= lo.
+    std::size_t firstBlock(int lo) const {
+        return (std::size_t) (std::lower_bound(skips.begin(), skips.end(), lo,
+                                               [](const Skip& s, int v){ return s.last < v; }) - skips.begin());
+    }
+
+    // One past the last block whose first ID is <= hi.
+    std::size_t lastBlock(int hi) const {
+        return (std::size_t) (std::upper_bound(skips.begin(), skips.end(), hi,
+                                               [](int v, const Skip& s){ return v < s.first; }) - skips.begin());
+    }
+
+    std::size_t countIn(std::size_t k, int lo, int hi) const {
+        const Skip& s = skips[k];
+        if (s.first >= lo && s.last <= hi)
+            return s.count;
+        int buf[blockSize];
+        std::size_t n = decode(k, buf);
+        return (std::size_t) (std::upper_bound(buf, buf + n, hi) - std::lower_bound(buf, buf + n, lo));
+    }
+
+    void assign(const std::vector<int>& sorted) {
+        skips.clear();
+        deltas.clear();
+        total = 0;
+        for (int id : sorted)
+            add(id);
+    }
+
+    void insert(int id) {
+        std::vector<int> ids = all();
+        auto it = std::lower_bound(ids.begin(), ids.end(), id);
+        if (it != ids.end() && *it == id)
+            return;
+        ids.insert(it, id);
+        assign(ids);
+    }
+};
+
+/*
+ * Posting lists of every cluster, answering "lines of template X in [a, b]",
+ * "count per template since line N" and intersections without scanning
+ * logIds or the structured output.
+ */
+class PostingIndex {
+public:
+    void add(int cluster, int lineId) {
+        if (cluster < 0)
+            return;
+        if ((std::size_t) cluster >= lists.size())
+            lists.resize((std::size_t) cluster + 1);
+        lists[(std::size_t) cluster].add(lineId);
+    }
+
+    // Rows of a result table (e.g. a columnar segment), in line ID order.
+    void add(const std::int32_t* lineIds, const std::int32_t* clusterIds, std::size_t rows) {
+        for (std::size_t i = 0; i < rows; i++)
+            add(clusterIds[i], lineIds[i]);
+    }
+
+    std::size_t clusters() const { return lists.size(); }
+
+    const PostingList& list(int cluster) const {
+        static const PostingList none;
+        return cluster >= 0 && (std::size_t) cluster < lists.size() ? lists[(std::size_t) cluster] : none;
+    }
+
+    std::vector<int> lines(int cluster, int first = INT_MIN, int last = INT_MAX) const {
+        std::vector<int> res;
+        list(cluster).range(first, last, res);
+        return res;
+    }
+
+    std::size_t count(int cluster, int first = INT_MIN, int last = INT_MAX) const {
+        return list(cluster).count(first, last);
+    }
+
+    // Lines of every cluster after lineId.
+    std::vector<std::size_t> countsSince(int lineId) const {
+        std::vector<std::size_t> res(lists.size());
+        if (lineId == INT_MAX)
+            return res;
+        for (std::size_t c = 0; c < lists.size(); c++)
+            res[c] = lists[c].count(lineId + 1, INT_MAX);
+        return res;
+    }
+
+    // Line IDs in [first, last] present in the lists of all the given clusters.
+    std::vector<int> intersect(const std::vector<int>& clusters, int first = INT_MIN, int last = INT_MAX) const {
+        std::vector<int> res;
+        if (clusters.empty())
+            return res;
+        std::vector<PostingList::Cursor> cursors;
+        cursors.reserve(clusters.size());
+        for (int c : clusters)
+            cursors.emplace_back(list(c));
+        int target = first;
+        while (true) {
+            bool agreed = true;
+            for (auto& cur : cursors) {
+                cur.seek(target);
+                if (cur.done() || cur.value() > last)
+                    return res;
+                if (cur.value() != target) {
+                    target = cur.value();
+                    agreed = false;
+                }
+            }
+            if (agreed) {
+                res.push_back(target);
+                if (target == INT_MAX)
+                    return res;
+                target++;
+            }
+        }
+    }
+
+    /*
+     * Follows a cluster renumbering (consolidation, eviction): the list of old
+     * cluster c moves to to[c], merging lists that land together; -1 drops it.
+     */
+    void remap(const std::vector<int>& to) {
+        int size = 0;
+        for (int t : to)
+            size = std::max(size, t + 1);
+        std::vector<PostingList> res((std::size_t) size);
+        for (std::size_t c = 0; c < lists.size(); c++) {
+            int t = c < to.size() ? to[c] : -1;
+            if (t < 0)
+                continue;
+            if (res[(std::size_t) t].empty())
+                res[(std::size_t) t] = std::move(lists[c]);
+            else
+                res[(std::size_t) t].merge(lists[c]);
+        }
+        lists = std::move(res);
+    }
+
+    std::size_t bytes() const {
+        std::size_t res = lists.capacity() * sizeof(PostingList);
+        for (const PostingList& l : lists)
+            res += l.bytes();
+        return res;
+    }
+
+private:
+    std::vector<PostingList> lists;
+};
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
+
+/*
+ * Scratch memory for the temporaries of one parsing step (token views, match
+ * sets, the LCS table). Everything is carved out of a monotonic buffer and
+ * dropped at once by reset(). A line that does not fit takes the overflow
+ * from the heap, and the next reset() regrows the buffer past the high-water
+ * mark, so a steady stream of lines makes no allocator calls at all.
+ */
+class ScratchArena {
+public:
+    explicit ScratchArena(std::size_t capacity = 16 * 1024) {
+        allocate(capacity);
+    }
+
+    // Scratch contents only live for one line, a copy starts out empty.
+    ScratchArena(const ScratchArena& other)
+            : ScratchArena(other.capacity) {}
+
+    ScratchArena& operator=(const ScratchArena&) {
+        reset();
+        return *this;
+    }
+
+    std::pmr::memory_resource* resource() {
+        return arena.get();
+    }
+
+    std::size_t getCapacity() const { return capacity; }
+
+    // Nothing allocated from resource() may be used after this.
+    void reset() {
+        if (overflow.used == 0)
+            arena->release();
+        else
+            allocate(std::max(2 * capacity, capacity + overflow.used));
+    }
+
+private:
+    class Overflow : public std::pmr::memory_resource {
+    public:
+        std::size_t used = 0;
+
+    private:
+        void* do_allocate(std::size_t bytes, std::size_t alignment) override {
+            used += bytes;
+            return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+        }
+
+        void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) override {
+            std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+        }
+
+        bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+            return this == &other;
+        }
+    };
+
+    std::size_t capacity = 0;
+    std::unique_ptr<std::byte[]> buffer;
+    Overflow overflow;
+    std::unique_ptr<std::pmr::monotonic_buffer_resource> arena;
+
+    void allocate(std::size_t newCapacity) {
+        arena.reset();
+        overflow.used = 0;
+        capacity = newCapacity;
+        buffer = std::make_unique<std::byte[]>(capacity);
+        arena = std::make_unique<std::pmr::monotonic_buffer_resource>(buffer.get(), capacity, &overflow);
+    }
+};
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+/*
+ * Append-only vector whose elements never move. Storage is a directory of
+ * segments doubling in size (64, 128, 256, ...), allocated on demand and
+ * never reallocated, so references handed out stay valid while the table
+ * grows. Appends are serialized between writers only; an element is fully
+ * constructed before the atomic size publishing it is bumped, so readers
+ * iterate [0, size()) without taking any lock.
+ */
+template <class T>
+class SegmentedVector {
+public:
+    SegmentedVector() {
+        for (auto& s : segments)
+            s.store(nullptr, std::memory_order_relaxed);
+    }
+
+    SegmentedVector(const SegmentedVector&) = delete;
+    SegmentedVector& operator=(const SegmentedVector&) = delete;
+
+    ~SegmentedVector() {
+        clear();
+    }
+
+    size_t size() const {
+        return count.load(std::memory_order_acquire);
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    T& operator[](size_t i) {
+        size_t seg = segmentOf(i);
+        return segments[seg].load(std::memory_order_acquire)[i - segmentStart(seg)];
+    }
+
+    const T& operator[](size_t i) const {
+        size_t seg = segmentOf(i);
+        return segments[seg].load(std::memory_order_acquire)[i - segmentStart(seg)];
+    }
+
+    template <class... Args>
+    T& emplace_back(Args&&... args) {
+        std::lock_guard<std::mutex> l(appendLock);
+        size_t n = count.load(std::memory_order_relaxed);
+        size_t seg = segmentOf(n);
+        T* base = segments[seg].load(std::memory_order_relaxed);
+        if (base == nullptr) {
+            base = static_cast<T*>(::operator new(segmentSize(seg) * sizeof(T), std::align_val_t(alignof(T))));
+            segments[seg].store(base, std::memory_order_release);
+        }
+        T* res = new(base + (n - segmentStart(seg))) T(std::forward<Args>(args)...);
+        count.store(n + 1, std::memory_order_release);
+        return *res;
+    }
+
+    T& push_back(const T& value) {
+        return emplace_back(value);
+    }
+
+    // Position of an element of this table, -1 if p does not belong to it.
+    long indexOf(const T* p) const {
+        size_t n = size();
+        for (size_t seg = 0; seg < maxSegments && segmentStart(seg) < n; seg++) {
+            const T* base = segments[seg].load(std::memory_order_acquire);
+            if (base != nullptr && p >= base && p < base + segmentSize(seg))
+                return (long) (segmentStart(seg) + (p - base));
+        }
+        return -1;
+    }
+
+    std::vector<T> snapshot() const {
+        std::vector<T> res;
+        size_t n = size();
+        res.reserve(n);
+        for (size_t i = 0; i < n; i++)
+            res.push_back((*this)[i]);
+        return res;
+    }
+
+    // Not safe against concurrent readers or writers.
+    void clear() {
+        size_t n = count.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < n; i++)
+            (*this)[i].~T();
+        for (size_t seg = 0; seg < maxSegments; seg++) {
+            T* base = segments[seg].exchange(nullptr, std::memory_order_relaxed);
+            if (base != nullptr)
+                ::operator delete(base, std::align_val_t(alignof(T)));
+        }
+        count.store(0, std::memory_order_release);
+    }
+
+private:
+    static constexpr size_t firstSegmentBits = 6;
+    static constexpr size_t maxSegments = 40;
+
+    std::atomic<T*> segments[maxSegments];
+    std::atomic<size_t> count{0};
+    std::mutex appendLock;
+
+    static size_t segmentSize(size_t seg) {
+        return (size_t) 1 << (seg + firstSegmentBits);
+    }
+
+    static size_t segmentStart(size_t seg) {
+        return segmentSize(seg) - segmentSize(0);
+    }
+
+    static size_t segmentOf(size_t i) {
+        size_t block = (i >> firstSegmentBits) + 1;
+#if defined(__GNUC__) || defined(__clang__)
+        return 63 - __builtin_clzll(block);
+#else
+        size_t seg = 0;
+        while (block >>= 1)
+            seg++;
+        return seg;
+#endif
+    }
+};
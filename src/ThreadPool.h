@@ -0,0 +1,271 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+/*
+ * Persistent worker pool running range jobs over [0, items). Each worker
+ * starts on its own contiguous slice and takes `grain` items at a time from
+ * the front; a worker whose slice is empty steals the back half of the
+ * largest remaining slice, so skewed ranges do not leave workers idle and
+ * every item is run exactly once.
+ *
+ * Workers can be pinned on Linux: "compact" fills the CPUs of one NUMA node
+ * before moving to the next, "spread" alternates nodes; "none" leaves
+ * placement to the scheduler.
+ */
+class ThreadPool {
+public:
+    using Job = std::function<void(std::size_t begin, std::size_t end, int worker)>;
+
+    explicit ThreadPool(int workers = 0, const std::string& placement = "none") {
+        if (workers <= 0)
+            workers = std::max(1, (int) std::thread::hardware_concurrency());
+        if (placement != "none" && placement != "compact" && placement != "spread")
+            throw std::invalid_argument("Unknown worker placement: " + placement);
+        std::vector<int> cpus = placement == "none" ? std::vector<int>() : cpuOrder(placement == "spread");
+        slices = std::make_unique<Slice[]>(workers);
+        for (int w = 0; w < workers; w++) {
+            threads.emplace_back(&ThreadPool::work, this, w);
+            if (!cpus.empty())
+                pin(threads.back(), cpus[w % cpus.size()]);
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> l(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& t : threads)
+            t.join();
+    }
+
+    int size() const { return (int) threads.size(); }
+
+    // Runs job over [0, items) on the workers and returns once every item is done.
+    void run(std::size_t items, std::size_t grain, const Job& job) {
+        if (items == 0)
+            return;
+        if (items > UINT32_MAX)
+            throw std::length_error("ThreadPool::run supports up to 2^32-1 items");
+        std::lock_guard<std::mutex> serial(runLock);
+        std::size_t n = threads.size();
+        for (std::size_t w = 0; w < n; w++)
+            slices[w].span.store(pack(items * w / n, items * (w + 1) / n), std::memory_order_relaxed);
+        {
+            std::lock_guard<std::mutex> l(lock);
+            current = &job;
+            this->grain = std::max<std::size_t>(grain, 1);
+            pending = (int) n;
+            failure = nullptr;
+            generation++;
+        }
+        wake.notify_all();
+        std::unique_lock<std::mutex> l(lock);
+        done.wait(l, [this]{ return pending == 0; });
+        current = nullptr;
+        if (failure)
+            std::rethrow_exception(failure);
+    }
+
+private:
+    struct Slice {
+        // [begin, end) packed as begin << 32 | end, so owner and thieves agree with one CAS.
+        std::atomic<std::uint64_t> span{0};
+    };
+
+    std::vector<std::thread> threads;
+    std::unique_ptr<Slice[]> slices;
+    std::mutex runLock;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable done;
+    const Job* current = nullptr;
+    std::size_t grain = 1;
+    int pending = 0;
+    unsigned long generation = 0;
+    bool stopping = false;
+    std::exception_ptr failure;
+
+    static std::uint64_t pack(std::uint64_t begin, std::uint64_t end) {
+        return begin << 32 | end;
+    }
+
+    static bool takeFront(Slice& s, std::size_t grain, std::size_t& begin, std::size_t& end) {
+        std::uint64_t cur = s.span.load(std::memory_order_acquire);
+        while (true) {
+            std::uint64_t b = cur >> 32, e = cur & UINT32_MAX;
+            if (b >= e)
+                return false;
+            std::uint64_t take = std::min<std::uint64_t>(grain, e - b);
+            if (s.span.compare_exchange_weak(cur, pack(b + take, e), std::memory_order_acq_rel)) {
+                begin = b;
+                end = b + take;
+                return true;
+            }
+        }
+    }
+
+    static bool stealBack(Slice& s, std::size_t& begin, std::size_t& end) {
+        std::uint64_t cur = s.span.load(std::memory_order_acquire);
+        while (true) {
+            std::uint64_t b = cur >> 32, e = cur & UINT32_MAX;
+            if (e <= b + 1)
+                return false;
+            std::uint64_t mid = b + (e - b) / 2;
+            if (s.span.compare_exchange_weak(cur, pack(b, mid), std::memory_order_acq_rel)) {
+                begin = mid;
+                end = e;
+                return true;
+            }
+        }
+    }
+
+    bool steal(int self) {
+        // Victim with the most work left; the stolen half becomes our own slice.
+        int victim = -1;
+        std::uint64_t most = 0;
+        for (int w = 0; w < (int) threads.size(); w++) {
+            std::uint64_t cur = slices[w].span.load(std::memory_order_relaxed);
+            std::uint64_t b = cur >> 32, e = cur & UINT32_MAX;
+            if (w != self && e > b && e - b > most) {
+                most = e - b;
+                victim = w;
+            }
+        }
+        std::size_t begin, end;
+        if (victim < 0 || !stealBack(slices[victim], begin, end))
+            return victim >= 0;
+        slices[self].span.store(pack(begin, end), std::memory_order_release);
+        return true;
+    }
+
+    void work(int self) {
+        unsigned long seen = 0;
+        while (true) {
+            const Job* job;
+            std::size_t step;
+            {
+                std::unique_lock<std::mutex> l(lock);
+                wake.wait(l, [&]{ return stopping || generation != seen; });
+                if (stopping)
+                    return;
+                seen = generation;
+                job = current;
+                step = grain;
+            }
+            try {
+                std::size_t begin, end;
+                while (true) {
+                    if (takeFront(slices[self], step, begin, end))
+                        (*job)(begin, end, self);
+                    else if (!steal(self))
+                        break;
+                }
+            } catch (...) {
+                std::lock_guard<std::mutex> l(lock);
+                if (!failure)
+                    failure = std::current_exception();
+            }
+            std::lock_guard<std::mutex> l(lock);
+            if (--pending == 0)
+                done.notify_all();
+        }
+    }
+
+    static std::vector<int> allowedCpus() {
+        std::vector<int> res;
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) == 0)
+            for (int c = 0; c < CPU_SETSIZE; c++)
+                if (CPU_ISSET(c, &set))
+                    res.push_back(c);
+#endif
+        return res;
+    }
+
+    static std::vector<int> parseCpuList(const std::string& list) {
+        // "0-3,8-11" as written in /sys/devices/system/node/node*/cpulist
+        std::vector<int> res;
+        std::size_t i = 0;
+        while (i < list.size()) {
+            std::size_t next = list.find(',', i);
+            std::string part = list.substr(i, next == std::string::npos ? std::string::npos : next - i);
+            std::size_t dash = part.find('-');
+            try {
+                int first = std::stoi(part.substr(0, dash));
+                int last = dash == std::string::npos ? first : std::stoi(part.substr(dash + 1));
+                for (int c = first; c <= last; c++)
+                    res.push_back(c);
+            } catch (const std::exception&) {
+            }
+            if (next == std::string::npos)
+                break;
+            i = next + 1;
+        }
+        return res;
+    }
+
+    static std::vector<int> cpuOrder(bool spread) {
+        std::vector<int> allowed = allowedCpus();
+        std::map<int, int> nodeOf;
+        for (int node = 0; ; node++) {
+            std::ifstream in("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            std::string list;
+            if (!in || !std::getline(in, list))
+                break;
+            for (int c : parseCpuList(list))
+                nodeOf[c] = node;
+        }
+        std::map<int, std::vector<int>> byNode;
+        for (int c : allowed)
+            byNode[nodeOf.count(c) ? nodeOf[c] : 0].push_back(c);
+        std::vector<int> res;
+        if (!spread) {
+            for (auto& node : byNode)
+                res.insert(res.end(), node.second.begin(), node.second.end());
+            return res;
+        }
+        for (std::size_t i = 0; res.size() < allowed.size(); i++)
+            for (auto& node : byNode)
+                if (i < node.second.size())
+                    res.push_back(node.second[i]);
+        return res;
+    }
+
+    static void pin(std::thread& t, int cpu) {
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        pthread_setaffinity_np(t.native_handle(), sizeof(set), &set);
+#else
+        (void) t;
+        (void) cpu;
+#endif
+    }
+};
@@ -0,0 +1,207 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+/*
+ * Line counts of every template by time bucket, kept while parsing. All
+ * templates share one window of the last `ring` buckets of `width` seconds,
+ * ending at the newest bucket a line fell into; the counts of template c are
+ * the ring counts[c * ring, (c + 1) * ring), bucket b in slot b % ring. When
+ * a line moves the window on, the buckets leaving it are closed: their
+ * non-zero counts become rows of `closed`, oldest bucket first, and the slots
+ * are reused. Lines a little out of order still land in their bucket; lines
+ * older than the window are only counted as late.
+ */
+class TimeBuckets {
+public:
+    /*
+     * Lines of a template in [start, start + width) seconds. cluster follows
+     * remap() while the row waits in closed, -1 once its template was dropped;
+     * eventId is left for the owner to fill in when the row closes.
+     */
+    struct Row {
+        std::int64_t start;
+        int cluster;
+        std::string eventId;
+        std::uint32_t count;
+    };
+
+    const std::int64_t width;
+    const std::size_t ring;
+    // Header fields whose digits make up the time of a line, see parseTime().
+    const std::vector<std::string> fields;
+    std::vector<Row> closed;
+    // Lines older than the window, and lines without a readable time.
+    std::uint64_t late = 0;
+    std::uint64_t unparsed = 0;
+
+    TimeBuckets(std::int64_t width, std::size_t ring, std::vector<std::string> fields)
+            : width(std::max<std::int64_t>(width, 1)), ring(std::max<std::size_t>(ring, 1)),
+              fields(std::move(fields)) {}
+
+    std::size_t clusters() const { return counts.size() / ring; }
+
+    // Newest bucket number (time / width), or none before the first line.
+    static constexpr std::int64_t none = std::numeric_limits<std::int64_t>::min();
+    std::int64_t newestBucket() const { return newest; }
+
+    void add(int cluster, std::int64_t time) {
+        std::int64_t bucket = floorDiv(time, width);
+        if (newest == none)
+            newest = bucket;
+        if (bucket > newest) {
+            close(bucket - (std::int64_t) ring + 1);
+            newest = bucket;
+        } else if (bucket <= newest - (std::int64_t) ring) {
+            late++;
+            return;
+        }
+        if ((std::size_t) cluster >= clusters())
+            counts.resize((std::size_t) (cluster + 1) * ring, 0);
+        counts[(std::size_t) cluster * ring + slot(bucket)]++;
+    }
+
+    void close(std::int64_t end) {
+        // Closes the buckets of the window before bucket number end.
+        if (newest == none)
+            return;
+        std::int64_t first = newest - (std::int64_t) ring + 1;
+        end = std::min(end, newest + 1);
+        for (std::int64_t b = first; b < end; b++) {
+            std::size_t s = slot(b);
+            for (std::size_t c = 0; c < clusters(); c++)
+                take((int) c, b, counts[c * ring + s]);
+        }
+    }
+
+    // Closes the whole window, e.g. at the end of the input. Later lines of its buckets give further rows.
+    void flush() {
+        if (newest != none)
+            close(newest + 1);
+    }
+
+    void closeCluster(int cluster) {
+        if (newest == none || (std::size_t) cluster >= clusters())
+            return;
+        for (std::int64_t b = newest - (std::int64_t) ring + 1; b <= newest; b++)
+            take(cluster, b, counts[(std::size_t) cluster * ring + slot(b)]);
+    }
+
+    // Rows of the buckets still open, by bucket then template, without closing them.
+    std::vector<Row> open() const {
+        std::vector<Row> res;
+        if (newest == none)
+            return res;
+        for (std::int64_t b = newest - (std::int64_t) ring + 1; b <= newest; b++)
+            for (std::size_t c = 0; c < clusters(); c++)
+                if (std::uint32_t n = counts[c * ring + slot(b)])
+                    res.push_back(Row{b * width, (int) c, std::string(), n});
+        return res;
+    }
+
+    void remap(const std::vector<int>& remap) {
+        // Counts move to remap[c] and add up there; clusters mapped to -1 must be closed first.
+        for (Row& row : closed)
+            if (row.cluster >= 0 && (std::size_t) row.cluster < remap.size())
+                row.cluster = remap[row.cluster];
+        std::vector<std::uint32_t> moved;
+        for (std::size_t c = 0; c < clusters() && c < remap.size(); c++) {
+            if (remap[c] < 0)
+                continue;
+            std::size_t to = (std::size_t) remap[c] * ring;
+            if (moved.size() < to + ring)
+                moved.resize(to + ring, 0);
+            for (std::size_t s = 0; s < ring; s++)
+                moved[to + s] += counts[c * ring + s];
+        }
+        counts = std::move(moved);
+    }
+
+    std::size_t bytes() const {
+        return counts.capacity() * sizeof(std::uint32_t) + closed.capacity() * sizeof(Row);
+    }
+
+    static bool parseTime(const std::vector<std::string_view>& parts, std::int64_t& seconds) {
+        /*
+         * Seconds since the epoch (UTC) of the digits of parts, read as yyMMdd if
+         * the first run of digits has six of them (HDFS "081109 203615") and as
+         * yyyyMMdd otherwise ("2015-10-18 18:01:47,978"), then HHmmss; missing
+         * time digits are zeros and further ones (fractions) are ignored.
+         */
+        std::string digits;
+        std::size_t firstRun = 0;
+        bool inFirst = true;
+        for (std::string_view part : parts) {
+            for (char ch : part) {
+                if (ch >= '0' && ch <= '9') {
+                    digits += ch;
+                    if (inFirst)
+                        firstRun++;
+                } else if (firstRun > 0)
+                    inFirst = false;
+            }
+            // A run also ends with its field.
+            if (firstRun > 0)
+                inFirst = false;
+        }
+        if (digits.empty())
+            return false;
+        std::size_t dateLen = firstRun == 6 ? 6 : 8;
+        if (digits.size() < dateLen)
+            return false;
+        auto num = [&](std::size_t pos, std::size_t len) {
+            int res = 0;
+            for (std::size_t i = pos; i < pos + len; i++)
+                res = res * 10 + (i < digits.size() ? digits[i] - '0' : 0);
+            return res;
+        };
+        int year = dateLen == 6 ? 2000 + num(0, 2) : num(0, 4);
+        int month = num(dateLen - 4, 2), day = num(dateLen - 2, 2);
+        int hour = num(dateLen, 2), minute = num(dateLen + 2, 2), second = num(dateLen + 4, 2);
+        if (month < 1 || month > 12 || day < 1 || day > 31 || hour > 23 || minute > 59 || second > 60)
+            return false;
+        seconds = daysFromCivil(year, month, day) * 86400 + hour * 3600 + minute * 60 + second;
+        return true;
+    }
+
+    static bool parseTime(std::string_view text, std::int64_t& seconds) {
+        return parseTime(std::vector<std::string_view>{text}, seconds);
+    }
+
+private:
+    std::int64_t newest = none;
+    std::vector<std::uint32_t> counts;
+
+    std::size_t slot(std::int64_t bucket) const {
+        auto n = (std::int64_t) ring;
+        return (std::size_t) (((bucket % n) + n) % n);
+    }
+
+    void take(int cluster, std::int64_t bucket, std::uint32_t& count) {
+        if (count == 0)
+            return;
+        closed.push_back(Row{bucket * width, cluster, std::string(), count});
+        count = 0;
+    }
+
+    static std::int64_t floorDiv(std::int64_t a, std::int64_t b) {
+        return a / b - (a % b != 0 && (a < 0) != (b < 0));
+    }
+
+    static std::int64_t daysFromCivil(std::int64_t y, int m, int d) {
+        // Days since 1970-01-01 of a proleptic Gregorian date (H. Hinnant's algorithm).
+        y -= m <= 2;
+        std::int64_t era = (y >= 0 ? y : y - 399) / 400;
+        std::int64_t yoe = y - era * 400;
+        std::int64_t doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+        std::int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+        return era * 146097 + doe - 719468;
+    }
+};
@@ -4,18 +4,27 @@
 
 namespace py =  pybind11;
 
+// Trie leaves hold a template version; Python sees them as template-only clusters.
+optional<TemplateCluster> leafCluster(const TrieNode &t) {
+    if (!t.cluster)
+        return nullopt;
+    return TemplateCluster(*t.cluster);
+}
+
 PYBIND11_MODULE(CPlusSpell, m) {
     m.doc() = "Log parsing module spellpy adapted into c++"; // Optional module docstring
 
     py::class_<TemplateCluster>(m, "TemplateCluster")
             .def(py::init<vector<string> &, vector<int> &>(),
                 py::arg("logTemplate"), py::arg("logIds"))
-            .def_readwrite("logTemplate", &TemplateCluster::logTemplate)
+            .def_property("logTemplate",
+                [](const TemplateCluster &t) { return t.logTemplate(); },
+                [](TemplateCluster &t, vector<string> logTemplate) { t.setTemplate(std::move(logTemplate)); })
             .def_readwrite("logIDL", &TemplateCluster::logIds)
             .def(py::pickle(
                     [](const TemplateCluster &t) { // __getstate__
                         /* Return a tuple that fully encodes the state of the object */
-                        return py::make_tuple(t.logTemplate, t.logIds);
+                        return py::make_tuple(t.logTemplate(), t.lineIds());
                     },
                     [](py::tuple t) { // __setstate__
                         if (t.size() != 2)
@@ -32,23 +41,23 @@ PYBIND11_MODULE(CPlusSpell, m) {
     py::class_<TrieNode>(m, "TrieNode")
             .def(py::init<>())
             .def(py::init<string &, int &>())
-            .def_readonly("cluster", &TrieNode::cluster)
-//            .def_readwrite("cluster", &TrieNode::cluster)
+            .def_property_readonly("cluster", &leafCluster)
             .def_readwrite("token", &TrieNode::token)
             .def_readwrite("templateNo", &TrieNode::templateNo)
             .def_readwrite("child", &TrieNode::child)
             .def(py::pickle(
                     [](const TrieNode &t) { // __getstate__
                         /* Return a tuple that fully encodes the state of the object */
-                        return py::make_tuple(t.cluster,t.token, t.templateNo, t.child);
+                        return py::make_tuple(leafCluster(t), t.token, t.templateNo, t.child);
                     },
                     [](py::tuple t) { // __setstate__
                         if (t.size() != 4)
                             throw std::runtime_error("Invalid state!");
 
                         /* Create a new C++ instance */
+                        auto cluster = t[0].cast<optional<TemplateCluster>>();
                         TrieNode trie(
-                                t[0].cast<optional<TemplateCluster>>(),
+                                cluster ? make_shared<const vector<string>>(cluster->logTemplate()) : nullptr,
                                 t[1].cast<string>(),
                                 t[2].cast<int>(),
                                 t[3].cast<map<string, TrieNode>>());
@@ -65,17 +74,42 @@ PYBIND11_MODULE(CPlusSpell, m) {
         .def_readonly("trieRoot", &Parser::trieRoot)
 //        .def("getTrieRoot", &Parser::getTrieRoot)
 //        .def_readwrite("logClust", &Parser::logClust)
+        .def_property_readonly("logClust", [](const Parser &p) { return p.logClust.snapshot(); },
+            "Snapshot of the current template clusters")
         .def("parse", &Parser::parse,
             "A function which parses the 'Content' section of a log"
             " generated from spellpy",
-            py::arg("content"), py::arg("lastLineId"))
-        .def("LCSMatch", &Parser::LCSMatch,py::return_value_policy::copy,
+            py::arg("content"), py::arg("lastLineId"),
+            py::call_guard<py::gil_scoped_release>())
+        .def("parseOrdered", &Parser::parseOrdered,
+            "Multithreaded parse committing lines in line id order, "
+            "with the same result as the sequential parser; runs on the executor if set, else on threads threads",
+            py::arg("content"), py::arg("lastLineId") = 0, py::arg("threads") = 0,
+            py::call_guard<py::gil_scoped_release>())
+        .def("setExecutor", &Parser::setExecutor,
+            "Persistent worker pool used by parse and parseOrdered: threads workers (0 for one per hardware thread), "
+            "placement 'none', 'compact' (fill a NUMA node first) or 'spread' (alternate nodes), "
+            "and grain lines handed out at a time",
+            py::arg("threads"), py::arg("placement") = "none", py::arg("grain") = 64)
+        .def("LCSMatch", [](Parser &p, const vector<TemplateCluster> &cluster, const vector<string> &logMsg) {
+                    ClusterTable table;
+                    for (const auto &c : cluster)
+                        table.push_back(c);
+                    optional<TemplateCluster> res;
+                    auto match = p.LCSMatch(table, logMsg);
+                    if (match.has_value())
+                        res.emplace(*match.value());
+                    return res;
+                },
                 "Tries to find a match for a logMsg in a List of TemplateCLuster",
                 py::arg("cluster"), py::arg("logMsg"))
-        .def("addSeqToPrefixTree", &Parser::addSeqToPrefixTree,
+        .def("addSeqToPrefixTree", [](Parser &p, TrieNode &prefixTreeRoot, const TemplateCluster &newCluster) {
+                    unique_lock<shared_mutex> l(p.trieLock);
+                    p.addSeqToPrefixTree(prefixTreeRoot, newCluster);
+                },
                 "Add Template to trie",
                 py::arg("prefixTreeRoot"), py::arg("newCluster"))
-        .def("addTemplate", py::overload_cast<std::string>(&Parser::addTemplate),
+        .def("addTemplate", py::overload_cast<const std::string&>(&Parser::addTemplate),
              "Manually add custom template to parser structures",
              py::arg("newTemplate"))
         .def("addTemplate", py::overload_cast<std::vector<std::string>>(&Parser::addTemplate),
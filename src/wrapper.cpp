@@ -1,4 +1,5 @@
 #include <pybind11/pybind11.h>
+#include <pybind11/functional.h>
 #include <pybind11/stl.h>
 #include "CSpell.cpp"
 
@@ -10,8 +11,15 @@ PYBIND11_MODULE(CPlusSpell, m) {
     py::class_<TemplateCluster>(m, "TemplateCluster")
             .def(py::init<vector<string> &, vector<int> &>(),
                 py::arg("logTemplate"), py::arg("logIds"))
-            .def_readwrite("logTemplate", &TemplateCluster::logTemplate)
+            .def_property("logTemplate",
+                          [](const TemplateCluster &t) { return t.logTemplate; },
+                          [](TemplateCluster &t, vector<string> logTemplate) {
+                              // A new template invalidates what was cached for the old one.
+                              t.logTemplate = std::move(logTemplate);
+                              t.version++;
+                          })
             .def_readwrite("logIDL", &TemplateCluster::logIds)
+            .def_readonly("version", &TemplateCluster::version)
             .def(py::pickle(
                     [](const TemplateCluster &t) { // __getstate__
                         /* Return a tuple that fully encodes the state of the object */
@@ -50,7 +58,7 @@ PYBIND11_MODULE(CPlusSpell, m) {
                                 t[0].cast<optional<TemplateCluster>>(),
                                 t[1].cast<string>(),
                                 t[2].cast<int>(),
-                                t[3].cast<map<string, TrieNode>>());
+                                t[3].cast<TrieChildren>());
                         return trie;
                     }
             ));
@@ -64,31 +72,253 @@ PYBIND11_MODULE(CPlusSpell, m) {
         .def_readwrite("logClust", &Parser::logClust)
         .def("parse", &Parser::parse,
             "A function which parses the 'Content' section of a log"
-            " generated from spellpy",
-            py::arg("content"), py::arg("lastLineId"))
-        .def("LCS", &Parser::LCS,
+            " generated from spellpy; times (e.g. Date + ' ' + Time of every line) feed the time buckets",
+            py::arg("content"), py::arg("lastLineId"), py::arg("times") = vector<string>())
+        .def("LCS", py::overload_cast<const vector<string> &, const vector<string> &>(&Parser::LCS),
                 "Longest Common Subsequence between String Arrays",
                 py::arg("seq1"),py::arg("seq2"))
-        .def("LCSMatch", &Parser::LCSMatch,py::return_value_policy::copy,
+        .def("LCSMatch", py::overload_cast<vector<TemplateCluster> &, const vector<string> &>(&Parser::LCSMatch),
+                py::return_value_policy::copy,
                 "Tries to find a match for a logMsg in a List of TemplateCLuster",
                 py::arg("cluster"), py::arg("logMsg"))
         .def("addSeqToPrefixTree", &Parser::addSeqToPrefixTree,
                 "Add Template to trie",
                 py::arg("prefixTreeRoot"), py::arg("newCluster"))
-        .def("getTemplate", &Parser::getTemplate,
+        .def("getTemplate", py::overload_cast<const vector<string> &, const vector<string> &>(&Parser::getTemplate),
                 "Generate Template from partial message obtained via LCS",
                 py::arg("lcs"), py::arg("seq"))
 //        .def("addTemplate", &Parser::addTemplate,
 //             "Manually add custom template to parser structures",
 //             py::arg("newTemplate"))
-        .def("addTemplate", py::overload_cast<std::string>(&Parser::addTemplate),
+        .def("addTemplate", py::overload_cast<const std::string&>(&Parser::addTemplate),
              "Manually add custom template to parser structures",
              py::arg("newTemplate"))
         .def("addTemplate", py::overload_cast<std::vector<std::string>>(&Parser::addTemplate),
              "Manually add custom template to parser structures",
              py::arg("newTemplate"))
+        .def("addTemplates", &Parser::addTemplates,
+             "Add a template library at once, skipping duplicates; templates are split on up to threads "
+             "threads and the prefix tree is built in one pass. Returns the number of templates added",
+             py::arg("templates"), py::arg("threads") = 1)
+        .def("loadTemplates", &Parser::loadTemplates,
+             "addTemplates with the lines of the file path, one template per line",
+             py::arg("path"), py::arg("threads") = 1)
         .def("purgeIDs", &Parser::purgeIDs,
              "Clear cache by removing the association of all templates to their lines"
-             "except for the greatest one, which is used to determined last line parsed");
+             "except for the greatest one, which is used to determined last line parsed")
+        .def("setRetention", &Parser::setRetention,
+             "Keep at most keepIds line IDs and/or the last idWindow lines per template in memory "
+             "(0 disables), spilling older ones to the append-only segment file spillPath. "
+             "An existing segment is resumed unless fresh, which truncates it",
+             py::arg("keepIds"), py::arg("idWindow") = 0, py::arg("spillPath") = "", py::arg("fresh") = false)
+        .def("setMasking", &Parser::setMasking,
+             "Mask variable tokens before matching with builtin rules ('ip', 'hex', 'blk', 'num') "
+             "or glob patterns ('*' any run, '?' any char, '#' digit run). An empty list disables masking. "
+             "Lines are split on the characters of delimiters",
+             py::arg("rules"), py::arg("delimiters") = string(Masker::defaultDelimiters))
+        .def("lineIds", &Parser::lineIds,
+             "All line IDs of a template, including the ones spilled to disk",
+             py::arg("clusterNo"))
+        .def("setConsolidation", &Parser::setConsolidation,
+             "Merge near-duplicate templates while parsing once there are more than maxClusters "
+             "(0 disables), examining at most budget templates after each line",
+             py::arg("maxClusters"), py::arg("budget") = 16)
+        .def("consolidate", &Parser::consolidate,
+             "Merge templates the LCS rule would have joined, examining at most budget of them "
+             "(0 means all). Returns the new index of every old template index",
+             py::arg("budget") = 0)
+        .def("setEviction", &Parser::setEviction,
+             "Keep at most hotClusters templates in memory (0 disables), evicting the least recently "
+             "seen ones to the store file storePath, where lines that match nothing in memory look them up. "
+             "An existing store is resumed unless fresh, which truncates it",
+             py::arg("hotClusters"), py::arg("storePath"), py::arg("fresh") = false)
+        .def("evict", &Parser::evict,
+             "Evict cold templates not seen after lastLineId down to the hot budget. "
+             "Returns the new index of every old template index, -1 for evicted ones",
+             py::arg("lastLineId"))
+        .def("setDeferredMatching", &Parser::setDeferredMatching,
+             "Give lines missed by the trie and the loop match a provisional template at once and run "
+             "the LCS match on a worker thread; its merges are applied while parsing and by applyDeferred",
+             py::arg("enable"))
+        .def("applyDeferred", &Parser::applyDeferred,
+             "Apply the merges the worker has found (all of them if wait). "
+             "Returns the new index of every old template index",
+             py::arg("wait") = false)
+        .def("memoryUsage", &Parser::memoryUsage,
+             "Heap bytes of the parser state by component, as a MemoryUsage")
+        .def("setMemoryBudget", &Parser::setMemoryBudget,
+             "Check the memory usage against soft and hard budgets in bytes (0 disables either) while parsing "
+             "and call onBudget(usage, hard) when one is exceeded, relieveMemory without a callback",
+             py::arg("soft"), py::arg("hard"), py::arg("onBudget") = nullptr)
+        .def("enforceMemoryBudget", &Parser::enforceMemoryBudget,
+             "Check the memory budgets now, as parsing does every retentionInterval lines")
+        .def("relieveMemory", &Parser::relieveMemory,
+             "Compact, and if hard also spill (or without a spill segment purge) the line ids in memory",
+             py::arg("hard"))
+        .def("compact", &Parser::compact,
+             "Give back spare capacity of the templates, line ids and token dictionary")
+        .def("spillIds", &Parser::spillIds,
+             "Move all line ids in memory to the spill segment set by setRetention")
+        .def("writeColumns",
+             py::overload_cast<const string &, const vector<string> &, int, bool>(&Parser::writeColumns),
+             "Append the lines of content, parsed as lastLineId + 1 ..., to the columnar file path: "
+             "line ids, cluster ids, parameters (if withParameters) and current templates",
+             py::arg("path"), py::arg("content"), py::arg("lastLineId"), py::arg("withParameters") = true)
+        .def("setPostings", &Parser::setPostings,
+             "Keep a compressed posting list of line ids per template for range, count and "
+             "intersection queries, available as the postings property",
+             py::arg("enable"))
+        .def_property_readonly("postings", [](const Parser &p) { return p.postings.get(); },
+             py::return_value_policy::reference_internal,
+             "PostingIndex of the parser, None unless enabled by setPostings")
+        .def("setTimeBuckets", &Parser::setTimeBuckets,
+             "Count the lines of every template by buckets of seconds (0 disables), keeping the last ring "
+             "buckets open. Closed buckets are appended to the CSV file path, or kept for drainCounts without one. "
+             "fields are the header fields holding the line time",
+             py::arg("seconds"), py::arg("ring") = 60, py::arg("path") = "",
+             py::arg("fields") = vector<string>{"Date", "Time"})
+        .def("drainCounts", &Parser::drainCounts,
+             "TimeBucketRows of the buckets closed since the last call")
+        .def("openCounts", &Parser::openCounts,
+             "TimeBucketRows of the buckets still open")
+        .def("flushCounts", &Parser::flushCounts,
+             "Close every open bucket, e.g. at the end of the input");
+
+    py::class_<TimeBuckets::Row>(m, "TimeBucketRow")
+        .def_readonly("start", &TimeBuckets::Row::start)
+        .def_readonly("cluster", &TimeBuckets::Row::cluster)
+        .def_readonly("eventId", &TimeBuckets::Row::eventId)
+        .def_readonly("count", &TimeBuckets::Row::count);
+
+    py::class_<FrozenParser::Classification>(m, "Classification")
+        .def_readonly("clusters", &FrozenParser::Classification::clusters)
+        .def_readonly("unmatched", &FrozenParser::Classification::unmatched);
+
+    py::class_<FrozenParser>(m, "FrozenParser")
+        .def(py::init<const Parser &>(), py::arg("parser"))
+        .def_readonly("templates", &FrozenParser::templates)
+        .def("__len__", &FrozenParser::size)
+        .def("classify", py::overload_cast<string_view>(&FrozenParser::classify, py::const_),
+             "Index of the template of a line as the parser would have matched it without learning, "
+             "-1 if none matches",
+             py::arg("logMsg"))
+        .def("classify", py::overload_cast<const vector<string> &, int>(&FrozenParser::classify, py::const_),
+             "Classify the lines on up to threads threads. Returns a Classification with the template "
+             "index of every line and the positions of the unmatched ones, to be fed to a learning parser",
+             py::arg("lines"), py::arg("threads") = 1,
+             py::call_guard<py::gil_scoped_release>());
+
+    py::class_<ParserRouter>(m, "ParserRouter")
+        .def(py::init<const string &, const string &, float, const string &>(),
+            py::arg("logFormat"), py::arg("key"), py::arg("tau"), py::arg("content") = "Content")
+        .def("setMasking", &ParserRouter::setMasking,
+             "Masking rules shared by every partition parser",
+             py::arg("rules"))
+        .def("parse", &ParserRouter::parse,
+             "Parse full log lines, routing each one to the parser of its key field. "
+             "Returns the global cluster id of every line (-1 if the line does not fit the format)",
+             py::arg("lines"), py::arg("lastLineId") = 0, py::arg("threads") = 1,
+             py::call_guard<py::gil_scoped_release>())
+        .def("cluster", &ParserRouter::cluster, py::return_value_policy::copy,
+             "TemplateCluster of a global cluster id",
+             py::arg("clusterId"))
+        .def("partition", [](const ParserRouter &r, int clusterId) { return r.clusterIds.at(clusterId).first; },
+             "Key of the partition owning a global cluster id",
+             py::arg("clusterId"))
+        .def("__len__", [](const ParserRouter &r) { return r.clusterIds.size(); });
+
+    py::class_<MemoryUsage>(m, "MemoryUsage")
+        .def_readonly("trie", &MemoryUsage::trie)
+        .def_readonly("trieClusters", &MemoryUsage::trieClusters)
+        .def_readonly("templates", &MemoryUsage::templates)
+        .def_readonly("lineIds", &MemoryUsage::lineIds)
+        .def_readonly("postings", &MemoryUsage::postings)
+        .def_readonly("tokens", &MemoryUsage::tokens)
+        .def_readonly("caches", &MemoryUsage::caches)
+        .def_property_readonly("total", &MemoryUsage::total);
+
+    py::class_<PostingIndex>(m, "PostingIndex")
+        .def(py::init<>())
+        .def("__len__", &PostingIndex::clusters)
+        .def("lines", &PostingIndex::lines,
+             "Sorted line ids of a template in [first, last]",
+             py::arg("cluster"), py::arg("first") = INT_MIN, py::arg("last") = INT_MAX)
+        .def("count", &PostingIndex::count,
+             "Number of lines of a template in [first, last]",
+             py::arg("cluster"), py::arg("first") = INT_MIN, py::arg("last") = INT_MAX)
+        .def("countsSince", &PostingIndex::countsSince,
+             "Number of lines of every template after lineId",
+             py::arg("lineId"))
+        .def("intersect", &PostingIndex::intersect,
+             "Line ids in [first, last] present in the lists of all the given templates",
+             py::arg("clusters"), py::arg("first") = INT_MIN, py::arg("last") = INT_MAX);
+
+    py::class_<ColumnarReader>(m, "ColumnarReader")
+        .def(py::init<const string &>(), py::arg("path"))
+        .def("lastLineId", py::overload_cast<>(&ColumnarReader::lastLineId, py::const_))
+        .def("__len__", &ColumnarReader::rows)
+        .def("lineIds", [](const ColumnarReader &r) {
+                 vector<int> res;
+                 for (const auto &s : r.getSegments())
+                     res.insert(res.end(), s.lineIds, s.lineIds + s.rows);
+                 return res;
+             },
+             "LineId column of every segment")
+        .def("clusterIds", [](const ColumnarReader &r) {
+                 vector<int> res;
+                 for (const auto &s : r.getSegments())
+                     res.insert(res.end(), s.clusterIds, s.clusterIds + s.rows);
+                 return res;
+             },
+             "Cluster index column of every segment, -1 for lines without a cluster")
+        .def("parameters", [](const ColumnarReader &r) {
+                 vector<vector<string>> res;
+                 for (const auto &s : r.getSegments())
+                     for (size_t i = 0; i < s.rows; i++) {
+                         auto params = ColumnarReader::params(s, i);
+                         res.emplace_back(params.begin(), params.end());
+                     }
+                 return res;
+             },
+             "Parameter list of every line")
+        .def("templates", [](const ColumnarReader &r) {
+                 map<int, string> res;
+                 for (const auto &s : r.getSegments())
+                     for (size_t t = 0; t < s.templates; t++)
+                         res[s.templateIds[t]] = string(ColumnarReader::templateText(s, t));
+                 return res;
+             },
+             "Latest template of every cluster index")
+        .def("postings", [](const ColumnarReader &r) {
+                 PostingIndex res;
+                 for (const auto &s : r.getSegments())
+                     res.add(s.lineIds, s.clusterIds, s.rows);
+                 return res;
+             },
+             "PostingIndex of the cluster ids as written");
+    m.def("lastLineId", py::overload_cast<const string &>(&ColumnarReader::lastLineId),
+          "Last line id of a columnar file, read from its footer only",
+          py::arg("path"));
+
+    py::class_<Ingestor>(m, "Ingestor")
+        .def(py::init<Parser &, const string &, const string &>(),
+            py::arg("parser"), py::arg("logFormat"), py::arg("content") = "Content",
+            py::keep_alive<1, 2>())
+        .def_readonly("lastLineId", &Ingestor::lastLine)
+        .def("setCheckpoint", &Ingestor::setCheckpoint,
+             "Save parser state and position to path at the end of ingest and every everyLines lines "
+             "(0 means only at the end)",
+             py::arg("path"), py::arg("everyLines") = 0)
+        .def("restore", &Ingestor::restore,
+             "Resume from the checkpoint file. Returns False if there is none")
+        .def("checkpoint", &Ingestor::checkpoint,
+             "Save parser state and position now")
+        .def("ingest", &Ingestor::ingest,
+             "Parse the files of a list of paths or glob patterns in order, continuing line ids, "
+             "reading the next file ahead on a background thread. Returns the number of lines parsed",
+             py::arg("files"), py::call_guard<py::gil_scoped_release>())
+        .def_static("expand", &Ingestor::expand,
+             "Files matched by a list of glob patterns, in order",
+             py::arg("patterns"));
 
 }
\ No newline at end of file